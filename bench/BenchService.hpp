@@ -0,0 +1,11 @@
+#pragma once
+#include "RakService.hpp"
+
+// The argument shapes rakservice-bench measures, every function answers through its callbacks
+RAK_SERVICE(BenchService)
+{
+	virtual void empty(RakNet::ServiceCallback<void()> _done) = 0;
+	virtual void text(RakNet::ServiceStringView _text, RakNet::ServiceCallback<void(unsigned int)> _done) = 0;
+	virtual void blob(RakNet::ServiceBlob _blob, RakNet::ServiceCallback<void(unsigned int)> _done) = 0;
+	virtual void callbacks(int _value, RakNet::ServiceCallback<void(int)> _first, RakNet::ServiceCallback<void(int, int)> _second) = 0;
+};
@@ -0,0 +1,499 @@
+// rakservice-bench runs a client and a server RakServicePlugin over 127.0.0.1 in one process and
+// prints one JSON object per line for every argument shape of BenchService:
+//
+//	benchmark			the BenchService function that was called
+//	callsPerSecond		throughput with up to --window calls in flight
+//	p50Us, p99Us, p999Us	round trip latency of calls made one after another
+//	bytesPerCall		message bytes both peers sent per call, RakNet's headers and acks not included
+//	wireBytesPerCall	bytes both peers put on the wire per call
+//	allocationsPerCall	operator new calls of any form made by the thread that calls and pumps, RakNet's threads are not counted
+//
+// usage: rakservice-bench [--calls N] [--window N] [--text BYTES] [--blob BYTES] [--wire 1|2] [--batching] [--port PORT]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "MessageIdentifiers.h"
+#include "RakPeerInterface.h"
+#include "RakNetStatistics.h"
+
+#include "BenchService.hpp"
+
+using namespace RakNet;
+
+namespace {
+	thread_local std::size_t tAllocations = 0;
+
+	void* CountedAllocate(std::size_t _size) noexcept
+	{
+		++tAllocations;
+		return std::malloc(_size ? _size : 1);
+	}
+
+#if defined(__cpp_aligned_new)
+	// the pointer malloc returned is kept in front of the aligned block, so it can be freed without the alignment
+	void* CountedAllocateAligned(std::size_t _size, std::size_t _alignment) noexcept
+	{
+		++tAllocations;
+		void* memory = std::malloc(_size + _alignment + sizeof(void*));
+		if (!memory)
+			return nullptr;
+		const std::uintptr_t aligned = (reinterpret_cast<std::uintptr_t>(memory) + sizeof(void*) + _alignment - 1) & ~std::uintptr_t(_alignment - 1);
+		reinterpret_cast<void**>(aligned)[-1] = memory;
+		return reinterpret_cast<void*>(aligned);
+	}
+
+	void FreeAligned(void* _memory) noexcept
+	{
+		if (_memory)
+			std::free(static_cast<void**>(_memory)[-1]);
+	}
+#endif
+}
+
+// GCC pairs the free in the replaced deletes with the malloc inlined from the replaced news and reports
+// -Wmismatched-new-delete, although both sides of each pair are the ones defined here
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+// every replaceable form is counted, the array and nothrow ones do not have to go through operator new(size_t)
+void* operator new(std::size_t _size)
+{
+	if (void* memory = CountedAllocate(_size))
+		return memory;
+	throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t _size)
+{
+	if (void* memory = CountedAllocate(_size))
+		return memory;
+	throw std::bad_alloc();
+}
+
+void* operator new(std::size_t _size, const std::nothrow_t&) noexcept
+{
+	return CountedAllocate(_size);
+}
+
+void* operator new[](std::size_t _size, const std::nothrow_t&) noexcept
+{
+	return CountedAllocate(_size);
+}
+
+void operator delete(void* _memory) noexcept
+{
+	std::free(_memory);
+}
+
+void operator delete[](void* _memory) noexcept
+{
+	std::free(_memory);
+}
+
+void operator delete(void* _memory, std::size_t) noexcept
+{
+	std::free(_memory);
+}
+
+void operator delete[](void* _memory, std::size_t) noexcept
+{
+	std::free(_memory);
+}
+
+void operator delete(void* _memory, const std::nothrow_t&) noexcept
+{
+	std::free(_memory);
+}
+
+void operator delete[](void* _memory, const std::nothrow_t&) noexcept
+{
+	std::free(_memory);
+}
+
+#if defined(__cpp_aligned_new)
+void* operator new(std::size_t _size, std::align_val_t _alignment)
+{
+	if (void* memory = CountedAllocateAligned(_size, std::size_t(_alignment)))
+		return memory;
+	throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t _size, std::align_val_t _alignment)
+{
+	if (void* memory = CountedAllocateAligned(_size, std::size_t(_alignment)))
+		return memory;
+	throw std::bad_alloc();
+}
+
+void* operator new(std::size_t _size, std::align_val_t _alignment, const std::nothrow_t&) noexcept
+{
+	return CountedAllocateAligned(_size, std::size_t(_alignment));
+}
+
+void* operator new[](std::size_t _size, std::align_val_t _alignment, const std::nothrow_t&) noexcept
+{
+	return CountedAllocateAligned(_size, std::size_t(_alignment));
+}
+
+void operator delete(void* _memory, std::align_val_t) noexcept
+{
+	FreeAligned(_memory);
+}
+
+void operator delete[](void* _memory, std::align_val_t) noexcept
+{
+	FreeAligned(_memory);
+}
+
+void operator delete(void* _memory, std::size_t, std::align_val_t) noexcept
+{
+	FreeAligned(_memory);
+}
+
+void operator delete[](void* _memory, std::size_t, std::align_val_t) noexcept
+{
+	FreeAligned(_memory);
+}
+
+void operator delete(void* _memory, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	FreeAligned(_memory);
+}
+
+void operator delete[](void* _memory, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	FreeAligned(_memory);
+}
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+namespace {
+
+	typedef std::chrono::steady_clock Clock;
+
+	struct Options
+	{
+		unsigned int calls = 20000;
+		unsigned int window = 64;
+		std::size_t textBytes = 64;
+		std::size_t blobBytes = 64 * 1024;
+		unsigned char wireVersion = 1;
+		bool batching = false;
+		unsigned short port = 60100;
+	};
+
+	class BenchServiceImpl : public BenchService
+	{
+	public:
+		virtual void empty(ServiceCallback<void()> _done) override
+		{
+			_done();
+		}
+
+		virtual void text(ServiceStringView _text, ServiceCallback<void(unsigned int)> _done) override
+		{
+			_done(static_cast<unsigned int>(_text.size()));
+		}
+
+		virtual void blob(ServiceBlob _blob, ServiceCallback<void(unsigned int)> _done) override
+		{
+			_done(static_cast<unsigned int>(_blob.size()));
+		}
+
+		virtual void callbacks(int _value, ServiceCallback<void(int)> _first, ServiceCallback<void(int, int)> _second) override
+		{
+			_first(_value);
+			_second(_value, -_value);
+		}
+	};
+
+	struct Payload
+	{
+		std::string text;
+		std::vector<unsigned char> blob;
+	};
+
+	// issues one call that increments _completed when its last callback returns
+	typedef void(*IssueCall)(BenchService* _service, const Payload& _payload, unsigned int& _completed);
+
+	struct Benchmark
+	{
+		const char* name;
+		IssueCall issue;
+	};
+
+	const Benchmark Benchmarks[] =
+	{
+		{ "empty", [](BenchService* _service, const Payload&, unsigned int& _completed)
+			{
+				_service->empty([&_completed]() { ++_completed; });
+			}
+		},
+		{ "text", [](BenchService* _service, const Payload& _payload, unsigned int& _completed)
+			{
+				_service->text(ServiceStringView(_payload.text), [&_completed](unsigned int) { ++_completed; });
+			}
+		},
+		{ "blob", [](BenchService* _service, const Payload& _payload, unsigned int& _completed)
+			{
+				_service->blob(ServiceBlob::Borrow(_payload.blob.data(), _payload.blob.size()), [&_completed](unsigned int) { ++_completed; });
+			}
+		},
+		{ "callbacks", [](BenchService* _service, const Payload&, unsigned int& _completed)
+			{
+				_service->callbacks(7, [](int) {}, [&_completed](int, int) { ++_completed; });
+			}
+		},
+	};
+
+	class Loopback
+	{
+	public:
+		Loopback()
+			: mServer(RakPeerInterface::GetInstance())
+			, mClient(RakPeerInterface::GetInstance())
+			, mServerAddress(UNASSIGNED_SYSTEM_ADDRESS)
+			, mService(nullptr)
+		{
+		}
+
+		~Loopback()
+		{
+			mClient->Shutdown(100);
+			mServer->Shutdown(100);
+			mClient->DetachPlugin(&mClientPlugin);
+			mServer->DetachPlugin(&mServerPlugin);
+			RakPeerInterface::DestroyInstance(mClient);
+			RakPeerInterface::DestroyInstance(mServer);
+		}
+
+		bool start(const Options& _options)
+		{
+			mServer->AttachPlugin(&mServerPlugin);
+			mClient->AttachPlugin(&mClientPlugin);
+			for (auto* plugin : { &mServerPlugin, &mClientPlugin })
+			{
+				plugin->SetWireVersion(_options.wireVersion);
+				plugin->SetBatching(_options.batching);
+			}
+			mServerPlugin.AddService("bench", &mImpl);
+
+			SocketDescriptor serverSocket(_options.port, "127.0.0.1");
+			SocketDescriptor clientSocket;
+			if (mServer->Startup(1, &serverSocket, 1) != RAKNET_STARTED || mClient->Startup(1, &clientSocket, 1) != RAKNET_STARTED)
+				return false;
+			mServer->SetMaximumIncomingConnections(1);
+			if (mClient->Connect("127.0.0.1", _options.port, 0, 0) != CONNECTION_ATTEMPT_STARTED)
+				return false;
+
+			const auto deadline = Clock::now() + std::chrono::seconds(5);
+			while (!mService && Clock::now() < deadline)
+			{
+				pump();
+				if (mServerAddress != UNASSIGNED_SYSTEM_ADDRESS && !mConnecting)
+				{
+					mConnecting = true;
+					mClientPlugin.ConnectService<BenchService>("bench", mServerAddress, [this](BenchService* _service) { mService = _service; });
+				}
+			}
+			return mService != nullptr;
+		}
+
+		void pump()
+		{
+			while (Packet* packet = mServer->Receive())
+				mServer->DeallocatePacket(packet);
+
+			while (Packet* packet = mClient->Receive())
+			{
+				if (packet->data[0] == ID_CONNECTION_REQUEST_ACCEPTED)
+					mServerAddress = packet->systemAddress;
+				mClient->DeallocatePacket(packet);
+			}
+		}
+
+		// bytes both peers sent to each other so far
+		std::uint64_t sentBytes(RNSPerSecondMetrics _metric)
+		{
+			RakNetStatistics client, server;
+			std::uint64_t bytes = 0;
+			if (mClient->GetStatistics(mServerAddress, &client))
+				bytes += client.runningTotal[_metric];
+			if (mServer->GetStatistics(mServer->GetSystemAddressFromIndex(0), &server))
+				bytes += server.runningTotal[_metric];
+			return bytes;
+		}
+
+		inline BenchService* service() const { return mService; }
+
+	private:
+		RakPeerInterface* mServer;
+		RakPeerInterface* mClient;
+		RakServicePlugin mServerPlugin;
+		RakServicePlugin mClientPlugin;
+		BenchServiceImpl mImpl;
+		SystemAddress mServerAddress;
+		BenchService* mService;
+		bool mConnecting = false;
+	};
+
+	// calls that do not complete within this time fail the benchmark
+	const auto Timeout = std::chrono::seconds(60);
+
+	bool MeasureThroughput(Loopback& _loopback, const Benchmark& _benchmark, const Payload& _payload, const Options& _options, double& _seconds)
+	{
+		unsigned int issued = 0, completed = 0;
+		const auto start = Clock::now();
+		while (completed < _options.calls)
+		{
+			while (issued < _options.calls && issued - completed < _options.window)
+			{
+				_benchmark.issue(_loopback.service(), _payload, completed);
+				++issued;
+			}
+			_loopback.pump();
+			if (Clock::now() - start > Timeout)
+				return false;
+		}
+		_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		return true;
+	}
+
+	bool MeasureLatency(Loopback& _loopback, const Benchmark& _benchmark, const Payload& _payload, unsigned int _calls, std::vector<double>& _micros)
+	{
+		_micros.clear();
+		_micros.reserve(_calls);
+		unsigned int completed = 0;
+		for (unsigned int i = 0; i < _calls; ++i)
+		{
+			const auto start = Clock::now();
+			_benchmark.issue(_loopback.service(), _payload, completed);
+			while (completed <= i)
+			{
+				_loopback.pump();
+				if (Clock::now() - start > Timeout)
+					return false;
+			}
+			_micros.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+		}
+		std::sort(_micros.begin(), _micros.end());
+		return true;
+	}
+
+	double Percentile(const std::vector<double>& _sorted, double _percentile)
+	{
+		if (_sorted.empty())
+			return 0.0;
+		const std::size_t rank = static_cast<std::size_t>(_percentile / 100.0 * double(_sorted.size()) + 0.5);
+		return _sorted[std::min(_sorted.size() - 1, rank > 0 ? rank - 1 : 0)];
+	}
+
+	bool ParseOptions(int _argc, char** _argv, Options& _options)
+	{
+		for (int i = 1; i < _argc; ++i)
+		{
+			const char* arg = _argv[i];
+			if (std::strcmp(arg, "--batching") == 0)
+			{
+				_options.batching = true;
+				continue;
+			}
+			if (i + 1 >= _argc)
+				return false;
+
+			const unsigned long value = std::strtoul(_argv[++i], nullptr, 10);
+			if (std::strcmp(arg, "--calls") == 0 && value > 0)
+				_options.calls = static_cast<unsigned int>(value);
+			else if (std::strcmp(arg, "--window") == 0 && value > 0)
+				_options.window = static_cast<unsigned int>(value);
+			else if (std::strcmp(arg, "--text") == 0 && value <= 0xFFFF)
+				_options.textBytes = value;
+			else if (std::strcmp(arg, "--blob") == 0)
+				_options.blobBytes = value;
+			else if (std::strcmp(arg, "--wire") == 0 && (value == 1 || value == 2))
+				_options.wireVersion = static_cast<unsigned char>(value);
+			else if (std::strcmp(arg, "--port") == 0 && value > 0 && value <= 0xFFFF)
+				_options.port = static_cast<unsigned short>(value);
+			else
+				return false;
+		}
+		return true;
+	}
+}
+
+int main(int _argc, char** _argv)
+{
+	Options options;
+	if (!ParseOptions(_argc, _argv, options))
+	{
+		std::fprintf(stderr, "usage: rakservice-bench [--calls N] [--window N] [--text BYTES] [--blob BYTES] [--wire 1|2] [--batching] [--port PORT]\n");
+		return 2;
+	}
+
+	Loopback loopback;
+	if (!loopback.start(options))
+	{
+		std::fprintf(stderr, "could not connect to 127.0.0.1:%u\n", unsigned(options.port));
+		return 1;
+	}
+
+	Payload payload;
+	payload.text.assign(options.textBytes, 'x');
+	payload.blob.assign(options.blobBytes, 0x5A);
+
+	const unsigned int latencyCalls = std::min(options.calls, 5000u);
+	std::vector<double> micros;
+	int result = 0;
+	for (const Benchmark& benchmark : Benchmarks)
+	{
+		// warm up the stream pool, the return slots and RakNet's buffers
+		double seconds = 0.0;
+		Options warmup = options;
+		warmup.calls = std::min(options.calls, 1000u);
+		if (!MeasureThroughput(loopback, benchmark, payload, warmup, seconds))
+		{
+			std::printf("{\"benchmark\":\"%s\",\"error\":\"timeout\"}\n", benchmark.name);
+			result = 1;
+			continue;
+		}
+
+		const std::uint64_t bytesBefore = loopback.sentBytes(USER_MESSAGE_BYTES_SENT);
+		const std::uint64_t wireBefore = loopback.sentBytes(ACTUAL_BYTES_SENT);
+		const std::size_t allocationsBefore = tAllocations;
+		const bool measured = MeasureThroughput(loopback, benchmark, payload, options, seconds);
+		const std::size_t allocations = tAllocations - allocationsBefore;
+		// what is still in RakNet's send buffers is counted by the latency run that follows
+		const std::uint64_t bytes = loopback.sentBytes(USER_MESSAGE_BYTES_SENT) - bytesBefore;
+		const std::uint64_t wire = loopback.sentBytes(ACTUAL_BYTES_SENT) - wireBefore;
+
+		if (!measured || !MeasureLatency(loopback, benchmark, payload, latencyCalls, micros))
+		{
+			std::printf("{\"benchmark\":\"%s\",\"error\":\"timeout\"}\n", benchmark.name);
+			result = 1;
+			continue;
+		}
+
+		std::printf("{\"benchmark\":\"%s\",\"calls\":%u,\"window\":%u,\"textBytes\":%u,\"blobBytes\":%u,\"wireVersion\":%u,\"batching\":%s,"
+			"\"seconds\":%.6f,\"callsPerSecond\":%.1f,\"p50Us\":%.1f,\"p99Us\":%.1f,\"p999Us\":%.1f,"
+			"\"bytesPerCall\":%.1f,\"wireBytesPerCall\":%.1f,\"allocationsPerCall\":%.2f}\n",
+			benchmark.name, options.calls, options.window, unsigned(options.textBytes), unsigned(options.blobBytes), unsigned(options.wireVersion), options.batching ? "true" : "false",
+			seconds, double(options.calls) / seconds, Percentile(micros, 50.0), Percentile(micros, 99.0), Percentile(micros, 99.9),
+			double(bytes) / options.calls, double(wire) / options.calls, double(allocations) / options.calls);
+		std::fflush(stdout);
+	}
+
+	return result;
+}
@@ -0,0 +1,22 @@
+# rakservice_generate(<target> <header>...)
+#
+# Parses the RAK_SERVICE interfaces declared in the given headers and adds the generated
+# proxies, function ids, meta info, _Invoke and _CreateClientImplementation to <target>.
+# The sources are regenerated whenever a header changes.
+
+set(RAKSERVICE_GENERATOR_SCRIPT ${CMAKE_CURRENT_LIST_DIR}/RakServiceGenerator.cmake)
+
+function(rakservice_generate _target)
+	foreach(_header ${ARGN})
+		get_filename_component(_input ${_header} ABSOLUTE)
+		get_filename_component(_name ${_header} NAME_WE)
+		set(_output ${CMAKE_CURRENT_BINARY_DIR}/${_name}.rakservice.cpp)
+
+		add_custom_command(OUTPUT ${_output}
+			COMMAND ${CMAKE_COMMAND} -DRAKSERVICE_INPUT=${_input} -DRAKSERVICE_OUTPUT=${_output} -P ${RAKSERVICE_GENERATOR_SCRIPT}
+			DEPENDS ${_input} ${RAKSERVICE_GENERATOR_SCRIPT}
+			COMMENT "Generating RakService stubs for ${_name}")
+
+		set_property(TARGET ${_target} APPEND PROPERTY SOURCES ${_output})
+	endforeach()
+endfunction()
@@ -0,0 +1,264 @@
+# Generates the RakService stubs of one header, run by rakservice_generate in script mode:
+#
+#	cmake -DRAKSERVICE_INPUT=<header> -DRAKSERVICE_OUTPUT=<source> -P RakServiceGenerator.cmake
+#
+# Understood declarations:
+#
+#	RAK_SERVICE(Chat)
+#	{
+#		virtual void get(int _x, RakNet::ServiceCallback<void(int)> _done) = 0;
+#		RAK_ONEWAY virtual void say(RakNet::RakString _text) = 0;
+#		RAK_SEND_OPTIONS(LOW_PRIORITY, UNRELIABLE_SEQUENCED) virtual void move(float _x, float _y) = 0;
+#	};
+#
+# Services have to be declared in the global namespace and contain nothing but pure virtual
+# functions returning void. Function ids are assigned in declaration order.
+
+foreach(_policy CMP0007 CMP0012 CMP0054)
+	if(POLICY ${_policy})
+		cmake_policy(SET ${_policy} NEW)
+	endif()
+endforeach()
+
+if(NOT RAKSERVICE_INPUT OR NOT RAKSERVICE_OUTPUT)
+	message(FATAL_ERROR "RAKSERVICE_INPUT and RAKSERVICE_OUTPUT have to be set")
+endif()
+
+set(_ws "[ \t\r\n]")
+set(_identifier "[A-Za-z_][A-Za-z0-9_]*")
+# stands in for ';' while the header is handled as one string, cmake would split it into a list otherwise
+set(_semicolon "@RAKSERVICE_SEMICOLON@")
+
+function(_rakservice_normalize _var _text)
+	string(REGEX REPLACE "[ \t\r\n]+" " " _text "${_text}")
+	string(STRIP "${_text}" _text)
+	set(${_var} "${_text}" PARENT_SCOPE)
+endfunction()
+
+# splits a parameter list at the commas that are not nested in <>, () or []
+function(_rakservice_split_params _var _text)
+	set(_params)
+	set(_current "")
+	set(_depth 0)
+	string(LENGTH "${_text}" _length)
+	set(_i 0)
+	while(_i LESS _length)
+		string(SUBSTRING "${_text}" ${_i} 1 _c)
+		if("${_c}" STREQUAL "<" OR "${_c}" STREQUAL "(" OR "${_c}" STREQUAL "[")
+			math(EXPR _depth "${_depth} + 1")
+		elseif("${_c}" STREQUAL ">" OR "${_c}" STREQUAL ")" OR "${_c}" STREQUAL "]")
+			math(EXPR _depth "${_depth} - 1")
+		endif()
+
+		if("${_c}" STREQUAL "," AND _depth EQUAL 0)
+			list(APPEND _params "${_current}")
+			set(_current "")
+		else()
+			set(_current "${_current}${_c}")
+		endif()
+		math(EXPR _i "${_i} + 1")
+	endwhile()
+
+	_rakservice_normalize(_current "${_current}")
+	if(NOT "${_current}" STREQUAL "" AND NOT "${_current}" STREQUAL "void")
+		list(APPEND _params "${_current}")
+	endif()
+	set(${_var} "${_params}" PARENT_SCOPE)
+endfunction()
+
+# splits "Type name" into its type and name, unnamed parameters are called _arg<index>
+function(_rakservice_split_param _typeVar _nameVar _param _index)
+	_rakservice_normalize(_param "${_param}")
+	string(REGEX REPLACE "=.*$" "" _param "${_param}")
+	_rakservice_normalize(_param "${_param}")
+
+	set(_type "${_param}")
+	set(_name "_arg${_index}")
+	if("${_param}" MATCHES "^(.*[^A-Za-z0-9_:])(${_identifier})$")
+		set(_candidateType "${CMAKE_MATCH_1}")
+		set(_candidateName "${CMAKE_MATCH_2}")
+		_rakservice_normalize(_candidateType "${_candidateType}")
+		set(_keywords bool char short int long float double unsigned signed const volatile)
+		list(FIND _keywords "${_candidateName}" _isKeyword)
+		if(_isKeyword EQUAL -1 AND NOT "${_candidateType}" MATCHES "^((const|volatile|unsigned|signed) ?)*$")
+			set(_type "${_candidateType}")
+			set(_name "${_candidateName}")
+		endif()
+	endif()
+
+	set(${_typeVar} "${_type}" PARENT_SCOPE)
+	set(${_nameVar} "${_name}" PARENT_SCOPE)
+endfunction()
+
+file(READ "${RAKSERVICE_INPUT}" _content)
+string(REPLACE ";" "${_semicolon}" _content "${_content}")
+
+# block comments
+while(TRUE)
+	string(FIND "${_content}" "/*" _begin)
+	if(_begin EQUAL -1)
+		break()
+	endif()
+	string(SUBSTRING "${_content}" ${_begin} -1 _rest)
+	string(FIND "${_rest}" "*/" _end)
+	if(_end EQUAL -1)
+		message(FATAL_ERROR "${RAKSERVICE_INPUT}: unterminated comment")
+	endif()
+	math(EXPR _end "${_end} + 2")
+	string(SUBSTRING "${_content}" 0 ${_begin} _head)
+	string(SUBSTRING "${_rest}" ${_end} -1 _tail)
+	set(_content "${_head} ${_tail}")
+endwhile()
+
+# line comments and preprocessor directives
+string(REGEX REPLACE "//[^\n]*" "" _content "${_content}")
+string(REGEX REPLACE "(^|\n)[ \t]*#[^\n]*" "\n" _content "${_content}")
+
+get_filename_component(_headerName "${RAKSERVICE_INPUT}" NAME)
+set(_out "// Generated by rakservice_generate from ${_headerName}, do not edit.\n")
+set(_out "${_out}#include \"${RAKSERVICE_INPUT}\"\n")
+
+set(_serviceRegex "RAK_SERVICE${_ws}*\\(${_ws}*(${_identifier})${_ws}*\\)[^{]*{([^}]*)}")
+set(_serviceCount 0)
+
+while(TRUE)
+	string(REGEX MATCH "${_serviceRegex}" _match "${_content}")
+	if("${_match}" STREQUAL "")
+		break()
+	endif()
+	set(_service "${CMAKE_MATCH_1}")
+	set(_body "${CMAKE_MATCH_2}")
+	string(FIND "${_content}" "${_match}" _position)
+	string(LENGTH "${_match}" _matchLength)
+	math(EXPR _position "${_position} + ${_matchLength}")
+	string(SUBSTRING "${_content}" ${_position} -1 _content)
+	math(EXPR _serviceCount "${_serviceCount} + 1")
+
+	set(_impl "_${_service}NetworkImpl")
+	set(_ids "")
+	set(_methods "")
+	set(_metaEntries "")
+	set(_thunks "")
+	set(_functionCount 0)
+
+	string(REPLACE "${_semicolon}" ";" _statements "${_body}")
+	foreach(_statement ${_statements})
+		_rakservice_normalize(_statement "${_statement}")
+		string(REGEX REPLACE "(public|protected|private) ?:" "" _statement "${_statement}")
+		_rakservice_normalize(_statement "${_statement}")
+		if(NOT "${_statement}" STREQUAL "")
+			if(NOT "${_statement}" MATCHES "^(.*)virtual void (${_identifier}) ?\\((.*)\\) ?= ?0$")
+				message(FATAL_ERROR "${RAKSERVICE_INPUT}: ${_service} may only declare pure virtual functions returning void, found '${_statement}'")
+			endif()
+			set(_annotations "${CMAKE_MATCH_1}")
+			set(_function "${CMAKE_MATCH_2}")
+			set(_paramText "${CMAKE_MATCH_3}")
+
+			set(_oneWay "false")
+			if("${_annotations}" MATCHES "RAK_ONEWAY")
+				set(_oneWay "true")
+			endif()
+			set(_sendOptions "")
+			if("${_annotations}" MATCHES "RAK_SEND_OPTIONS ?\\(([^)]*)\\)")
+				set(_sendOptions "${CMAKE_MATCH_1}")
+			endif()
+
+			_rakservice_split_params(_params "${_paramText}")
+			set(_declaration "")
+			set(_signature "")
+			set(_names "")
+			set(_addArgs "")
+			set(_index 0)
+			foreach(_param ${_params})
+				_rakservice_split_param(_type _name "${_param}" ${_index})
+				if(_oneWay STREQUAL "true" AND "${_type}" MATCHES "(ServiceCallback|std::function|InplaceFunction) ?<")
+					message(FATAL_ERROR "${RAKSERVICE_INPUT}: ${_service}::${_function} is RAK_ONEWAY and must not take the callback '${_param}'")
+				endif()
+				if(_index GREATER 0)
+					set(_declaration "${_declaration}, ")
+					set(_signature "${_signature}, ")
+					set(_names "${_names}, ")
+				endif()
+				set(_declaration "${_declaration}${_type} ${_name}")
+				set(_signature "${_signature}${_type} ${_name}")
+				set(_names "${_names}${_name}")
+				set(_addArgs "${_addArgs}\t\t_AddArg(sargs, std::move(${_name}))${_semicolon}\n")
+				math(EXPR _index "${_index} + 1")
+			endforeach()
+			string(REPLACE "\"" "\\\"" _signature "${_signature}")
+
+			set(_id "::RakNet::ServiceFunctionId(FunctionIds::FUNC_${_function})")
+			set(_ids "${_ids}\t\tFUNC_${_function} = ${_functionCount},\n")
+
+			set(_methods "${_methods}\tvirtual void ${_function}(${_declaration}) override\n\t{\n")
+			set(_methods "${_methods}\t\tauto* plugin = GetServiceController().GetRakServicePlugin()${_semicolon}\n")
+			set(_methods "${_methods}\t\tauto stream = plugin->_AcquireStream()${_semicolon}\n")
+			set(_methods "${_methods}\t\tstream->AddBitsAndReallocate(::RakNet::detail::CallHeaderBits + ::RakNet::detail::SerializedBits(${_names}))${_semicolon}\n")
+			set(_methods "${_methods}\t\t::RakNet::detail::SerializationArgs sargs(*stream, plugin)${_semicolon}\n")
+			set(_methods "${_methods}\t\t_BeginCall(sargs, ${_id})${_semicolon}\n")
+			set(_methods "${_methods}${_addArgs}")
+			set(_methods "${_methods}\t\t_EndCall(*stream, ${_id}, mForeignTargetAddress)${_semicolon}\n\t}\n\n")
+
+			set(_entry "\t\t{ ::RakNet::ServiceFunctionId(${_impl}::FunctionIds::FUNC_${_function}), \"${_function}\", \"${_signature}\"")
+			if(NOT "${_sendOptions}" STREQUAL "" OR _oneWay STREQUAL "true")
+				set(_entry "${_entry}, ::RakNet::RakServiceSendOptions(${_sendOptions}), ${_oneWay}")
+			endif()
+			if(_functionCount GREATER 0)
+				set(_metaEntries "${_metaEntries},\n")
+				set(_thunks "${_thunks},\n")
+			endif()
+			set(_metaEntries "${_metaEntries}${_entry} }")
+			if(_oneWay STREQUAL "true")
+				set(_thunks "${_thunks}\t\tRAKSERVICE_ONEWAY_METHOD(${_service}, ${_function})")
+			else()
+				set(_thunks "${_thunks}\t\tRAKSERVICE_METHOD(${_service}, ${_function})")
+			endif()
+
+			math(EXPR _functionCount "${_functionCount} + 1")
+		endif()
+	endforeach()
+
+	if(_functionCount EQUAL 0)
+		message(FATAL_ERROR "${RAKSERVICE_INPUT}: ${_service} declares no functions")
+	endif()
+
+	# proxy
+	set(_out "${_out}\n\nclass ${_impl} : public ${_service}\n{\npublic:\n")
+	set(_out "${_out}\tenum class FunctionIds : ::RakNet::ServiceFunctionId\n\t{\n${_ids}\t\tFUNCTION_COUNT\n\t}${_semicolon}\npublic:\n")
+	set(_out "${_out}\t${_impl}(const ::RakNet::SystemAddress& _address)\n\t\t: mForeignTargetAddress(_address)\n\t{\n\t}\n\n")
+	set(_out "${_out}${_methods}")
+	set(_out "${_out}\tvirtual bool _IsForeignService() const override\n\t{\n\t\treturn true${_semicolon}\n\t}\n\n")
+	set(_out "${_out}private:\n\t::RakNet::SystemAddress mForeignTargetAddress${_semicolon}\n}${_semicolon}\n\n")
+
+	# meta info
+	set(_out "${_out}namespace ${_service}_MetaInfoContent\n{\n")
+	set(_out "${_out}\t::RakNet::RakServiceFunctionMetaInfo ${_service}Functions[] =\n\t{\n${_metaEntries}\n\t}${_semicolon}\n\n")
+	set(_out "${_out}\t::RakNet::RakServiceMetaInfo ${_service}MetaInfo =\n\t{\n\t\t\"${_service}\",\n\t\t${_service}Functions,\n")
+	set(_out "${_out}\t\t${_service}Functions + ::RakNet::ServiceFunctionId(${_impl}::FunctionIds::FUNCTION_COUNT)\n\t}${_semicolon}\n}\n\n")
+	set(_out "${_out}template<>\n::RakNet::RakServiceMetaInfo* ::RakNet::GenericRakService<${_service}>::MetaInfo()\n{\n")
+	set(_out "${_out}\treturn &${_service}_MetaInfoContent::${_service}MetaInfo${_semicolon}\n}\n\n")
+
+	# invoker
+	set(_out "${_out}template<>\nbool ::RakNet::GenericRakService<${_service}>::_Invoke(::RakNet::detail::DeserializationArgs& _stream, ::RakNet::ServiceFunctionId _func)\n{\n")
+	set(_out "${_out}\ttypedef ::RakNet::detail::ServiceDispatchTable<${_service},\n${_thunks}\n\t> DispatchTable${_semicolon}\n\n")
+	set(_out "${_out}\treturn DispatchTable::Invoke(static_cast<${_service}*>(this), _stream, _func)${_semicolon}\n}\n\n")
+
+	# factory
+	set(_out "${_out}template<>\n${_service}* ::RakNet::GenericRakService<${_service}>::_CreateClientImplementation(const ::RakNet::SystemAddress& addr)\n{\n")
+	set(_out "${_out}\treturn new ${_impl}(addr)${_semicolon}\n}\n")
+endwhile()
+
+if(_serviceCount EQUAL 0)
+	message(WARNING "${RAKSERVICE_INPUT} declares no RAK_SERVICE")
+endif()
+
+string(REPLACE "${_semicolon}" ";" _out "${_out}")
+
+# keep the timestamp if nothing changed, so dependent objects are not rebuilt
+set(_previous "")
+if(EXISTS "${RAKSERVICE_OUTPUT}")
+	file(READ "${RAKSERVICE_OUTPUT}" _previous)
+endif()
+if(NOT "${_previous}" STREQUAL "${_out}")
+	file(WRITE "${RAKSERVICE_OUTPUT}" "${_out}")
+endif()
@@ -3,26 +3,496 @@
 #define _RAKNET_RAKSERVICE_HPP
 
 
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <new>
+#include <type_traits>
 #include <functional>
 #include <memory>
 #include <unordered_map>
 #include <tuple>
+#include <vector>
+#include <algorithm>
 #include <forward_list>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <thread>
 
 #include "PluginInterface2.h"
 #include "BitStream.h"
+#include "RakServiceMetrics.hpp"
+#include "RakServiceSharedMemory.hpp"
+
+// Inline storage of ServiceCallback in bytes.
+// Large enough for the closure that answers a call (plugin, return slot and SystemAddress).
+#ifndef RAKSERVICE_CALLBACK_CAPACITY
+#define RAKSERVICE_CALLBACK_CAPACITY 64
+#endif
 
 namespace RakNet {
 
 	class RakService;
 	class RakServicePlugin;
+	class RakServiceMetaInfo;
 	class NetworkIDManager;
+	template<typename ServiceType>
+	class GenericRakService;
 	typedef unsigned char ServiceFunctionId;
 	typedef unsigned short RakServiceId;
 
+	// How the messages of a service function are sent
+	struct RakServiceSendOptions
+	{
+		// use the channel the RakServicePlugin was created with
+		static const char DefaultChannel = -1;
+
+		inline RakServiceSendOptions(PacketPriority _priority = HIGH_PRIORITY, PacketReliability _reliability = RELIABLE_ORDERED, char _channel = DefaultChannel)
+			: priority(_priority)
+			, reliability(_reliability)
+			, channel(_channel)
+		{
+		}
+
+		inline bool operator==(const RakServiceSendOptions& _other) const
+		{
+			return priority == _other.priority && reliability == _other.reliability && channel == _other.channel;
+		}
+
+		PacketPriority priority;
+		PacketReliability reliability;
+		char channel;
+	};
+
+	// Binary argument that is written with a single bulk copy.
+	// Blobs above the plugin's streaming threshold (see RakServicePlugin::SetStreaming) are sent in
+	// chunks ahead of their call and handed to the receiver in the buffer they were reassembled in.
+	class ServiceBlob
+	{
+	public:
+		typedef std::shared_ptr<const std::vector<unsigned char>> Buffer;
+
+	public:
+		inline ServiceBlob()
+			: mData(nullptr)
+			, mSize(0)
+		{
+		}
+
+		// copies _size bytes of _data
+		ServiceBlob(const void* _data, std::size_t _size);
+
+		// shares _buffer, it is never copied by the plugin
+		explicit ServiceBlob(Buffer _buffer);
+
+		// Refers to memory that has to stay valid until the call it is passed to returns.
+		// Only a streamed blob needs the bytes longer, it takes a copy then.
+		static ServiceBlob Borrow(const void* _data, std::size_t _size);
+
+		inline const unsigned char* data() const { return mData; }
+		inline std::size_t size() const { return mSize; }
+		inline bool empty() const { return mSize == 0; }
+		inline bool owned() const { return mBuffer || mSize == 0; }
+
+		// copies borrowed bytes into a buffer of its own
+		ServiceBlob& own();
+
+	private:
+		Buffer mBuffer;
+		const unsigned char* mData;
+		std::size_t mSize;
+	};
+
+	// View parameters refer to the bytes of the packet they were received with instead of copying them,
+	// so they are only valid until the service function or callback returns. Invocations handed to a
+	// RakServiceDispatcher copy the viewed bytes first and the view refers to that copy.
+
+	// Characters of a string, sent like a RakString
+	class ServiceStringView
+	{
+	public:
+		inline ServiceStringView()
+			: mData(""), mSize(0) {}
+		inline ServiceStringView(const char* _str)
+			: mData(_str), mSize(std::strlen(_str)) {}
+		inline ServiceStringView(const char* _data, std::size_t _size)
+			: mData(_data), mSize(_size) {}
+		inline ServiceStringView(const std::string& _str)
+			: mData(_str.data()), mSize(_str.size()) {}
+		inline ServiceStringView(const RakString& _str)
+			: mData(_str.C_String()), mSize(_str.GetLength()) {}
+
+		inline const char* data() const { return mData; }
+		inline std::size_t size() const { return mSize; }
+		inline bool empty() const { return mSize == 0; }
+		inline const char* begin() const { return mData; }
+		inline const char* end() const { return mData + mSize; }
+		inline std::string str() const { return std::string(mData, mSize); }
+
+		inline bool operator==(const ServiceStringView& _other) const
+		{
+			return mSize == _other.mSize && std::memcmp(mData, _other.mData, mSize) == 0;
+		}
+		inline bool operator!=(const ServiceStringView& _other) const { return !(*this == _other); }
+
+	private:
+		const char* mData;
+		std::size_t mSize;
+	};
+
+	// Name of a welcome service together with its hash. Names that are connected often can be kept
+	// as ServiceName, so they are hashed once. Does not copy the name.
+	class ServiceName
+	{
+	public:
+		inline ServiceName(const char* _name)
+			: ServiceName(_name, std::strlen(_name)) {}
+		inline ServiceName(const std::string& _name)
+			: ServiceName(_name.data(), _name.size()) {}
+		inline ServiceName(const char* _data, std::size_t _size)
+			: mData(_data), mSize(_size), mHash(Hash(_data, _size)) {}
+
+		inline const char* data() const { return mData; }
+		inline std::size_t size() const { return mSize; }
+		inline unsigned int hash() const { return mHash; }
+		inline ServiceStringView view() const { return ServiceStringView(mData, mSize); }
+
+		// 32 bit FNV-1a, the same on every platform
+		static inline unsigned int Hash(const char* _data, std::size_t _size)
+		{
+			unsigned int hash = 2166136261u;
+			for (std::size_t i = 0; i < _size; ++i)
+				hash = (hash ^ static_cast<unsigned char>(_data[i])) * 16777619u;
+			return hash;
+		}
+
+	private:
+		const char* mData;
+		std::size_t mSize;
+		unsigned int mHash;
+	};
+
+	// Bytes sent like a ServiceBlob that is never streamed
+	class ServiceByteSpan
+	{
+	public:
+		inline ServiceByteSpan()
+			: mData(nullptr), mSize(0) {}
+		inline ServiceByteSpan(const void* _data, std::size_t _size)
+			: mData(static_cast<const unsigned char*>(_data)), mSize(_size) {}
+		inline ServiceByteSpan(const std::vector<unsigned char>& _bytes)
+			: mData(_bytes.data()), mSize(_bytes.size()) {}
+		inline ServiceByteSpan(const ServiceBlob& _blob)
+			: mData(_blob.data()), mSize(_blob.size()) {}
+
+		inline const unsigned char* data() const { return mData; }
+		inline std::size_t size() const { return mSize; }
+		inline bool empty() const { return mSize == 0; }
+		inline const unsigned char* begin() const { return mData; }
+		inline const unsigned char* end() const { return mData + mSize; }
+
+	private:
+		const unsigned char* mData;
+		std::size_t mSize;
+	};
+
+	// Base of argument types that write themselves with a fixed number of bits.
+	// Derived types provide static const BitSize_t Bits, void pack(BitStream&) const and bool unpack(BitStream&).
+	struct PackedValue {};
+
+	namespace detail {
+
+		inline constexpr BitSize_t BitsForRange(unsigned long long _range)
+		{
+			return _range == 0 ? 0 : 1 + BitsForRange(_range >> 1);
+		}
+
+		// writes the lowest _bits of _value, most significant first
+		inline void WritePackedBits(BitStream& _stream, unsigned long long _value, BitSize_t _bits)
+		{
+			unsigned char bytes[sizeof(_value)];
+			const BitSize_t byteCount = (_bits + 7) / 8;
+			for (BitSize_t i = 0; i < byteCount; ++i)
+				bytes[i] = static_cast<unsigned char>(_value >> (8 * (byteCount - 1 - i)));
+
+			// the partial byte comes first, right aligned
+			const BitSize_t partial = _bits % 8;
+			if (partial)
+				_stream.WriteBits(bytes, partial, true);
+			if (_bits >= 8)
+				_stream.WriteBits(bytes + (partial ? 1 : 0), 8 * (_bits / 8), true);
+		}
+
+		inline bool ReadPackedBits(BitStream& _stream, unsigned long long& _value, BitSize_t _bits)
+		{
+			unsigned char bytes[sizeof(_value)] = {};
+			const BitSize_t partial = _bits % 8;
+			if (partial && !_stream.ReadBits(bytes, partial, true))
+				return false;
+			if (_bits >= 8 && !_stream.ReadBits(bytes + (partial ? 1 : 0), 8 * (_bits / 8), true))
+				return false;
+
+			_value = 0;
+			for (BitSize_t i = 0; i < (_bits + 7) / 8; ++i)
+				_value = (_value << 8) | bytes[i];
+			return true;
+		}
+	}
+
+	// Integer in [Min, Max] that is sent with just enough bits for its range
+	template<long long Min, long long Max>
+	class RangedInt : public PackedValue
+	{
+		static_assert(Min < Max, "RangedInt needs a range");
+	public:
+		static const BitSize_t Bits = detail::BitsForRange(static_cast<unsigned long long>(Max) - static_cast<unsigned long long>(Min));
+
+		// values outside the range are clamped
+		inline RangedInt(long long _value = Min)
+			: mValue(_value < Min ? Min : (_value > Max ? Max : _value))
+		{
+		}
+
+		inline operator long long() const { return mValue; }
+		inline long long value() const { return mValue; }
+
+		inline void pack(BitStream& _stream) const
+		{
+			detail::WritePackedBits(_stream, static_cast<unsigned long long>(mValue) - static_cast<unsigned long long>(Min), Bits);
+		}
+
+		inline bool unpack(BitStream& _stream)
+		{
+			unsigned long long offset;
+			if (!detail::ReadPackedBits(_stream, offset, Bits))
+				return false;
+			*this = RangedInt(static_cast<long long>(offset + static_cast<unsigned long long>(Min)));
+			return true;
+		}
+
+	private:
+		long long mValue;
+	};
+
+	// Float in [Min, Max] that is sent as one of 2^BitCount evenly spaced steps
+	template<int Min, int Max, BitSize_t BitCount>
+	class QuantizedFloat : public PackedValue
+	{
+		static_assert(Min < Max, "QuantizedFloat needs a range");
+		static_assert(BitCount > 0 && BitCount <= 32, "QuantizedFloat is sent with 1 to 32 bits");
+	public:
+		static const BitSize_t Bits = BitCount;
+
+		inline QuantizedFloat(float _value = float(Min))
+			: mValue(_value < Min ? float(Min) : (_value > Max ? float(Max) : _value))
+		{
+		}
+
+		inline operator float() const { return mValue; }
+		inline float value() const { return mValue; }
+
+		inline void pack(BitStream& _stream) const
+		{
+			const double normalized = (double(mValue) - Min) / (double(Max) - Min);
+			detail::WritePackedBits(_stream, static_cast<unsigned long long>(normalized * Steps + 0.5), Bits);
+		}
+
+		inline bool unpack(BitStream& _stream)
+		{
+			unsigned long long step;
+			if (!detail::ReadPackedBits(_stream, step, Bits))
+				return false;
+			*this = QuantizedFloat(static_cast<float>(Min + (double(Max) - Min) * double(step) / Steps));
+			return true;
+		}
+
+	private:
+		static constexpr double Steps = double((1ull << Bits) - 1);
+
+		float mValue;
+	};
+
+	template<int Min, int Max, BitSize_t BitCount>
+	constexpr double QuantizedFloat<Min, Max, BitCount>::Steps;
+
 	namespace detail {
 
-		typedef unsigned short ReturnSlotId;
+		// lower bits index the slot table, upper bits carry the slot's generation
+		typedef unsigned int ReturnSlotId;
+
+		// Wire formats. Version 2 packs the message header into a single byte and writes
+		// ids and integer arguments as varints, see RakServicePlugin::SetWireVersion.
+		static const unsigned char WireVersion1 = 1;
+		static const unsigned char WireVersion2 = 2;
+
+		// Return slots take 16 bits in version 1 messages like they did before there were versions,
+		// see ReturnSlotTable::compact(), and all 32 bits in version 2 messages
+		inline void WriteReturnSlotId(BitStream& _stream, ReturnSlotId _id, unsigned char _version)
+		{
+			if (_version >= WireVersion2)
+				_stream.Write(_id);
+			else
+				_stream.Write(static_cast<unsigned short>(_id));
+		}
+
+		inline bool ReadReturnSlotId(BitStream& _stream, ReturnSlotId& _id, unsigned char _version)
+		{
+			if (_version >= WireVersion2)
+				return _stream.Read(_id);
+
+			unsigned short id;
+			if (!_stream.Read(id))
+				return false;
+			_id = id;
+			return true;
+		}
+
+		inline void WriteVarint(BitStream& _stream, unsigned long long _value)
+		{
+			while (_value >= 0x80)
+			{
+				_stream.Write(static_cast<unsigned char>(_value | 0x80));
+				_value >>= 7;
+			}
+			_stream.Write(static_cast<unsigned char>(_value));
+		}
+
+		inline bool ReadVarint(BitStream& _stream, unsigned long long& _value)
+		{
+			_value = 0;
+			for (unsigned int shift = 0; shift < 64; shift += 7)
+			{
+				unsigned char byte;
+				if (!_stream.Read(byte))
+					return false;
+				_value |= static_cast<unsigned long long>(byte & 0x7F) << shift;
+				if (!(byte & 0x80))
+					return true;
+			}
+			return false;
+		}
+
+		// integers wider than a byte and enums are varints in version 2, signed ones zigzag encoded
+		template<typename T>
+		struct is_varint : std::integral_constant<bool, std::is_enum<T>::value
+			|| (std::is_integral<T>::value && !std::is_same<T, bool>::value && sizeof(T) > 1)> {};
+
+		template<typename T>
+		struct VarintCodec
+		{
+			typedef typename std::conditional<std::is_enum<T>::value, std::underlying_type<T>, std::enable_if<true, T>>::type::type integer;
+
+			static inline unsigned long long encode(T _value, std::true_type /*signed*/)
+			{
+				const long long value = static_cast<long long>(static_cast<integer>(_value));
+				return (static_cast<unsigned long long>(value) << 1) ^ static_cast<unsigned long long>(value >> 63);
+			}
+
+			static inline unsigned long long encode(T _value, std::false_type)
+			{
+				return static_cast<unsigned long long>(static_cast<integer>(_value));
+			}
+
+			static inline T decode(unsigned long long _value, std::true_type /*signed*/)
+			{
+				return static_cast<T>(static_cast<integer>(static_cast<long long>(_value >> 1) ^ -static_cast<long long>(_value & 1)));
+			}
+
+			static inline T decode(unsigned long long _value, std::false_type)
+			{
+				return static_cast<T>(static_cast<integer>(_value));
+			}
+
+			static inline unsigned long long encode(T _value) { return encode(_value, std::is_signed<integer>()); }
+			static inline T decode(unsigned long long _value) { return decode(_value, std::is_signed<integer>()); }
+		};
+
+		template<typename T>
+		struct Serializer;
+		template<typename T>
+		struct Deserializer;
+
+		struct StreamPoolStats
+		{
+			// number of streams handed out
+			unsigned long long acquired = 0;
+			// number of streams that had to be allocated because the pool was empty
+			unsigned long long allocated = 0;
+		};
+
+		class StreamPool
+		{
+		public:
+			StreamPool(std::size_t _maxCached = 64);
+			~StreamPool();
+
+			BitStream* acquire();
+			void release(BitStream* _stream);
+
+			inline const StreamPoolStats& stats() const { return mStats; }
+
+		private:
+			StreamPool(const StreamPool&) = delete;
+			StreamPool& operator=(const StreamPool&) = delete;
+
+		private:
+			const std::size_t mMaxCached;
+			std::vector<BitStream*> mFreeStreams;
+			StreamPoolStats mStats;
+		};
+
+		class PooledStream
+		{
+		public:
+			inline PooledStream(StreamPool& _pool)
+				: mPool(&_pool)
+				, mStream(_pool.acquire())
+			{
+			}
+
+			inline PooledStream(PooledStream&& _other)
+				: mPool(_other.mPool)
+				, mStream(_other.mStream)
+			{
+				_other.mStream = nullptr;
+			}
+
+			inline ~PooledStream()
+			{
+				_release();
+			}
+
+			inline PooledStream& operator=(PooledStream&& _other)
+			{
+				if (this != &_other)
+				{
+					_release();
+					mPool = _other.mPool;
+					mStream = _other.mStream;
+					_other.mStream = nullptr;
+				}
+				return *this;
+			}
+
+			inline BitStream& operator*() const { return *mStream; }
+			inline BitStream* operator->() const { return mStream; }
+			inline BitStream* get() const { return mStream; }
+
+		private:
+			PooledStream(const PooledStream&) = delete;
+			PooledStream& operator=(const PooledStream&) = delete;
+
+			inline void _release()
+			{
+				if (mStream)
+					mPool->release(mStream);
+			}
+
+		private:
+			StreamPool* mPool;
+			BitStream* mStream;
+		};
 
 		template <typename Iterator>
 		class iterator_pair {
@@ -42,6 +512,13 @@ namespace RakNet {
 		template<template<typename...> class Ref, typename... Args>
 		struct is_specialization<Ref<Args...>, Ref> : std::true_type{};
 
+		// receiver of a group call and the id the service has there
+		struct GroupMember
+		{
+			SystemAddress address;
+			RakServiceId sid;
+		};
+
 		struct SerializationArgs
 		{
 			SerializationArgs(BitStream& _stream, RakServicePlugin* _plugin)
@@ -50,109 +527,1002 @@ namespace RakNet {
 			{}
 			BitStream& stream;
 			RakServicePlugin* plugin;
+			// number of returns a callback written with these args can receive, one per receiver
+			unsigned int replies = 1;
+			// peer that answers, its callbacks are cancelled when it disconnects. nullptr for groups
+			const SystemAddress* target = nullptr;
+			// receivers of a group call, each answers once
+			const std::vector<GroupMember>* group = nullptr;
+			// peer the message goes to, set for single receivers of version 2 messages
+			const SystemAddress* receiver = nullptr;
+			unsigned char version = WireVersion1;
+			// function whose callbacks are timed when their returns arrive, nullptr without metrics
+			FunctionMetrics* metrics = nullptr;
+		};
+
+		// a blob that is sent in chunks ahead of the message it was written to
+		struct OutgoingBlob
+		{
+			unsigned int id;
+			ServiceBlob blob;
 		};
 
+		struct DispatchTarget;
+
 		struct DeserializationArgs
 		{
-			DeserializationArgs(BitStream& _stream, RakServicePlugin* _plugin, const SystemAddress& _addr)
+			DeserializationArgs(BitStream& _stream, RakServicePlugin* _plugin, const SystemAddress& _addr, const RakServiceSendOptions* _sendOptions = nullptr)
 				: stream(_stream)
 				, plugin(_plugin)
 				, recvAddress(_addr)
+				, sendOptions(_sendOptions)
 			{}
 			BitStream& stream;
 			RakServicePlugin* plugin;
 			const SystemAddress& recvAddress;
+			// options of the invoked function, used for its returns
+			const RakServiceSendOptions* sendOptions;
+			// set when the deserialized invocation is handed to a RakServiceDispatcher instead of being called inline
+			const DispatchTarget* dispatch = nullptr;
+			// return slot of the last callback argument read, 0 if there was none
+			ReturnSlotId call = 0;
+			// wire format the message was received in, returns are answered in the same one
+			unsigned char version = WireVersion1;
 		};
 
-		template<int I, typename... Signature>
-		struct Expander
+		// Tells a callable that it is dropped without ever being called, if it has an expire() to hear about it
+		template<typename F>
+		inline auto ExpireCallable(F& _func, int) -> decltype(_func.expire(), void())
 		{
-		private:
-			struct ProceedExpanding
+			_func.expire();
+		}
+
+		template<typename F>
+		inline void ExpireCallable(F&, long)
+		{
+		}
+
+		// Move-only replacement for std::function with a fixed inline buffer.
+		// Callables that fit into Capacity bytes are stored in place, bigger ones fall back to the heap.
+		template<typename Signature, std::size_t Capacity = RAKSERVICE_CALLBACK_CAPACITY>
+		class InplaceFunction;
+
+		template<typename R, typename... Args, std::size_t Capacity>
+		class InplaceFunction<R(Args...), Capacity>
+		{
+			template<typename Signature, std::size_t OtherCapacity>
+			friend class InplaceFunction;
+
+			struct Operations
 			{
-				template<typename Handler, typename... Args>
-				static void ExpandCall(const Handler& func, DeserializationArgs& deArgs, Args&&... args)
+				R(*invoke)(void* _storage, Args&&... _args);
+				void(*move)(void* _dest, void* _src);
+				void(*destroy)(void* _storage);
+				void(*expire)(void* _storage);
+			};
+
+			template<typename F>
+			struct InlineManager
+			{
+				static R invoke(void* _storage, Args&&... _args)
 				{
-					typedef typename std::tuple_element<I, std::tuple<Signature...>>::type arg_type;
-					arg_type arg;
-					Deserializer<arg_type>::type::read(deArgs, arg);
+					return (*static_cast<F*>(_storage))(std::forward<Args>(_args)...);
+				}
+
+				static void move(void* _dest, void* _src)
+				{
+					new (_dest) F(std::move(*static_cast<F*>(_src)));
+					static_cast<F*>(_src)->~F();
+				}
+
+				static void destroy(void* _storage)
+				{
+					static_cast<F*>(_storage)->~F();
+				}
+
+				static void expire(void* _storage)
+				{
+					ExpireCallable(*static_cast<F*>(_storage), 0);
+				}
+			};
+
+			template<typename F>
+			struct HeapManager
+			{
+				static R invoke(void* _storage, Args&&... _args)
+				{
+					return (**static_cast<F**>(_storage))(std::forward<Args>(_args)...);
+				}
+
+				static void move(void* _dest, void* _src)
+				{
+					*static_cast<F**>(_dest) = *static_cast<F**>(_src);
+				}
+
+				static void destroy(void* _storage)
+				{
+					delete *static_cast<F**>(_storage);
+				}
+
+				static void expire(void* _storage)
+				{
+					ExpireCallable(**static_cast<F**>(_storage), 0);
+				}
+			};
+
+			template<typename F>
+			struct StoresInline
+			{
+				static const bool value = sizeof(F) <= Capacity
+					&& alignof(F) <= alignof(std::max_align_t)
+					&& std::is_nothrow_move_constructible<F>::value;
+			};
+
+			template<typename F>
+			static const Operations* OperationsFor(std::true_type)
+			{
+				static const Operations ops = { &InlineManager<F>::invoke, &InlineManager<F>::move, &InlineManager<F>::destroy, &InlineManager<F>::expire };
+				return &ops;
+			}
+
+			template<typename F>
+			static const Operations* OperationsFor(std::false_type)
+			{
+				static const Operations ops = { &HeapManager<F>::invoke, &HeapManager<F>::move, &HeapManager<F>::destroy, &HeapManager<F>::expire };
+				return &ops;
+			}
+
+			template<typename F>
+			void construct(F&& _func, std::true_type)
+			{
+				typedef typename std::decay<F>::type function_type;
+				new (&mStorage) function_type(std::forward<F>(_func));
+			}
+
+			template<typename F>
+			void construct(F&& _func, std::false_type)
+			{
+				typedef typename std::decay<F>::type function_type;
+				*reinterpret_cast<function_type**>(&mStorage) = new function_type(std::forward<F>(_func));
+			}
+
+		public:
+			inline InplaceFunction()
+				: mOperations(nullptr)
+			{
+			}
+
+			inline InplaceFunction(std::nullptr_t)
+				: mOperations(nullptr)
+			{
+			}
+
+			template<typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, InplaceFunction>::value>::type>
+			InplaceFunction(F&& _func)
+				: mOperations(nullptr)
+			{
+				typedef typename std::decay<F>::type function_type;
+				typedef std::integral_constant<bool, StoresInline<function_type>::value> is_inline;
+				construct(std::forward<F>(_func), is_inline());
+				mOperations = OperationsFor<function_type>(is_inline());
+			}
+
+			inline InplaceFunction(InplaceFunction&& _other)
+				: mOperations(_other.mOperations)
+			{
+				if (mOperations)
+				{
+					mOperations->move(&mStorage, &_other.mStorage);
+					_other.mOperations = nullptr;
+				}
+			}
+
+			inline ~InplaceFunction()
+			{
+				reset();
+			}
+
+			inline InplaceFunction& operator=(InplaceFunction&& _other)
+			{
+				if (this != &_other)
+				{
+					reset();
+					mOperations = _other.mOperations;
+					if (mOperations)
+					{
+						mOperations->move(&mStorage, &_other.mStorage);
+						_other.mOperations = nullptr;
+					}
+				}
+				return *this;
+			}
+
+			inline InplaceFunction& operator=(std::nullptr_t)
+			{
+				reset();
+				return *this;
+			}
+
+			inline explicit operator bool() const { return mOperations != nullptr; }
+
+			inline R operator()(Args... _args) const
+			{
+				RakAssert(mOperations);
+				return mOperations->invoke(const_cast<void*>(static_cast<const void*>(&mStorage)), std::forward<Args>(_args)...);
+			}
+
+			// the call this callback waits for expired or was cancelled, it will not be called
+			inline void expire() const
+			{
+				if (mOperations)
+					mOperations->expire(const_cast<void*>(static_cast<const void*>(&mStorage)));
+			}
+
+		private:
+			InplaceFunction(const InplaceFunction&) = delete;
+			InplaceFunction& operator=(const InplaceFunction&) = delete;
+
+			inline void reset()
+			{
+				if (mOperations)
+				{
+					mOperations->destroy(&mStorage);
+					mOperations = nullptr;
+				}
+			}
+
+		private:
+			typename std::aligned_storage<Capacity, alignof(std::max_align_t)>::type mStorage;
+			const Operations* mOperations;
+		};
+
+		template<typename T>
+		struct is_inplace_function : std::false_type {};
+
+		template<typename Signature, std::size_t Capacity>
+		struct is_inplace_function<InplaceFunction<Signature, Capacity>> : std::true_type{};
+
+		// a return slot has to hold a wrapped ServiceCallback, so it gets room for one more vtable
+		typedef InplaceFunction<void(DeserializationArgs&), RAKSERVICE_CALLBACK_CAPACITY + 2 * sizeof(void*)> ReturnSlot;
+
+		// how a return slot counts against the call windows of its owner, see RakServicePlugin::SetCallWindow
+		enum class SlotWindowState : unsigned char
+		{
+			NONE,
+			// the call is held back
+			QUEUED,
+			IN_FLIGHT
+		};
+
+		struct SlotWindow
+		{
+			SlotWindowState state = SlotWindowState::NONE;
+			RakServiceId service = 0;
+		};
+
+		// Hierarchical timing wheel for the deadlines of return slots, in ticks of a millisecond.
+		// Every level has 64 buckets, each spanning a whole turn of the level below. A timer waits
+		// in the lowest level that reaches its deadline and moves down a level whenever its bucket
+		// comes round, so scheduling, cancelling and advancing by a tick take constant time. Buckets
+		// are intrusive lists of pooled nodes, a node keeps its index while it moves between them.
+		class TimerWheel
+		{
+		public:
+			struct Timer
+			{
+				ReturnSlotId id;
+				std::uint64_t deadline;
+			};
+
+			static const unsigned int LevelBits = 6;
+			static const unsigned int Levels = 4;
+			static const unsigned int BucketMask = (1u << LevelBits) - 1;
+			// no timer, schedule() never returns it
+			static const unsigned int NoTimer = ~0u;
+
+		public:
+			TimerWheel();
+
+			// deadlines that already passed are due with the next tick. Returns the timer for cancel()
+			unsigned int schedule(ReturnSlotId _id, std::uint64_t _deadline, std::uint64_t _now);
+			// removes a timer that is not due yet
+			void cancel(unsigned int _timer);
+			// turns the wheel up to _now and appends the timers that became due to _due, they are gone from the wheel
+			void advance(std::uint64_t _now, std::vector<Timer>& _due);
+
+			inline std::size_t size() const { return mCount; }
+
+		private:
+			struct Node
+			{
+				Timer timer;
+				unsigned int prev;
+				// the next node in the bucket, or in the free list
+				unsigned int next;
+				// level * 64 + bucket of the list the node is in
+				unsigned int bucket;
+			};
+
+			void _insert(unsigned int _node);
+			void _link(unsigned int _node, unsigned int _bucket);
+			void _free(unsigned int _node);
+
+		private:
+			std::vector<Node> mNodes;
+			unsigned int mFree;
+			unsigned int mBuckets[Levels * (BucketMask + 1)];
+			std::uint64_t mNow;
+			std::size_t mCount;
+		};
+
+		// Slab of pending return slots.
+		// Freed slots are recycled through a free list and every reuse bumps the slot's
+		// generation, so a late or duplicated return for an old id never reaches a new callback.
+		// Slots of version 1 messages are compact: their index fits CompactIndexBits and they are
+		// sent as 16 bit ids that keep the low bits of the generation, see compact() and expand().
+		class ReturnSlotTable
+		{
+		public:
+			static const unsigned int IndexBits = 20;
+			static const unsigned int IndexMask = (1u << IndexBits) - 1;
+			static const unsigned int GenerationMask = (1u << (32 - IndexBits)) - 1;
+			static const unsigned int CompactIndexBits = 12;
+			static const unsigned int CompactIndexMask = (1u << CompactIndexBits) - 1;
+			// the highest compact index is left out, so 16 bit ids with all bits set are never pending
+			static const unsigned int CompactCapacity = CompactIndexMask;
+			// never pending, add() returns it for compact slots when all compact indices are taken
+			static const ReturnSlotId InvalidId = IndexMask;
+
+		public:
+			// _timers holds the timers of slots with a deadline, see setTimer()
+			explicit ReturnSlotTable(TimerWheel& _timers);
+
+			// _owner tags the slot for cancel(), 0 means no owner. Returns to slots with
+			// _metrics are counted there together with the time since add(). A slot with a
+			// _deadline is due from that tick on, see isDue(). _slot is left alone if no slot is free.
+			ReturnSlotId add(ReturnSlot&& _slot, unsigned int _replies = 1, unsigned int _owner = 0, FunctionMetrics* _metrics = nullptr, std::uint64_t _deadline = 0, bool _compact = false);
+			// Hands the callback out for one return from the connection _from, false if _id is not pending
+			// or a group slot does not wait for _from. The slot is released with its last return, otherwise
+			// _more is set and the callback has to be given back with restore(). _window is set to the
+			// window state of a released slot.
+			bool take(ReturnSlotId _id, ReturnSlot& _slot, bool& _more, SlotWindow* _window = nullptr, unsigned int _from = 0);
+			// a group slot whose last members were cancelled while it was lent out is released here
+			void restore(ReturnSlotId _id, ReturnSlot&& _slot);
+			// Releases every pending slot of _owner and expires its callback, and takes _owner out of
+			// the group slots that wait for it. A group slot that got a return already is not expired.
+			// Slots that are lent out right now are left to their restore().
+			std::size_t cancel(unsigned int _owner);
+			// Releases the slot _id and hands its callback out, false if it is not pending or lent out.
+			// _slot stays empty for a group slot that got a return already, its callback must not expire.
+			bool remove(ReturnSlotId _id, ReturnSlot& _slot, unsigned int& _owner, SlotWindow* _window = nullptr);
+			// _id is pending and its deadline is not after _tick
+			bool isDue(ReturnSlotId _id, std::uint64_t _tick) const;
+			bool isPending(ReturnSlotId _id) const;
+			void setWindow(ReturnSlotId _id, const SlotWindow& _window);
+			// _timer of _timers that is cancelled with the slot
+			void setTimer(ReturnSlotId _id, unsigned int _timer);
+			// the slot's timer was taken out of the wheel because it became due
+			void clearTimer(ReturnSlotId _id);
+			// makes _id a group slot that waits for one return from each of _members
+			void setMembers(ReturnSlotId _id, std::vector<unsigned int>&& _members);
+			// _id is a pending group slot, its returns have to name their connection
+			bool isGroup(ReturnSlotId _id) const;
+
+			// the 16 bit id of a compact slot
+			static inline ReturnSlotId compact(ReturnSlotId _id)
+			{
+				return (((_id >> IndexBits) & ((1u << (16 - CompactIndexBits)) - 1)) << CompactIndexBits) | (_id & CompactIndexMask);
+			}
+			// the compact slot a 16 bit id names, InvalidId if it is not pending
+			ReturnSlotId expand(ReturnSlotId _compact) const;
+			// the id _id was sent with
+			ReturnSlotId wireId(ReturnSlotId _id) const;
+
+			inline std::size_t size() const { return mUsed; }
+
+		private:
+			struct Entry
+			{
+				ReturnSlot slot;
+				unsigned int generation = 0;
+				unsigned int nextFree = 0;
+				unsigned int replies = 0;
+				unsigned int owner = 0;
+				bool used = false;
+				// a return reached the callback, which is not expired then
+				bool answered = false;
+				// connections a group slot still waits for, empty for other slots
+				std::vector<unsigned int> members;
+				// the slot's deadline in the TimerWheel, it is cancelled when the slot is released
+				unsigned int timer = TimerWheel::NoTimer;
+				FunctionMetrics* metrics = nullptr;
+				std::uint64_t sentAt = 0;
+				// 0 without one
+				std::uint64_t deadline = 0;
+				SlotWindow window;
+				bool compact = false;
+			};
+
+			void _release(unsigned int _index);
+
+		private:
+			std::vector<Entry> mEntries;
+			TimerWheel& mTimers;
+			// free slots below CompactCapacity, which every slot prefers, and the ones above
+			unsigned int mFreeHead;
+			unsigned int mFreeWideHead;
+			std::size_t mUsed;
+		};
+
+		// a call to a single peer that a call window may hold back, meta is nullptr for other messages
+		struct WindowedCall
+		{
+			const RakServiceMetaInfo* meta = nullptr;
+			RakServiceId sid = 0;
+			ServiceFunctionId fid = 0;
+		};
+
+		// A message that was serialized on another thread than the network thread.
+		// Its return slots are registered once the network thread takes the message,
+		// until then the stream carries placeholder ids at the recorded bit offsets.
+		struct OutboundMessage
+		{
+			struct DeferredReturn
+			{
+				BitSize_t offset;
+				unsigned int replies;
+				ReturnSlot slot;
+				FunctionMetrics* metrics;
+				// milliseconds from the time the slot is registered, 0 for none
+				unsigned int timeout;
+				// written as a 16 bit id of a version 1 message
+				bool compact;
+			};
+
+
+			std::atomic<OutboundMessage*> next;
+			BitStream stream;
+			AddressOrGUID target;
+			RakServiceSendOptions options;
+			std::vector<DeferredReturn> returns;
+			// receivers of a group call, target is unused then
+			std::vector<GroupMember> group;
+			std::vector<OutgoingBlob> blobs;
+			// services the message introduced, they are registered before it is sent
+			std::vector<RakService*> services;
+			WindowedCall call;
+		};
+
+		// Intrusive multi producer single consumer queue.
+		// push is lock-free and may be called from any thread, pop belongs to a single consumer.
+		class OutboundQueue
+		{
+		public:
+			OutboundQueue();
+			~OutboundQueue();
+
+			void push(OutboundMessage* _message);
+			// nullptr if the queue is empty or a producer has not finished linking its message yet
+			OutboundMessage* pop();
+
+		private:
+			OutboundQueue(const OutboundQueue&) = delete;
+			OutboundQueue& operator=(const OutboundQueue&) = delete;
+
+		private:
+			std::atomic<OutboundMessage*> mHead;
+			OutboundMessage* mTail;
+			OutboundMessage mStub;
+		};
+
+	}
+
+	// Runs deserialized invocations somewhere else than on the thread that pumps the RakPeer.
+	// Tasks dispatched with the same strand have to run one after another in dispatch order.
+	class RakServiceDispatcher
+	{
+	public:
+		typedef detail::InplaceFunction<void(), 4 * RAKSERVICE_CALLBACK_CAPACITY> Task;
+
+	public:
+		virtual ~RakServiceDispatcher() {}
+		virtual void Dispatch(std::size_t _strand, Task _task) = 0;
+	};
+
+	enum class RakServiceDispatchOrder
+	{
+		PER_SERVICE,
+		PER_PEER,
+		PER_SERVICE_AND_PEER
+	};
+
+	// What happens to a call whose window is full, see RakServicePlugin::SetCallWindow
+	enum class RakServiceWindowPolicy
+	{
+		// held back until an earlier call is answered
+		QUEUE,
+		// dropped right away, its callback's expire() runs
+		REJECT,
+		// replaces a held back call of the same function, which is dropped like a rejected one. Queued if there is none
+		COALESCE
+	};
+
+	struct RakServiceCallWindow
+	{
+		// calls with a callback that may wait for their answers at once, 0 for no limit
+		unsigned int maxInFlight = 0;
+		RakServiceWindowPolicy policy = RakServiceWindowPolicy::QUEUE;
+		// calls that may be held back, further ones are rejected. 0 for no limit
+		unsigned int maxQueued = 0;
+	};
+
+	// Calls of a RakServicePlugin to one peer, see RakServicePlugin::GetPeerLoad
+	struct RakServicePeerLoad
+	{
+		// sent and waiting for their answers, counted while a call window is set
+		std::size_t inFlight = 0;
+		// held back by a full window
+		std::size_t queued = 0;
+		// since the peer connected
+		std::size_t rejected = 0;
+		std::size_t coalesced = 0;
+		// calls are held back, see RakServicePlugin::SetCongestionHandler
+		bool congested = false;
+	};
+
+	// Carries the messages of a RakServicePlugin, see RakServicePlugin::SetTransport. Without one they go
+	// through the RakPeer the plugin is attached to. A transport hands the messages it receives to
+	// RakServicePlugin::HandleMessage and reports lost peers with OnClosedConnection, both on the thread
+	// that runs the plugin's Update().
+	class RakServiceTransport
+	{
+	public:
+		virtual ~RakServiceTransport() {}
+
+		// _stream starts with ID_RPC_PLUGIN, the channel of _options is resolved already
+		virtual void Send(const BitStream& _stream, const AddressOrGUID& _target, const RakServiceSendOptions& _options) = 0;
+		// the same message to every one of _targets, used for group calls. Transports that can multicast
+		// override it, the default sends it to one target after the other.
+		virtual void SendToMany(const BitStream& _stream, const SystemAddress* _targets, std::size_t _count, const RakServiceSendOptions& _options)
+		{
+			for (std::size_t i = 0; i < _count; ++i)
+				Send(_stream, _targets[i], _options);
+		}
+		// UNASSIGNED_SYSTEM_ADDRESS if no peer has _guid
+		virtual SystemAddress GetSystemAddressFromGuid(const RakNetGUID& _guid) const = 0;
+		// clock of call deadlines in microseconds, a monotonic clock unless the transport has its own time
+		virtual std::uint64_t GetTimeUS() const { return detail::MetricsNow(); }
+	};
+
+	// Gives the calls made on this thread while it lives _timeoutMs to be answered, instead of the
+	// timeout set with RakServicePlugin::SetCallTimeout. 0 lets them wait forever. Scopes nest.
+	//
+	//		RakServiceDeadline deadline(250);
+	//		store->get(key, callback);
+	//		plugin.CancelCall(deadline.lastCall());
+	class RakServiceDeadline
+	{
+	public:
+		explicit RakServiceDeadline(unsigned int _timeoutMs);
+		~RakServiceDeadline();
+
+		inline unsigned int timeout() const { return mTimeout; }
+		// return slot of the last call made on the network thread in this scope, detail::ReturnSlotTable::InvalidId
+		// if there was none, which CancelCall() ignores. 0 is a valid slot id.
+		// Calls from other threads get theirs on the next Update(), they can only expire.
+		inline detail::ReturnSlotId lastCall() const { return mLastCall; }
+
+		// innermost scope of this thread, nullptr outside of one
+		static RakServiceDeadline* Current();
+		inline void _SetLastCall(detail::ReturnSlotId _call) { mLastCall = _call; }
+
+	private:
+		RakServiceDeadline(const RakServiceDeadline&) = delete;
+		RakServiceDeadline& operator=(const RakServiceDeadline&) = delete;
+
+	private:
+		unsigned int mTimeout;
+		detail::ReturnSlotId mLastCall;
+		RakServiceDeadline* mPrevious;
+	};
+
+	namespace detail {
+
+		template<std::size_t... I>
+		struct IndexSequence {};
+
+		template<std::size_t N, std::size_t... I>
+		struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, I...> {};
+
+		template<std::size_t... I>
+		struct MakeIndexSequence<0, I...>
+		{
+			typedef IndexSequence<I...> type;
+		};
+
+		struct InvocationContext
+		{
+			const RakService* service;
+			SystemAddress origin;
+			// return slot the caller waits on, see RakService::InvokeCallId()
+			ReturnSlotId call;
+		};
+
+		// Makes an invocation visible to RakService::InvokeOrigin() on the current thread
+		class InvocationScope
+		{
+		public:
+			InvocationScope(const RakService* _service, const SystemAddress& _origin, ReturnSlotId _call = 0);
+			~InvocationScope();
+
+			static const InvocationContext* Current();
+			// the callback argument of the running invocation was read
+			static void SetCall(ReturnSlotId _call);
+
+		private:
+			InvocationScope(const InvocationScope&) = delete;
+			InvocationScope& operator=(const InvocationScope&) = delete;
+
+		private:
+			InvocationContext mContext;
+			InvocationContext* mPrevious;
+		};
+
+		struct DispatchTarget
+		{
+			RakServiceDispatcher* dispatcher;
+			std::size_t strand;
+			const RakService* service;
+			SystemAddress origin;
+			FunctionMetrics* metrics;
+		};
+
+		// Type a deserialized argument is kept as until a dispatcher runs the invocation.
+		// Views have to outlive the packet, so they keep a copy of what they refer to.
+		template<typename T>
+		struct DeferredArg
+		{
+			typedef T type;
+			static inline T&& store(T&& _arg) { return std::move(_arg); }
+		};
+
+		template<>
+		struct DeferredArg<ServiceStringView>
+		{
+			typedef std::string type;
+			static inline type store(const ServiceStringView& _arg) { return _arg.str(); }
+		};
+
+		template<>
+		struct DeferredArg<ServiceByteSpan>
+		{
+			typedef std::vector<unsigned char> type;
+			static inline type store(const ServiceByteSpan& _arg) { return type(_arg.begin(), _arg.end()); }
+		};
+
+		// An invocation whose arguments are already deserialized, waiting to run on a dispatcher
+		template<typename Handler, typename... Args>
+		struct DeferredCall
+		{
+			template<typename... CallArgs>
+			inline DeferredCall(const DispatchTarget& _target, ReturnSlotId _call, const Handler& _handler, CallArgs&&... _args)
+				: service(_target.service)
+				, origin(_target.origin)
+				, call(_call)
+				, metrics(_target.metrics)
+				, handler(_handler)
+				, args(std::forward<CallArgs>(_args)...)
+			{
+			}
+
+			inline void operator()()
+			{
+				InvocationScope scope(service, origin, call);
+				HandlerTimer timer(metrics);
+				apply(typename MakeIndexSequence<sizeof...(Args)>::type());
+			}
+
+			template<std::size_t... I>
+			inline void apply(IndexSequence<I...>)
+			{
+				handler(std::move(std::get<I>(args))...);
+			}
+
+			const RakService* service;
+			SystemAddress origin;
+			ReturnSlotId call;
+			FunctionMetrics* metrics;
+			Handler handler;
+			std::tuple<Args...> args;
+		};
+
+		template<int I, typename... Signature>
+		struct Expander
+		{
+		private:
+			struct ProceedExpanding
+			{
+				template<typename Handler, typename... Args>
+				static void ExpandCall(const Handler& func, DeserializationArgs& deArgs, Args&&... args)
+				{
+					typedef typename std::tuple_element<I, std::tuple<Signature...>>::type arg_type;
+					arg_type arg;
+					Deserializer<arg_type>::type::read(deArgs, arg);
+
+					return Expander<I + 1, Signature...>::type::ExpandCall(func, deArgs, std::forward<Args>(args)..., std::move(arg));
+				}
+			};
+
+			struct DoneExpanding
+			{
+				static_assert(I <= sizeof...(Signature), "Invalid value for I");
+
+				template<typename Handler, typename... Args>
+				static void ExpandCall(const Handler& func, DeserializationArgs& deArgs, Args&&... args)
+				{
+					Call(std::is_copy_constructible<Handler>(), func, deArgs, std::forward<Args>(args)...);
+				}
+
+			private:
+				template<typename Handler, typename... Args>
+				static void Call(std::true_type, const Handler& func, DeserializationArgs& deArgs, Args&&... args)
+				{
+					if (deArgs.dispatch)
+					{
+						const DispatchTarget& target = *deArgs.dispatch;
+						target.dispatcher->Dispatch(target.strand, DeferredCall<Handler, typename DeferredArg<typename std::decay<Args>::type>::type...>(target, deArgs.call, func, DeferredArg<typename std::decay<Args>::type>::store(std::forward<Args>(args))...));
+						return;
+					}
+
+					func(std::forward<Args>(args)...);
+				}
+
+				// move-only handlers are return callbacks, those always run on the receiving thread
+				template<typename Handler, typename... Args>
+				static void Call(std::false_type, const Handler& func, DeserializationArgs& deArgs, Args&&... args)
+				{
+					RakAssert(!deArgs.dispatch);
+					func(std::forward<Args>(args)...);
+				}
+			};
+
+	 	public:
+			typedef typename std::conditional<
+				(I < sizeof...(Signature)),
+				ProceedExpanding,
+				DoneExpanding>::type type;
+		};
+
+		template<typename Service, typename... Sig>
+		struct MethodCall
+		{
+			inline MethodCall(Service* _self, void(Service::*_method)(Sig...))
+				: self(_self)
+				, method(_method)
+			{
+			}
+
+			template<typename... Args>
+			inline void operator()(Args&&... args) const
+			{
+				(self->*method)(std::forward<Args>(args)...);
+			}
+
+			Service* self;
+			void(Service::*method)(Sig...);
+		};
+
+		template<typename... Sig>
+		void ExpandCall(void(*func)(Sig...), DeserializationArgs& deArgs)
+		{
+			Expander<0, typename std::decay<Sig>::type...>::type::ExpandCall(func, deArgs);
+		}
+
+		template<typename... Sig>
+		void ExpandCall(const std::function<void(Sig...)>& func, DeserializationArgs& deArgs)
+		{
+			Expander<0, typename std::decay<Sig>::type...>::type::ExpandCall(func, deArgs);
+		}
+
+		template<std::size_t Capacity, typename... Sig>
+		void ExpandCall(const InplaceFunction<void(Sig...), Capacity>& func, DeserializationArgs& deArgs)
+		{
+			Expander<0, typename std::decay<Sig>::type...>::type::ExpandCall(func, deArgs);
+		}
+
+		// Deserializes the arguments of one service method into a tuple and moves them into the call
+		template<typename Service, typename Method, Method method>
+		struct MethodThunk;
+
+		template<typename Service, typename Base, typename... Sig, void(Base::*method)(Sig...)>
+		struct MethodThunk<Service, void(Base::*)(Sig...), method>
+		{
+			typedef std::tuple<typename std::decay<Sig>::type...> args_type;
+
+			static void invoke(Service* _self, DeserializationArgs& _deArgs)
+			{
+				args_type args;
+				read(_deArgs, args, typename MakeIndexSequence<sizeof...(Sig)>::type());
+
+				if (_deArgs.dispatch)
+				{
+					dispatch(_self, *_deArgs.dispatch, _deArgs.call, args, typename MakeIndexSequence<sizeof...(Sig)>::type());
+					return;
+				}
+
+				call(_self, args, typename MakeIndexSequence<sizeof...(Sig)>::type());
+			}
+
+		private:
+			template<std::size_t... I>
+			static void dispatch(Service* _self, const DispatchTarget& _target, ReturnSlotId _call, args_type& _args, IndexSequence<I...>)
+			{
+				typedef DeferredCall<MethodCall<Base, Sig...>, typename DeferredArg<typename std::tuple_element<I, args_type>::type>::type...> Call;
+				_target.dispatcher->Dispatch(_target.strand, Call(_target, _call, MethodCall<Base, Sig...>(_self, method), DeferredArg<typename std::tuple_element<I, args_type>::type>::store(std::move(std::get<I>(_args)))...));
+				(void)_args;
+			}
+
+			template<std::size_t... I>
+			static void read(DeserializationArgs& _deArgs, args_type& _args, IndexSequence<I...>)
+			{
+				// braced initializers are evaluated in order, so the arguments are read in order
+				int order[] = { 0, (Deserializer<typename std::tuple_element<I, args_type>::type>::type::read(_deArgs, std::get<I>(_args)), 0)... };
+				(void)order;
+				(void)_deArgs;
+			}
+
+			template<std::size_t... I>
+			static void call(Service* _self, args_type& _args, IndexSequence<I...>)
+			{
+				(_self->*method)(std::move(std::get<I>(_args))...);
+				(void)_args;
+			}
+		};
+
+		template<typename... T>
+		struct AnyCallback : std::false_type {};
+
+		template<typename T, typename... Rest>
+		struct AnyCallback<T, Rest...> : std::integral_constant<bool, is_inplace_function<T>::value || is_specialization<T, std::function>::value || AnyCallback<Rest...>::value> {};
+
+		// MethodThunk of a one-way function, which is never answered and so must not take callbacks
+		template<typename Service, typename Method, Method method>
+		struct OneWayMethodThunk;
+
+		template<typename Service, typename Base, typename... Sig, void(Base::*method)(Sig...)>
+		struct OneWayMethodThunk<Service, void(Base::*)(Sig...), method> : MethodThunk<Service, void(Base::*)(Sig...), method>
+		{
+			static_assert(!AnyCallback<typename std::decay<Sig>::type...>::value, "RAK_ONEWAY functions must not take a ServiceCallback or std::function");
+		};
+
+		// Table of MethodThunks indexed by ServiceFunctionId, so _Invoke is a single indirect call.
+		// Thunks have to be listed in function id order.
+		template<typename Service, typename... Thunks>
+		struct ServiceDispatchTable
+		{
+			typedef void(*Thunk)(Service*, DeserializationArgs&);
+
+			static bool Invoke(Service* _self, DeserializationArgs& _deArgs, ServiceFunctionId _func)
+			{
+				if (_func >= sizeof...(Thunks))
+					return false;
+				thunks[_func](_self, _deArgs);
+				return true;
+			}
+
+			// one extra entry, so a service without functions still has a valid array
+			static constexpr Thunk thunks[sizeof...(Thunks) + 1] = { &Thunks::invoke..., nullptr };
+		};
+
+		template<typename Service, typename... Thunks>
+		constexpr typename ServiceDispatchTable<Service, Thunks...>::Thunk ServiceDispatchTable<Service, Thunks...>::thunks[sizeof...(Thunks) + 1];
 
-					return Expander<I + 1, Signature...>::type::ExpandCall(func, deArgs, std::forward<Args>(args)..., arg);
-				}
-			};
+		template<typename Function>
+		struct WrappedFunction
+		{
+			inline WrappedFunction(Function&& _func)
+				: func(std::move(_func))
+			{
+			}
 
-			struct DoneExpanding
+			inline void operator()(DeserializationArgs& deArgs) const
 			{
-				static_assert(I <= sizeof...(Signature), "Invalid value for I");
+				ExpandCall(func, deArgs);
+			}
 
-				template<typename Handler, typename... Args>
-				static void ExpandCall(const Handler& func, DeserializationArgs& deArgs, Args&&... args)
-				{
-					func(std::forward<Args>(args)...);
-				}
-			};
+			inline void expire()
+			{
+				ExpireCallable(func, 0);
+			}
 
-	 	public:
-			typedef typename std::conditional<
-				(I < sizeof...(Signature)),
-				ProceedExpanding,
-				DoneExpanding>::type type;
+			Function func;
 		};
 
 		template<typename... Sig>
-		void ExpandCall(void(*func)(Sig...), DeserializationArgs& deArgs)
+		inline ReturnSlot WrapFunction(std::function<void(Sig...)> func)
 		{
-			Expander<0, Sig...>::type::ExpandCall(func, deArgs);
+			return WrappedFunction<std::function<void(Sig...)>>(std::move(func));
 		}
 
-		template<typename... Sig>
-		void ExpandCall(const std::function<void(Sig...)>& func, DeserializationArgs& deArgs)
+		template<std::size_t Capacity, typename... Sig>
+		inline ReturnSlot WrapFunction(InplaceFunction<void(Sig...), Capacity> func)
 		{
-			Expander<0, Sig...>::type::ExpandCall(func, deArgs);
+			return WrappedFunction<InplaceFunction<void(Sig...), Capacity>>(std::move(func));
 		}
 
-
-		template<typename... Sig>
-		static std::function<void(DeserializationArgs&)> WrapFunction(std::function<void(Sig...)> func)
+		template<typename Callback, typename ExpiredHandler>
+		struct ExpiringCallback
 		{
-			return [func](DeserializationArgs& deArgs)
+			template<typename... Args>
+			inline void operator()(Args&&... _args)
 			{
-				ExpandCall(func, deArgs);
-			};
-		}
+				callback(std::forward<Args>(_args)...);
+			}
 
-		static void PackCall(SerializationArgs&)
+			inline void expire()
+			{
+				onExpired();
+			}
+
+			Callback callback;
+			ExpiredHandler onExpired;
+		};
+
+		inline void PackCall(SerializationArgs&)
 		{
 		}
 
 		template<typename Arg, typename... Args>
-		static void PackCall(SerializationArgs& sa, Arg&& arg, Args&&... tailArgs)
+		inline void PackCall(SerializationArgs& sa, Arg&& arg, Args&&... tailArgs)
 		{
-			Serializer<Arg>::type::write(sa, arg);
+			Serializer<typename std::decay<Arg>::type>::type::write(sa, std::forward<Arg>(arg));
 			PackCall(sa, std::forward<Args>(tailArgs)...);
 		}
 
-
+		// Closure that sends the arguments it is called with back to the caller as SMI_RETURN
 		template<typename... Sig>
-		static std::function<void(Sig...)> MakeInkoation(RakServicePlugin* plugin, ReturnSlotId rid, const SystemAddress& addr)
+		struct ReturnInvocation
 		{
-			return[plugin, rid, addr](Sig... fargs)
+			inline ReturnInvocation(RakServicePlugin* _plugin, ReturnSlotId _rid, const SystemAddress& _addr, const RakServiceSendOptions* _sendOptions, unsigned char _version, bool _compact)
+				: plugin(_plugin)
+				, sendOptions(_sendOptions)
+				, rid(_rid)
+				, version(_version)
+				, compact(_compact)
+				, addr(_addr)
 			{
-				BitStream stream;
-				SerializationArgs args(stream, plugin);
-				plugin->_BeginReturn(args, rid);
-				PackCall(args, std::forward<Sig>(fargs)...);
-				plugin->_EndReturn(args, addr);
-			};
+			}
+
+			void operator()(Sig... fargs) const;
+
+			RakServicePlugin* plugin;
+			const RakServiceSendOptions* sendOptions;
+			ReturnSlotId rid;
+			unsigned char version;
+			// rid came as a 16 bit id, which stays one in answers of any version
+			bool compact;
+			SystemAddress addr;
+		};
+
+		template<typename... Sig>
+		inline ReturnInvocation<Sig...> MakeInkoation(RakServicePlugin* plugin, ReturnSlotId rid, const SystemAddress& addr, const RakServiceSendOptions* sendOptions, unsigned char version, bool compact)
+		{
+			return ReturnInvocation<Sig...>(plugin, rid, addr, sendOptions, version, compact);
 		}
 
 		struct SerializeFunction
 		{
 			template<typename... Sig>
-			static void write(SerializationArgs& args, const std::function<void(Sig...)>& _func)
+			static void write(SerializationArgs& args, const std::function<void(Sig...)>& _func);
+
+			template<std::size_t Capacity, typename... Sig>
+			static void write(SerializationArgs& args, InplaceFunction<void(Sig...), Capacity>&& _func);
+
+			// the callback is moved into its return slot
+			template<std::size_t Capacity, typename... Sig>
+			static void write(SerializationArgs& args, InplaceFunction<void(Sig...), Capacity>& _func)
 			{
-				auto id = args.plugin->_RegisterReturn(WrapFunction(_func));
-				args.stream << id;
+				write(args, std::move(_func));
 			}
 		};
 
@@ -160,9 +1530,34 @@ namespace RakNet {
 		{
 			template<typename T>
 			static void write(SerializationArgs& args, const T& _val)
+			{
+				write(args, _val, is_varint<T>());
+			}
+
+		private:
+			template<typename T>
+			static void write(SerializationArgs& args, const T& _val, std::false_type)
 			{
 				args.stream << _val;
 			}
+
+			template<typename T>
+			static void write(SerializationArgs& args, const T& _val, std::true_type)
+			{
+				if (args.version >= WireVersion2)
+					WriteVarint(args.stream, VarintCodec<T>::encode(_val));
+				else
+					args.stream << _val;
+			}
+		};
+
+		struct SerializePacked
+		{
+			template<typename T>
+			static void write(SerializationArgs& args, const T& _val)
+			{
+				_val.pack(args.stream);
+			}
 		};
 
 		struct SerializeService
@@ -170,12 +1565,26 @@ namespace RakNet {
 			static void write(SerializationArgs& args, RakService* _p);
 		};
 
+		struct SerializeBlob
+		{
+			static void write(SerializationArgs& args, const ServiceBlob& _blob);
+		};
+
+		struct SerializeView
+		{
+			static void write(SerializationArgs& args, const ServiceStringView& _str);
+			static void write(SerializationArgs& args, const ServiceByteSpan& _bytes);
+		};
+
+		template<typename T>
+		struct is_view : std::integral_constant<bool, std::is_same<T, ServiceStringView>::value || std::is_same<T, ServiceByteSpan>::value> {};
+
 		template<typename T>
 		struct Serializer
 		{
 		private:
 			typedef typename std::conditional <
-				is_specialization<T, std::function>::value,
+				is_specialization<T, std::function>::value || is_inplace_function<T>::value,
 				SerializeFunction,
 				SerializeEverything
 			>::type type1;
@@ -185,18 +1594,127 @@ namespace RakNet {
 				SerializeService,
 				type1
 			> ::type type2;
+
+			typedef typename std::conditional <
+				std::is_same<T, ServiceBlob>::value,
+				SerializeBlob,
+				type2
+			> ::type type3;
+
+			typedef typename std::conditional <
+				is_view<T>::value,
+				SerializeView,
+				type3
+			> ::type type4;
+
+			typedef typename std::conditional <
+				std::is_base_of<PackedValue, T>::value,
+				SerializePacked,
+				type4
+			> ::type type5;
 		public:
-			typedef type2 type;
+			typedef type5 type;
+		};
+
+		// upper bound of the message header written by RakService::_BeginCall
+		static const BitSize_t CallHeaderBits = 8 * (2 * sizeof(MessageID) + sizeof(RakServiceId) + sizeof(ServiceFunctionId));
+
+		// Upper bound of the bits Serializer<T> writes for a value, 0 if it is not known up front
+		template<typename T, typename Enable = void>
+		struct SerializedSize
+		{
+			static inline BitSize_t bits(const T&) { return 0; }
+		};
+
+		template<typename T>
+		struct SerializedSize<T, typename std::enable_if<std::is_arithmetic<T>::value || std::is_enum<T>::value>::type>
+		{
+			static inline BitSize_t bits(const T&) { return 8 * sizeof(T); }
+		};
+
+		template<typename T>
+		struct SerializedSize<T, typename std::enable_if<std::is_base_of<PackedValue, T>::value>::type>
+		{
+			static inline BitSize_t bits(const T&) { return T::Bits; }
+		};
+
+		template<>
+		struct SerializedSize<RakString>
+		{
+			// length prefix, alignment and the characters
+			static inline BitSize_t bits(const RakString& _str) { return 8 * (sizeof(unsigned short) + 1 + static_cast<BitSize_t>(_str.GetLength())); }
+		};
+
+		template<typename T>
+		struct SerializedSize<T, typename std::enable_if<is_specialization<T, std::function>::value || is_inplace_function<T>::value>::type>
+		{
+			static inline BitSize_t bits(const T&) { return 8 * sizeof(ReturnSlotId); }
+		};
+
+		template<typename T>
+		struct SerializedSize<T*, typename std::enable_if<std::is_base_of<RakService, T>::value>::type>
+		{
+			static inline BitSize_t bits(const T*) { return 2 + 8 * sizeof(RakServiceId); }
+		};
+
+		template<>
+		struct SerializedSize<ServiceStringView>
+		{
+			static inline BitSize_t bits(const ServiceStringView& _str) { return 8 * (sizeof(unsigned short) + 1 + static_cast<BitSize_t>(_str.size())); }
+		};
+
+		template<>
+		struct SerializedSize<ServiceByteSpan>
+		{
+			static inline BitSize_t bits(const ServiceByteSpan& _bytes) { return 1 + 8 * (sizeof(unsigned int) + 1 + static_cast<BitSize_t>(_bytes.size())); }
 		};
 
+		template<>
+		struct SerializedSize<ServiceBlob>
+		{
+			// streamed flag, length, alignment and the bytes, streamed blobs write less
+			static inline BitSize_t bits(const ServiceBlob& _blob) { return 1 + 8 * (sizeof(unsigned int) + 1 + static_cast<BitSize_t>(_blob.size())); }
+		};
+
+		inline BitSize_t SerializedBits()
+		{
+			return 0;
+		}
+
+		// used by generated proxies to reserve a whole call before writing it
+		template<typename Arg, typename... Args>
+		BitSize_t SerializedBits(const Arg& _arg, const Args&... _args)
+		{
+			return SerializedSize<Arg>::bits(_arg) + SerializedBits(_args...);
+		}
+
 		struct DeserializeFunction
 		{
+			static inline void setCall(DeserializationArgs& args, ReturnSlotId _rid)
+			{
+				args.call = _rid;
+				// inline invocations are read inside their scope, dispatched ones take the id along
+				if (!args.dispatch)
+					InvocationScope::SetCall(_rid);
+			}
+
 			template<typename... Args>
 			static void read(DeserializationArgs& args, std::function<void(Args...)>& _func)
 			{
-				ReturnSlotId rid;
-				args.stream >> rid;
-				_func = MakeInkoation<Args...>(args.plugin, rid, args.recvAddress);
+				// a truncated id answers a slot that is never pending
+				ReturnSlotId rid = ReturnSlotTable::InvalidId;
+				ReadReturnSlotId(args.stream, rid, args.version);
+				_func = MakeInkoation<Args...>(args.plugin, rid, args.recvAddress, args.sendOptions, args.version, args.version < WireVersion2);
+				setCall(args, rid);
+			}
+
+			template<std::size_t Capacity, typename... Args>
+			static void read(DeserializationArgs& args, InplaceFunction<void(Args...), Capacity>& _func)
+			{
+				ReturnSlotId rid = ReturnSlotTable::InvalidId;
+				ReadReturnSlotId(args.stream, rid, args.version);
+				_func = MakeInkoation<Args...>(args.plugin, rid, args.recvAddress, args.sendOptions, args.version, args.version < WireVersion2);
+				setCall(args, rid);
 			}
 		};
 
@@ -205,37 +1723,64 @@ namespace RakNet {
 			template<typename T>
 			static void read(DeserializationArgs& args, T& _val)
 			{
-				args.stream >> _val;
+				read(args, _val, is_varint<T>());
 			}
-		};
 
-		struct DeserializeService
-		{
+		private:
 			template<typename T>
-			static void read(DeserializationArgs& args, T*& _p)
+			static void read(DeserializationArgs& args, T& _val, std::false_type)
 			{
-				static_assert(std::is_base_of<RakService, T>::value, "_p must be a RakService!");
+				args.stream >> _val;
+			}
 
-				bool isNull;
-				args.stream >> isNull;
-				if (isNull)
+			template<typename T>
+			static void read(DeserializationArgs& args, T& _val, std::true_type)
+			{
+				if (args.version < WireVersion2)
 				{
-					_p = nullptr;
+					args.stream >> _val;
 					return;
 				}
 
-				RakServiceId sid;
-				args.stream >> sid;
-				_p = args.plugin->GetForeignService<T>(args.recvAddress, sid);
+				unsigned long long value = 0;
+				ReadVarint(args.stream, value);
+				_val = VarintCodec<T>::decode(value);
+			}
+		};
+
+		struct DeserializePacked
+		{
+			template<typename T>
+			static void read(DeserializationArgs& args, T& _val)
+			{
+				_val.unpack(args.stream);
 			}
 		};
 
+		struct DeserializeService
+		{
+			template<typename T>
+			static void read(DeserializationArgs& args, T*& _p);
+		};
+
+		struct DeserializeBlob
+		{
+			static void read(DeserializationArgs& args, ServiceBlob& _blob);
+		};
+
+		// views point into the stream, which points into the packet
+		struct DeserializeView
+		{
+			static void read(DeserializationArgs& args, ServiceStringView& _str);
+			static void read(DeserializationArgs& args, ServiceByteSpan& _bytes);
+		};
+
 		template<typename T>
 		struct Deserializer
 		{
 		private:
 			typedef typename std::conditional <
-				is_specialization<T, std::function>::value,
+				is_specialization<T, std::function>::value || is_inplace_function<T>::value,
 				DeserializeFunction,
 				DeserializeEverything
 			>::type type1;
@@ -245,42 +1790,136 @@ namespace RakNet {
 				DeserializeService,
 				type1
 			> ::type type2;
+
+			typedef typename std::conditional <
+				std::is_same<T, ServiceBlob>::value,
+				DeserializeBlob,
+				type2
+			> ::type type3;
+
+			typedef typename std::conditional <
+				is_view<T>::value,
+				DeserializeView,
+				type3
+			> ::type type4;
+
+			typedef typename std::conditional <
+				std::is_base_of<PackedValue, T>::value,
+				DeserializePacked,
+				type4
+			> ::type type5;
 		public:
-			typedef type2 type;
+			typedef type5 type;
 		};
 
+		// FNV-1a over port and address, IPv6 addresses take all 16 bytes into account
 		struct SystemAddressHash
 		{
-			inline std::size_t operator()(const SystemAddress& _addr)
+			std::size_t operator()(const SystemAddress& _addr) const;
+		};
+
+		// for keys that already are hashes, like ServiceName::hash()
+		struct PrecomputedHash
+		{
+			inline std::size_t operator()(unsigned int _hash) const { return _hash; }
+		};
+
+		// Collects the answers of the separate connects RakServicePlugin::ConnectServices falls back to
+		template<typename... ServiceTypes>
+		struct ConnectJoin
+		{
+			inline ConnectJoin(InplaceFunction<void(ServiceTypes*...)>&& _handler)
+				: pending(sizeof...(ServiceTypes))
+				, handler(std::move(_handler))
+			{
+			}
+
+			template<std::size_t... I>
+			void finish(IndexSequence<I...>)
+			{
+				handler(std::get<I>(services)...);
+			}
+
+			std::tuple<ServiceTypes*...> services;
+			std::size_t pending;
+			InplaceFunction<void(ServiceTypes*...)> handler;
+		};
+
+		template<std::size_t I, typename... ServiceTypes>
+		struct ConnectJoinPart
+		{
+			typedef typename std::tuple_element<I, std::tuple<ServiceTypes*...>>::type Service;
+
+			void operator()(Service _service) const
 			{
-				std::hash<USHORT> usHash;
-				std::hash<u_long> longHash;
-				return usHash(_addr.address.addr4.sin_port)
-					+ longHash(_addr.address.addr4.sin_addr.s_addr);
+				std::get<I>(join->services) = _service;
+				if (--join->pending == 0)
+					join->finish(typename MakeIndexSequence<sizeof...(ServiceTypes)>::type());
 			}
+
+			std::shared_ptr<ConnectJoin<ServiceTypes...>> join;
 		};
 	}
 
 
+	// Declaration macros read by rakservice_generate (cmake/RakServiceGenerate.cmake), which creates
+	// the proxies and meta info of the services declared with them.
+	// RAK_SERVICE declares a service interface of pure virtual functions returning void.
+#define RAK_SERVICE(_name) struct _name : public ::RakNet::GenericRakService<_name>
+	// Marks the following service function as one-way, see RakServiceFunctionMetaInfo::isOneWay
+#define RAK_ONEWAY
+	// Send options of the following service function, the arguments of a RakServiceSendOptions
+#define RAK_SEND_OPTIONS(...)
+
+	// Entry of a detail::ServiceDispatchTable for the method _method of _service
+#define RAKSERVICE_METHOD(_service, _method) ::RakNet::detail::MethodThunk<_service, decltype(&_service::_method), &_service::_method>
+	// RAKSERVICE_METHOD for a RAK_ONEWAY function
+#define RAKSERVICE_ONEWAY_METHOD(_service, _method) ::RakNet::detail::OneWayMethodThunk<_service, decltype(&_service::_method), &_service::_method>
+
+	// Callback argument type for service functions.
+	// Unlike std::function it is move-only and keeps the closures created by the library inline.
+	template<typename Signature>
+	using ServiceCallback = detail::InplaceFunction<Signature>;
+
+	// Callback that runs _onExpired instead of _callback if the call expires, is cancelled or the peer
+	// disconnects before it answers, see RakServicePlugin::SetCallTimeout. A group call only expires
+	// if no member answered.
+	//
+	//		store->get(key, RakNet::OnExpired([](int _value) {}, []() { retry(); }));
+	template<typename Callback, typename ExpiredHandler>
+	detail::ExpiringCallback<typename std::decay<Callback>::type, typename std::decay<ExpiredHandler>::type> OnExpired(Callback&& _callback, ExpiredHandler&& _onExpired)
+	{
+		return{ std::forward<Callback>(_callback), std::forward<ExpiredHandler>(_onExpired) };
+	}
+
+	// Proxies may be called and callbacks answered from any thread. Messages that are not
+	// issued on the thread that pumps the RakPeer go through a lock-free queue and are sent,
+	// and their return slots registered, on the next Update().
 	class RakServicePlugin	: public PluginInterface2
 	{
-		class ForeignServiceTable;
+		class ConnectionState;
+		class RakNetTransport;
 	public:
-		typedef std::function<void(detail::DeserializationArgs&)> ServiceFunctionReturnSlot;
+		typedef detail::ReturnSlot ServiceFunctionReturnSlot;
 		typedef detail::ReturnSlotId ReturnSlotId;
 	public:
 		RakServicePlugin(char channel = 0);
 		virtual ~RakServicePlugin();
 
-		void AddService(const char* name, RakService* service);
-		RakService* GetService(const char* name);
-		RakService* RemoveService(const char* name);
+		void AddService(const ServiceName& name, RakService* service);
+		RakService* GetService(const ServiceName& name) const;
+		RakService* RemoveService(const ServiceName& name);
 
+		// Gives service an id of this plugin, on the network thread. Services serialized for the first time on
+		// another thread are introduced by their message when it is sent, a service is introduced by one thread.
 		void IntroduceService(RakService* service);
+		// Services of a RakServicePlugin in this process are returned as they are, see ConnectService
 		template<typename Service>
 		Service* GetForeignService(const SystemAddress& addr, RakServiceId sid)
 		{
 			RakService* gservice = _GetForeignService(addr, sid);
+			if (!gservice)
+				gservice = _FindSameProcessService(addr, sid);
 
 			if (gservice)
 			{
@@ -295,64 +1934,505 @@ namespace RakNet {
 		}
 
 		inline NetworkIDManager* GetNetworkIdManager() { return mIdManager; }
+
+		// Proxy that calls all foreign services in [_begin, _end) at once. The arguments are serialized
+		// once and the same message is sent to every member. Callbacks are called once for every member
+		// that answers, except for those of CallFuture and CallAsync, which take the first answer. A
+		// callback that got an answer is never expired, see OnExpired.
+		template<typename Service, typename Iterator>
+		std::unique_ptr<Service> MakeGroup(Iterator _begin, Iterator _end);
+
+		template<typename Service>
+		std::unique_ptr<Service> MakeGroup(const std::vector<Service*>& _members)
+		{
+			return MakeGroup<Service>(_members.begin(), _members.end());
+		}
+
+		// Hands incoming invocations to _dispatcher instead of running them inside OnReceive.
+		// Invocations of the same service, peer or both (see _order) keep their order.
+		void SetDispatcher(RakServiceDispatcher* _dispatcher, RakServiceDispatchOrder _order = RakServiceDispatchOrder::PER_SERVICE);
+		inline RakServiceDispatcher* GetDispatcher() const { return mDispatcher; }
+
+		// Collects outgoing invokes and returns per destination and sends them as one SMI_BATCH
+		// message on the next Update() or as soon as a batch would grow beyond _maxBatchBytes.
+		// A message with other send options than the batch for its destination sends the batch
+		// first, so the peer gets the messages in the order they were made.
+		void SetBatching(bool _enabled, unsigned int _maxBatchBytes = 1200);
+		inline bool IsBatching() const { return mBatching; }
+		void FlushBatches();
+
+		// Highest wire format this plugin offers in SMI_CONNECT. Each connection uses the highest
+		// version both peers offer, peers that do not know about versions speak version 1.
+		void SetWireVersion(unsigned char _version);
+		inline unsigned char GetWireVersion() const { return mWireVersion; }
+
+		// Sends ServiceBlobs larger than _thresholdBytes as chunks on their own ordered _channel,
+		// followed by the message that carries them, so they do not hold up small calls.
+		// At most _bytesPerUpdate chunk bytes are sent per Update(), shared by all transfers.
+		// Streamed messages are not ordered with the messages sent on the regular channels.
+		void SetStreaming(bool _enabled, unsigned int _thresholdBytes = 16 * 1024, char _channel = 1, unsigned int _bytesPerUpdate = 256 * 1024);
+		inline bool IsStreaming() const { return mStreamThreshold.load(std::memory_order_relaxed) > 0; }
+		// streamed blobs announcing more bytes are dropped
+		inline void SetMaxBlobSize(unsigned int _maxBytes) { mMaxBlobBytes = _maxBytes; }
+		// Bytes of streamed blobs a peer may have received that still wait for their message. A blob that goes
+		// over it is dropped and its message gets an empty ServiceBlob, as do blobs beyond the 64 a peer may
+		// have open at once.
+		inline void SetMaxPendingBlobBytes(unsigned int _maxBytes) { mMaxPendingBlobBytes = _maxBytes; }
+		inline std::size_t GetPendingTransferCount() const { return mTransfers.size(); }
+
+		// Counts calls, returns and bytes per service function and records round trip and handler times,
+		// see RakServiceMetrics.hpp. Off by default, the counters of a function are kept once it was used.
+		// Handler times include reading the arguments unless the invocation goes through a dispatcher.
+		void SetMetrics(bool _enabled);
+		inline bool HasMetrics() const { return mMetricsEnabled.load(std::memory_order_relaxed); }
+		// may be called from any thread
+		RakServiceMetricsSnapshot GetMetrics() const;
+
+		// Skips the network for peers whose RakServicePlugin runs in this process, is pumped by the same
+		// thread and has no dispatcher, as long as this plugin holds no proxies of them. ConnectService and
+		// GetForeignService then return the peer's services themselves instead of proxies. Calls on them
+		// run directly on the calling thread and so do their callbacks, in the order they are made, and
+		// InvokeOrigin() is not set for them. Off by default.
+		inline void SetSameProcessCalls(bool _enabled) { mSameProcessCalls = _enabled; }
+		inline bool HasSameProcessCalls() const { return mSameProcessCalls; }
+
+		// Sends and receives through _transport instead of the RakPeer, nullptr goes back to the RakPeer.
+		// The transport is not owned and has to outlive its use.
+		void SetTransport(RakServiceTransport* _transport);
+		// handles a message a transport received, false if it is not meant for a RakServicePlugin
+		bool HandleMessage(const SystemAddress& _sender, const unsigned char* _data, unsigned int _length);
+
+		// Sends everything for _address through _link instead of RakNet and handles the messages read from
+		// it in Update() as if they came from _address, see RakServiceSharedMemory.hpp. _address only names
+		// the peer, it needs no RakNet connection. Messages the ring has no room for wait for the next Update().
+		// Send options do not apply, the link delivers everything reliably and in order. A message larger than
+		// the link's maxMessageSize() can not be delivered, the link is then removed in the next Update() like
+		// with RemoveSharedMemoryLink. SetStreaming sends large blobs in chunks that fit.
+		void AddSharedMemoryLink(const SystemAddress& _address, std::unique_ptr<RakServiceSharedMemoryLink> _link);
+		// Closes the link and the connection to _address like OnClosedConnection. Happens in Update() as well
+		// once the peer closed its end and everything it sent was handled.
+		void RemoveSharedMemoryLink(const SystemAddress& _address);
+		// to wait() on it while there is nothing else to do, nullptr if _address has no link
+		RakServiceSharedMemoryLink* GetSharedMemoryLink(const SystemAddress& _address) const;
+		inline std::size_t GetSharedMemoryLinkCount() const { return mSharedMemoryLinks.size(); }
 		
-		template<typename ServiceType>
-		void ConnectService(const char* name, AddressOrGUID systemIdentifier, std::function<void(ServiceType*)> handler)
+		// handler is anything callable with a ServiceType*, see RakServiceAsync.hpp for futures and coroutines.
+		//
+		// With SetSameProcessCalls the service may be connected without the network, handler is then
+		// called before ConnectService returns.
+		template<typename ServiceType, typename Handler>
+		void ConnectService(const ServiceName& name, AddressOrGUID systemIdentifier, Handler&& handler)
 		{
-			_ConnectService(name, systemIdentifier, detail::WrapFunction(handler));
+			ServiceCallback<void(ServiceType*)> callback(std::forward<Handler>(handler));
+			RakService* local = nullptr;
+			if (_ConnectSameProcess(&name, 1, systemIdentifier, &local))
+			{
+				callback(dynamic_cast<ServiceType*>(local));
+				return;
+			}
+			_ConnectService(name, systemIdentifier, detail::WrapFunction(std::move(callback)));
+		}
+
+		// Connects several services of one peer, handler is called once with all of them (null for unknown names).
+		// Connections that negotiated wire version 2 send a single SMI_CONNECT_MANY and refer to names
+		// sent before by a token, others send one SMI_CONNECT per name.
+		//
+		//		plugin.ConnectServices<Chat, Store>({ "chat", "store" }, server, [](Chat* chat, Store* store) {});
+		template<typename... ServiceTypes, typename Handler>
+		void ConnectServices(const ServiceName (&names)[sizeof...(ServiceTypes)], AddressOrGUID systemIdentifier, Handler&& handler)
+		{
+			static_assert(sizeof...(ServiceTypes) > 0 && sizeof...(ServiceTypes) <= MaxConnectBatch, "ConnectServices takes 1 to MaxConnectBatch services");
+			ServiceCallback<void(ServiceTypes*...)> callback(std::forward<Handler>(handler));
+
+			RakService* local[sizeof...(ServiceTypes)];
+			if (_ConnectSameProcess(names, sizeof...(ServiceTypes), systemIdentifier, local))
+			{
+				_AnswerSameProcess<ServiceTypes...>(callback, local, typename detail::MakeIndexSequence<sizeof...(ServiceTypes)>::type());
+				return;
+			}
+
+			auto* connection = _FindNegotiatedConnection(systemIdentifier);
+			if (connection)
+				_ConnectServices(connection, names, sizeof...(ServiceTypes), detail::WrapFunction(std::move(callback)));
+			else
+				_ConnectEach<ServiceTypes...>(names, systemIdentifier, std::move(callback), typename detail::MakeIndexSequence<sizeof...(ServiceTypes)>::type());
 		}
 
+		// most services a single SMI_CONNECT_MANY asks for
+		static const std::size_t MaxConnectBatch = 32;
+
+		inline const detail::StreamPoolStats& GetStreamPoolStats() const { return mStreamPool.stats(); }
+		inline std::size_t GetPendingReturnCount() const { return mReturnSlots.size(); }
+
+		// Calls with a callback that are not answered within _timeoutMs expire: their return slot is freed
+		// and the callback is dropped, after its expire() ran if it has one (see OnExpired). Deadlines are
+		// checked in Update() to the millisecond, on the transport's clock. 0, the default, waits forever.
+		// RakServiceDeadline sets the timeout of single calls. Direct calls in the same process never expire.
+		inline void SetCallTimeout(unsigned int _timeoutMs) { mCallTimeout.store(_timeoutMs, std::memory_order_relaxed); }
+		inline unsigned int GetCallTimeout() const { return mCallTimeout.load(std::memory_order_relaxed); }
+		// Gives up on a pending call like an expiry, false if it is not pending. Network thread only
+		bool CancelCall(ReturnSlotId _call);
+		inline std::size_t GetExpiredCallCount() const { return mExpiredCalls; }
+
+		// Expired and cancelled calls send SMI_CANCEL to the peer that was to answer them. The peer then
+		// drops the answer and reports the call in IsCallCancelled, so a service can stop working on it.
+		// Group calls are never cancelled on the peers. Peers that do not know the message ignore it. Off by default.
+		inline void SetCancelMessages(bool _enabled) { mCancelMessages = _enabled; }
+		inline bool HasCancelMessages() const { return mCancelMessages; }
+		// _origin cancelled its call _call, see RakService::InvokeCallId. Only the last MaxCancelledCalls
+		// cancels of each peer that have not been answered are kept. Network thread only
+		bool IsCallCancelled(const SystemAddress& _origin, ReturnSlotId _call);
+		static const std::size_t MaxCancelledCalls = 64;
+
+		// Limits the calls with a callback that wait for the answers of a single peer, the window's policy
+		// decides about the calls beyond, see RakServiceWindowPolicy. Only calls made after a window was set
+		// count. Held back calls are sent in order as answers arrive, expire or are cancelled, and their
+		// deadlines run while they wait. Calls without a callback, group calls and direct calls in the same
+		// process are never held back, so they may overtake held back calls. Network thread only
+		void SetCallWindow(const RakServiceCallWindow& _window);
+		// Window per peer for the calls to services of type Service, on top of the peer's window.
+		// Calls to other services are still sent while it is full
+		template<typename Service>
+		void SetServiceCallWindow(const RakServiceCallWindow& _window)
+		{
+			_SetServiceCallWindow(GenericRakService<Service>::MetaInfo(), _window);
+		}
+		// network thread only
+		RakServicePeerLoad GetPeerLoad(const SystemAddress& _address) const;
+		// held back calls to all peers
+		inline std::size_t GetQueuedCallCount() const { return mQueuedCalls; }
+		// _handler runs when calls to a peer start to be held back, and with false once none are held back anymore.
+		// Calls rejected by RakServiceWindowPolicy::REJECT are only counted in RakServicePeerLoad::rejected.
+		inline void SetCongestionHandler(std::function<void(const SystemAddress&, bool _congested)> _handler) { mCongestionHandler = std::move(_handler); }
+
+		// local service by id, proxies peers hand back to this plugin resolve to it
+		inline RakService* _FindService(RakServiceId sid) const { return sid < mServices.size() ? mServices[sid] : nullptr; }
+		// IntroduceService for a service written to _stream, which may be serialized on any thread
+		void _IntroduceService(RakService* _service, const BitStream& _stream);
+
+		// nullptr while metrics are off
+		detail::FunctionMetrics* _GetFunctionMetrics(RakService* _service, ServiceFunctionId _fid);
+
+		detail::PooledStream _AcquireStream();
 		ReturnSlotId _RegisterReturn(ServiceFunctionReturnSlot _callback);
-		void _BeginReturn(detail::SerializationArgs&, ReturnSlotId rid);
-		void _EndReturn(detail::SerializationArgs&, const SystemAddress& _address);
-		void _EndCall(const BitStream& stream, const SystemAddress& _address);
+		void _WriteReturn(detail::SerializationArgs& sargs, ServiceFunctionReturnSlot _callback);
+		void _BeginReturn(detail::SerializationArgs&, ReturnSlotId rid, bool _compact = false);
+		// true if the answer to _rid is not wanted anymore, it is forgotten then
+		bool _TakeCancelledReturn(const SystemAddress& _address, ReturnSlotId _rid);
+		void _EndReturn(detail::SerializationArgs&, const SystemAddress& _address, const RakServiceSendOptions& _options);
+		void _EndCall(const BitStream& stream, const SystemAddress& _address, const RakServiceSendOptions& _options, const detail::WindowedCall& _call);
+		void _SendGroup(BitStream& _stream, const std::vector<detail::GroupMember>& _members, const RakServiceSendOptions& _options);
+		void _WriteBlob(detail::SerializationArgs& sargs, const ServiceBlob& _blob);
+		ServiceBlob _TakeBlob(const SystemAddress& _address, unsigned int _id, unsigned int _size);
 	public:
 		// Handle Plugin stuff
 		virtual void OnAttach(void) override;
 		virtual void OnDetach(void) override;
+		virtual void Update(void) override;
 		virtual PluginReceiveResult OnReceive(Packet *packet) override;
+		// Runs the disconnect handlers of the local services the peer knows and of its proxies,
+		// then deletes the proxies. Callbacks still waiting for the peer's returns expire first.
 		virtual void OnClosedConnection(const SystemAddress &systemAddress, RakNetGUID rakNetGUID, PI2_LostConnectionReason lostConnectionReason) override;
 
 	private:
+		// message whose streamed blobs are still being sent
+		struct OutgoingTransfer
+		{
+			inline OutgoingTransfer(const AddressOrGUID& _target, detail::PooledStream&& _message, std::vector<detail::OutgoingBlob>&& _blobs)
+				: target(_target)
+				, message(std::move(_message))
+				, blobs(std::move(_blobs))
+				, blob(0)
+				, offset(0)
+			{
+			}
+
+			AddressOrGUID target;
+			detail::PooledStream message;
+			std::vector<detail::OutgoingBlob> blobs;
+			// position of the next chunk
+			std::size_t blob;
+			std::size_t offset;
+		};
+
+		struct OutgoingBatch
+		{
+			inline OutgoingBatch(const SystemAddress& _target, detail::PooledStream&& _stream)
+				: target(_target)
+				, stream(std::move(_stream))
+				, messages(0)
+			{
+			}
+
+			SystemAddress target;
+			// of every message in the batch
+			RakServiceSendOptions options;
+			detail::PooledStream stream;
+			unsigned int messages;
+		};
+
+		struct SharedMemoryPeer
+		{
+			SystemAddress address;
+			std::unique_ptr<RakServiceSharedMemoryLink> link;
+			// messages the ring had no room for, in order
+			std::deque<std::vector<unsigned char>> backlog;
+			// a message did not fit into the ring, the link is closed in the next Update()
+			bool broken = false;
+		};
+
+		struct WelcomeService
+		{
+			std::string name;
+			RakService* service;
+		};
+
+		template<typename... ServiceTypes, std::size_t... I>
+		void _ConnectEach(const ServiceName* _names, const AddressOrGUID& _target, ServiceCallback<void(ServiceTypes*...)>&& _handler, detail::IndexSequence<I...>)
+		{
+			auto join = std::make_shared<detail::ConnectJoin<ServiceTypes...>>(std::move(_handler));
+			int expand[] = { (_ConnectService(_names[I], _target, detail::WrapFunction(ServiceCallback<void(ServiceTypes*)>(detail::ConnectJoinPart<I, ServiceTypes...>{ join }))), 0)... };
+			(void)expand;
+		}
 
-		void _ConnectService(const char* name, AddressOrGUID systemIdentifier, ServiceFunctionReturnSlot handler);
-		void _HandlePackage(BitStream& _stream, Packet* packet);
-		void _HandleConnect(BitStream& _stream, Packet* packet);
-		void _HandleReturn(BitStream& _stream, Packet* packet);
-		void _HandleInvoke(BitStream& _stream, Packet* packet);
-		ForeignServiceTable*_GetForeignServiceTable(const SystemAddress& addr);
+		template<typename... ServiceTypes, std::size_t... I>
+		static void _AnswerSameProcess(ServiceCallback<void(ServiceTypes*...)>& _handler, RakService* const* _services, detail::IndexSequence<I...>)
+		{
+			_handler(dynamic_cast<ServiceTypes*>(_services[I])...);
+		}
+
+		void _ConnectService(const ServiceName& name, AddressOrGUID systemIdentifier, ServiceFunctionReturnSlot handler);
+		// connects _names on a plugin of this process that can be called directly, false to go through the network
+		bool _ConnectSameProcess(const ServiceName* _names, std::size_t _count, const AddressOrGUID& _target, RakService** _services);
+		// plugin attached to _target's RakPeer in this process whose services may be called from this thread
+		RakServicePlugin* _FindSameProcessPlugin(const AddressOrGUID& _target) const;
+		RakService* _FindSameProcessService(const SystemAddress& _addr, RakServiceId _sid);
+		void _ConnectServices(ConnectionState* _connection, const ServiceName* _names, std::size_t _count, ServiceFunctionReturnSlot _handler);
+		// connection to _target that can take SMI_CONNECT_MANY, only known on the network thread
+		ConnectionState* _FindNegotiatedConnection(const AddressOrGUID& _target);
+		RakService* _FindWelcomeService(const ServiceStringView& _name, unsigned int _hash) const;
+		// runs OnConnect of the welcome service _name, if there is one, and returns it
+		RakService* _WelcomeConnect(const SystemAddress& _addr, const ServiceStringView& _name, unsigned int _hash);
+		void _Send(const BitStream& _stream, const AddressOrGUID& _target, const RakServiceSendOptions& _options);
+		void _SendUnbatched(const BitStream& _stream, const AddressOrGUID& _target, const RakServiceSendOptions& _options);
+		// one send of _stream to all of _members, after what is batched for them
+		void _SendToMembers(const BitStream& _stream, const detail::GroupMember* _members, std::size_t _count, const RakServiceSendOptions& _options);
+		void _SendBatch(OutgoingBatch& _batch);
+		void _SendStreamed(const BitStream& _stream, const AddressOrGUID& _target, std::vector<detail::OutgoingBlob>&& _blobs);
+		void _PumpTransfers();
+		// address of _target, resolved through the transport if only the guid is known
+		SystemAddress _ResolveAddress(const AddressOrGUID& _target) const;
+		SharedMemoryPeer* _FindSharedMemoryPeer(const SystemAddress& _address) const;
+		void _SendSharedMemory(SharedMemoryPeer& _peer, const BitStream& _stream);
+		void _PumpSharedMemory();
+		// _batched for an entry of an SMI_BATCH, which may not be a batch itself
+		void _HandlePackage(BitStream& _stream, const SystemAddress& _sender, bool _batched = false);
+		void _HandleBatch(BitStream& _stream, const SystemAddress& _sender);
+		void _HandleConnect(BitStream& _stream, const SystemAddress& _sender);
+		void _HandleConnectMany(BitStream& _stream, const SystemAddress& _sender);
+		void _HandleReturn(BitStream& _stream, const SystemAddress& _sender);
+		void _HandleInvoke(BitStream& _stream, const SystemAddress& _sender);
+		void _HandleNotify(BitStream& _stream, const SystemAddress& _sender);
+		void _HandleChunk(BitStream& _stream, const SystemAddress& _sender);
+		void _HandleCancel(BitStream& _stream, const SystemAddress& _sender);
+		void _HandlePacked(BitStream& _stream, const SystemAddress& _sender, unsigned char _header);
+		void _DeliverReturn(ReturnSlotId _rid, BitStream& _stream, const SystemAddress& _sender, unsigned char _version);
+		void _DeliverInvoke(RakServiceId _sid, ServiceFunctionId _fid, BitStream& _stream, const SystemAddress& _sender, unsigned char _version);
+		void _DeliverNotify(RakServiceId _sid, ServiceFunctionId _fid, BitStream& _stream, const SystemAddress& _sender, unsigned char _version);
+		void _InvokeService(RakService* _service, ServiceFunctionId _fid, detail::DeserializationArgs& _args);
+		// adds an introduced service to mServices
+		void _RegisterService(RakService* _service);
+		bool _IsNetworkThread() const;
+		void _SetNetworkThread();
+		void _EnqueueOutbound(const BitStream& _stream, const AddressOrGUID& _target, const RakServiceSendOptions& _options, const std::vector<detail::GroupMember>* _group = nullptr, const detail::WindowedCall* _call = nullptr);
+		void _DrainOutboundQueue();
+		// registers a return slot, with a deadline unless _timeoutMs is 0
+		// a compact slot that finds no free index is expired right away and InvalidId is returned
+		ReturnSlotId _AddReturn(ServiceFunctionReturnSlot&& _slot, unsigned int _replies, unsigned int _owner, detail::FunctionMetrics* _metrics, unsigned int _timeoutMs, bool _compact);
+		// makes _rid wait for one return from each of _members
+		void _SetGroupMembers(ReturnSlotId _rid, const std::vector<detail::GroupMember>& _members);
+		// the deadline clock in milliseconds
+		std::uint64_t _DeadlineNow() const;
+		void _ExpireCalls();
+		// tells the peer and the callback of a call that was given up, _wireRid is the id the peer knows
+		void _DropCall(ReturnSlotId _rid, ReturnSlotId _wireRid, ServiceFunctionReturnSlot& _slot, unsigned int _owner, const detail::SlotWindow& _window);
+		ConnectionState* _FindConnectionById(unsigned int _id) const;
+		void _SetServiceCallWindow(const RakServiceMetaInfo* _meta, const RakServiceCallWindow& _window);
+		// sends the call _rid waits for or holds it back if its window is full
+		void _SendCall(const BitStream& _stream, const SystemAddress& _address, const RakServiceSendOptions& _options, const detail::WindowedCall& _call, ReturnSlotId _rid);
+		// the window that keeps _call from being sent to _connection, nullptr if it fits
+		const RakServiceCallWindow* _FullWindow(const ConnectionState* _connection, const detail::WindowedCall& _call) const;
+		void _HoldCall(ConnectionState* _connection, const BitStream& _stream, const RakServiceSendOptions& _options, const detail::WindowedCall& _call, ReturnSlotId _rid, const RakServiceCallWindow& _window);
+		// a slot that counted against _connection's windows was released
+		void _ReleaseWindow(ConnectionState* _connection, ReturnSlotId _rid, const detail::SlotWindow& _window);
+		// sends the held back calls of _connection that fit now
+		void _PumpWindow(ConnectionState* _connection);
+		void _SetCongested(ConnectionState* _connection, bool _congested);
+		ConnectionState* _GetConnection(const SystemAddress& addr);
+		// like _GetConnection, but nullptr instead of a new state for unknown peers
+		ConnectionState* _FindConnection(const SystemAddress& _addr) const;
+		// tag for return slots answered by _target, 0 if it can not be resolved
+		unsigned int _GetConnectionOwner(const AddressOrGUID& _target);
 		RakService* _GetForeignService(const SystemAddress& addr, RakServiceId sid);
 		void _AddForeignService(const SystemAddress& addr, RakServiceId sid, RakService* serivce);
 		void _AddForeignServiceHandle(const SystemAddress& addr, RakService* service);
 	private:
 		NetworkIDManager* mIdManager;
 		const char mChannel;
-		ReturnSlotId mNextReturnSlotId;
-		RakServiceId mNextServiceId;
-		std::unordered_map<ReturnSlotId, ServiceFunctionReturnSlot> mReturnSlots;
-		std::unordered_map<std::string, RakService*> mWelcomeServices;
-		std::unordered_map<RakServiceId, RakService*> mServices;
-		std::unordered_map<SystemAddress, std::unique_ptr<ForeignServiceTable>, detail::SystemAddressHash> mForeignServices;
+		detail::StreamPool mStreamPool;
+		// taken on any thread, see _IntroduceService
+		std::atomic<RakServiceId> mNextServiceId;
+		detail::TimerWheel mDeadlines;
+		detail::ReturnSlotTable mReturnSlots;
+		std::vector<detail::TimerWheel::Timer> mDueTimers;
+		std::atomic<unsigned int> mCallTimeout;
+		bool mCancelMessages;
+		// set once a peer cancelled a call, until then answers skip the lookup
+		bool mReceivedCancels;
+		std::size_t mExpiredCalls;
+		RakServiceCallWindow mCallWindow;
+		std::unordered_map<const RakServiceMetaInfo*, RakServiceCallWindow> mServiceWindows;
+		// set once any window is set, until then calls skip the bookkeeping
+		bool mWindowed;
+		std::size_t mQueuedCalls;
+		std::function<void(const SystemAddress&, bool)> mCongestionHandler;
+		// return slot _WriteReturn registered for the call that is being serialized on the network thread
+		const BitStream* mWrittenCallStream;
+		ReturnSlotId mWrittenCall;
+		// keyed by ServiceName::hash(), so names read from packets are looked up without copying them
+		std::unordered_multimap<unsigned int, WelcomeService, detail::PrecomputedHash> mWelcomeServices;
+		// local services indexed by service id
+		std::vector<RakService*> mServices;
+		// owns the state of every peer, mConnectionSlots caches it by SystemAddress::systemIndex
+		std::unordered_map<SystemAddress, std::unique_ptr<ConnectionState>, detail::SystemAddressHash> mConnections;
+		std::vector<ConnectionState*> mConnectionSlots;
+		// states of closed connections, reused for new peers
+		std::vector<std::unique_ptr<ConnectionState>> mConnectionPool;
+		// open connections by the index part of their id, see _FindConnectionById
+		std::vector<ConnectionState*> mConnectionsById;
+		std::vector<unsigned int> mFreeConnectionIndices;
+		// generation part of the next connection id
+		unsigned int mNextConnectionId;
+		bool mBatching;
+		unsigned int mMaxBatchBytes;
+		std::vector<OutgoingBatch> mBatches;
+		// one open batch per destination, so its messages cannot be reordered against each other
+		std::unordered_map<SystemAddress, std::size_t, detail::SystemAddressHash> mBatchIndex;
+		// addresses of the group members that share a send, kept to reuse the allocation
+		std::vector<SystemAddress> mGroupTargets;
+		unsigned char mWireVersion;
+		std::atomic<unsigned int> mStreamThreshold;
+		unsigned int mStreamBytesPerUpdate;
+		unsigned int mMaxBlobBytes;
+		unsigned int mMaxPendingBlobBytes;
+		RakServiceSendOptions mStreamOptions;
+		std::atomic<unsigned int> mNextBlobId;
+		std::deque<std::unique_ptr<OutgoingTransfer>> mTransfers;
+		// usually a handful, so they are searched linearly
+		std::vector<std::unique_ptr<SharedMemoryPeer>> mSharedMemoryLinks;
+		std::unique_ptr<RakNetTransport> mRakNetTransport;
+		RakServiceTransport* mTransport;
+		RakServiceDispatcher* mDispatcher;
+		RakServiceDispatchOrder mDispatchOrder;
+		bool mSameProcessCalls;
+		std::atomic<bool> mMetricsEnabled;
+		// by service type. Services cache their entry, so the lock is only taken the first time they are used
+		mutable std::mutex mMetricsMutex;
+		std::unordered_map<const RakServiceMetaInfo*, std::unique_ptr<detail::ServiceMetrics>> mMetrics;
+		std::atomic<std::thread::id> mNetworkThread;
+		detail::OutboundQueue mOutboundQueue;
 	};
 
+	namespace detail {
+
+		template<typename... Sig>
+		void ReturnInvocation<Sig...>::operator()(Sig... fargs) const
+		{
+			if (plugin->_TakeCancelledReturn(addr, rid))
+				return;
+
+			auto stream = plugin->_AcquireStream();
+			SerializationArgs args(*stream, plugin);
+			args.version = version;
+			args.receiver = &addr;
+			plugin->_BeginReturn(args, rid, compact);
+			PackCall(args, std::forward<Sig>(fargs)...);
+			plugin->_EndReturn(args, addr, sendOptions ? *sendOptions : RakServiceSendOptions());
+		}
+
+		template<typename... Sig>
+		void SerializeFunction::write(SerializationArgs& args, const std::function<void(Sig...)>& _func)
+		{
+			args.plugin->_WriteReturn(args, WrapFunction(_func));
+		}
+
+		template<std::size_t Capacity, typename... Sig>
+		void SerializeFunction::write(SerializationArgs& args, InplaceFunction<void(Sig...), Capacity>&& _func)
+		{
+			args.plugin->_WriteReturn(args, WrapFunction(std::move(_func)));
+		}
+
+		template<typename T>
+		void DeserializeService::read(DeserializationArgs& args, T*& _p)
+		{
+			static_assert(std::is_base_of<RakService, T>::value, "_p must be a RakService!");
+
+			bool isNull;
+			args.stream >> isNull;
+			if (isNull)
+			{
+				_p = nullptr;
+				return;
+			}
+
+			RakServiceId sid;
+			bool home = false;
+			if (args.version >= WireVersion2)
+			{
+				args.stream >> home;
+				unsigned long long value = 0;
+				ReadVarint(args.stream, value);
+				sid = static_cast<RakServiceId>(value);
+			}
+			else{
+				args.stream >> sid;
+			}
+			if (home)
+			{
+				// one of our own services the peer hands back
+				_p = dynamic_cast<T*>(args.plugin->_FindService(sid));
+				return;
+			}
+			_p = args.plugin->GetForeignService<T>(args.recvAddress, sid);
+		}
+	}
+
 	class RakServiceFunctionMetaInfo
 	{
 	public:
-		inline RakServiceFunctionMetaInfo(ServiceFunctionId _id, const char* _name, const char* _signatur)
-			: mName(_name)
-			, mId(_id)
+		// One-way functions must not take callbacks. They are sent as SMI_NOTIFY,
+		// which has a shorter header and is dispatched without any return bookkeeping.
+		inline RakServiceFunctionMetaInfo(ServiceFunctionId _id, const char* _name, const char* _signatur, const RakServiceSendOptions& _sendOptions = RakServiceSendOptions(), bool _oneWay = false)
+			: mId(_id)
+			, mName(_name)
 			, mSignatur(_signatur)
+			, mSendOptions(_sendOptions)
+			, mOneWay(_oneWay)
 		{
 		}
 
 		inline const char* name() const { return mName; }
 		inline const char* signatur() const { return mSignatur; }
-		inline const ServiceFunctionId id() const { return mId; }
+		inline ServiceFunctionId id() const { return mId; }
+		inline const RakServiceSendOptions& sendOptions() const { return mSendOptions; }
+		inline bool isOneWay() const { return mOneWay; }
 		
 	private:
 		const ServiceFunctionId mId;
 		const char* mName;
 		const char* mSignatur;
+		const RakServiceSendOptions mSendOptions;
+		const bool mOneWay;
 	};
 
 	class RakServiceMetaInfo
@@ -388,6 +2468,12 @@ namespace RakNet {
 			return mService._IsForeignService();
 		}
 
+		// peer a foreign service lives on
+		const SystemAddress& GetForeignAddress() const
+		{
+			return mService._mForeignAddress;
+		}
+
 		const RakServiceMetaInfo* GetMetaInfo() const
 		{ 
 			return mService._GetMetaInfo();
@@ -438,16 +2524,20 @@ namespace RakNet {
 		virtual void OnConnect();
 		virtual void OnDisconnect();
 
-		const SystemAddress& InvokeOrigin() const { return _mRecvAddress; }
+		// address of the peer whose invocation is currently running on this thread
+		const SystemAddress& InvokeOrigin() const;
+		// return slot the peer waits on for the answer of the invocation currently running on this thread as
+		// the peer sent it, 0 if it takes no callback. With InvokeOrigin() it names the call for RakServicePlugin::IsCallCancelled
+		detail::ReturnSlotId InvokeCallId() const;
 
 	protected:
-		void _BeginCall(BitStream& stream, ServiceFunctionId _funcId);
+		void _BeginCall(detail::SerializationArgs& sargs, ServiceFunctionId _funcId);
 		template<typename T>
-		void _AddArg(detail::SerializationArgs& sargs, const T& _arg)
+		void _AddArg(detail::SerializationArgs& sargs, T&& _arg)
 		{
-			detail::Serializer<T>::type::write(sargs, _arg);
+			detail::Serializer<typename std::decay<T>::type>::type::write(sargs, std::forward<T>(_arg));
 		}
-		void _EndCall(const BitStream& _stream, const SystemAddress& _address);
+		void _EndCall(BitStream& _stream, ServiceFunctionId _funcId, const SystemAddress& _address);
 		virtual bool _Invoke(detail::DeserializationArgs& _stream, ServiceFunctionId _func) = 0;
 		virtual const RakServiceMetaInfo* _GetMetaInfo() const = 0;
 		virtual bool _IsForeignService() const;
@@ -457,8 +2547,15 @@ namespace RakNet {
 	private:
 		RakServicePlugin* _mServicePlugin = nullptr;
 		RakServiceId _mServiceId = 0;
-		SystemAddress _mRecvAddress;
+		// peer a foreign service lives on
+		SystemAddress _mForeignAddress;
+		// wire format of calls through this proxy
+		unsigned char _mWireVersion = detail::WireVersion1;
+		// receivers of a group proxy created by RakServicePlugin::MakeGroup
+		std::unique_ptr<std::vector<detail::GroupMember>> _mGroup;
 		std::function<void(RakService*, const SystemAddress&)> _mDisconnectHandler;
+		// entry of the plugin's metrics for this service's type, set when it is first measured
+		std::atomic<detail::ServiceMetrics*> _mMetrics{ nullptr };
 	};
 
 	template<typename ServiceType>
@@ -476,6 +2573,29 @@ namespace RakNet {
 		static ServiceType* _CreateClientImplementation(const SystemAddress& addr);
 
 	};
+
+	template<typename Service, typename Iterator>
+	std::unique_ptr<Service> RakServicePlugin::MakeGroup(Iterator _begin, Iterator _end)
+	{
+		std::unique_ptr<std::vector<detail::GroupMember>> members(new std::vector<detail::GroupMember>());
+		for (; _begin != _end; ++_begin)
+		{
+			const RakService* member = *_begin;
+			RakAssert(member->_IsForeignService() && member->_mServicePlugin == this);
+			detail::GroupMember entry;
+			entry.address = member->_mForeignAddress;
+			entry.sid = member->_mServiceId;
+			members->push_back(entry);
+		}
+		// members with the same service id share the message header
+		std::stable_sort(members->begin(), members->end(), [](const detail::GroupMember& _a, const detail::GroupMember& _b) { return _a.sid < _b.sid; });
+
+		std::unique_ptr<Service> group(GenericRakService<Service>::_CreateClientImplementation(UNASSIGNED_SYSTEM_ADDRESS));
+		RakService* groupService = group.get();
+		groupService->_mServicePlugin = this;
+		groupService->_mGroup = std::move(members);
+		return group;
+	}
 }
 
 #endif
\ No newline at end of file
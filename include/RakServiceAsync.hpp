@@ -0,0 +1,322 @@
+#pragma once
+#ifndef _RAKNET_RAKSERVICEASYNC_HPP
+#define _RAKNET_RAKSERVICEASYNC_HPP
+
+#include <future>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+
+#include "RakService.hpp"
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#include <optional>
+#define RAKSERVICE_COROUTINES 1
+#endif
+
+// Future and coroutine style calls on top of the callback arguments of service functions.
+//
+// A service function whose last parameter is a ServiceCallback can be called as
+//
+//		std::future<int> result = RakNet::CallFuture(service, &Service::get, 21);
+//		int value = co_await RakNet::CallAsync(service, &Service::get, 21);
+//
+// The callback's arguments become the result: nothing for void(), the value for a single
+// argument and a std::tuple for more. ConnectServiceFuture and ConnectServiceAsync do the
+// same for RakServicePlugin::ConnectService.
+//
+// Results arrive on the thread that pumps the RakPeer, so a future must not be waited
+// for on that thread and an awaiting coroutine is resumed there. Calls that expire, are
+// cancelled (see RakServicePlugin::SetCallTimeout) or whose peer disconnects throw
+// RakServiceCallExpired instead. Calls through a group proxy (RakServicePlugin::MakeGroup)
+// result in the first member's answer.
+
+namespace RakNet {
+
+	class RakServiceCallExpired : public std::runtime_error
+	{
+	public:
+		inline RakServiceCallExpired()
+			: std::runtime_error("RakService call expired")
+		{
+		}
+	};
+
+	namespace detail {
+
+		template<typename... T>
+		struct LastType;
+
+		template<typename T>
+		struct LastType<T>
+		{
+			typedef T type;
+		};
+
+		template<typename T, typename... Rest>
+		struct LastType<T, Rest...> : LastType<Rest...> {};
+
+		template<typename... Sig>
+		struct CallResult
+		{
+			typedef std::tuple<typename std::decay<Sig>::type...> type;
+		};
+
+		template<>
+		struct CallResult<>
+		{
+			typedef void type;
+		};
+
+		template<typename T>
+		struct CallResult<T>
+		{
+			typedef typename std::decay<T>::type type;
+		};
+
+		template<typename Callback>
+		struct CallbackResult;
+
+		template<std::size_t Capacity, typename... Sig>
+		struct CallbackResult<InplaceFunction<void(Sig...), Capacity>> : CallResult<Sig...> {};
+
+		template<typename... Sig>
+		struct CallbackResult<std::function<void(Sig...)>> : CallResult<Sig...> {};
+
+		// result of calling a service function with the parameters Params... asynchronously
+		template<typename... Params>
+		struct AsyncResult : CallbackResult<typename LastType<Params...>::type> {};
+
+		inline void SetPromise(std::promise<void>& _promise)
+		{
+			_promise.set_value();
+		}
+
+		template<typename T, typename Arg>
+		void SetPromise(std::promise<T>& _promise, Arg&& _arg)
+		{
+			_promise.set_value(std::forward<Arg>(_arg));
+		}
+
+		template<typename T, typename Arg1, typename Arg2, typename... Args>
+		void SetPromise(std::promise<T>& _promise, Arg1&& _arg1, Arg2&& _arg2, Args&&... _args)
+		{
+			_promise.set_value(T(std::forward<Arg1>(_arg1), std::forward<Arg2>(_arg2), std::forward<Args>(_args)...));
+		}
+
+		// Callback that fulfills a promise. A callback that is dropped without being
+		// called breaks the promise, so the future reports std::future_errc::broken_promise.
+		// Group calls answer once per member, the promise keeps the first answer.
+		template<typename Result>
+		struct PromiseCallback
+		{
+			template<typename... Args>
+			void operator()(Args&&... _args)
+			{
+				if (settled)
+					return;
+				settled = true;
+				SetPromise(promise, std::forward<Args>(_args)...);
+			}
+
+			void expire()
+			{
+				if (settled)
+					return;
+				settled = true;
+				promise.set_exception(std::make_exception_ptr(RakServiceCallExpired()));
+			}
+
+			std::promise<Result> promise;
+			bool settled = false;
+		};
+
+#ifdef RAKSERVICE_COROUTINES
+		template<typename Result>
+		class ReturnAwaiter
+		{
+		public:
+			inline bool await_ready() const noexcept { return false; }
+
+			inline Result await_resume()
+			{
+				if (!mResult)
+					throw RakServiceCallExpired();
+				return std::move(*mResult);
+			}
+
+			template<typename... Args>
+			void complete(Args&&... _args)
+			{
+				mResult.emplace(std::forward<Args>(_args)...);
+				mHandle.resume();
+			}
+
+			// resumes without a result
+			inline void expire()
+			{
+				mHandle.resume();
+			}
+
+		protected:
+			std::coroutine_handle<> mHandle;
+			std::optional<Result> mResult;
+		};
+
+		template<>
+		class ReturnAwaiter<void>
+		{
+		public:
+			inline bool await_ready() const noexcept { return false; }
+
+			inline void await_resume()
+			{
+				if (mExpired)
+					throw RakServiceCallExpired();
+			}
+
+			inline void complete()
+			{
+				mHandle.resume();
+			}
+
+			inline void expire()
+			{
+				mExpired = true;
+				mHandle.resume();
+			}
+
+		protected:
+			std::coroutine_handle<> mHandle;
+			bool mExpired = false;
+		};
+
+		// The only state of an awaited call besides the coroutine frame, small enough to stay inline in the return slot.
+		// The first answer of a group call resumes the coroutine, the awaiter may be gone for the others.
+		template<typename Awaiter>
+		struct ResumeCallback
+		{
+			template<typename... Args>
+			void operator()(Args&&... _args)
+			{
+				if (Awaiter* resumed = _Take())
+					resumed->complete(std::forward<Args>(_args)...);
+			}
+
+			inline void expire()
+			{
+				if (Awaiter* resumed = _Take())
+					resumed->expire();
+			}
+
+			inline Awaiter* _Take()
+			{
+				Awaiter* taken = awaiter;
+				awaiter = nullptr;
+				return taken;
+			}
+
+			Awaiter* awaiter;
+		};
+
+		template<typename Service, typename Function, typename Callback, typename... Args>
+		class CallAwaiter : public ReturnAwaiter<typename CallbackResult<Callback>::type>
+		{
+		public:
+			template<typename... CallArgs>
+			CallAwaiter(Service* _service, Function _function, CallArgs&&... _args)
+				: mService(_service)
+				, mFunction(_function)
+				, mArgs(std::forward<CallArgs>(_args)...)
+			{
+			}
+
+			void await_suspend(std::coroutine_handle<> _handle)
+			{
+				this->mHandle = _handle;
+				_call(typename MakeIndexSequence<sizeof...(Args)>::type());
+			}
+
+		private:
+			template<std::size_t... I>
+			void _call(IndexSequence<I...>)
+			{
+				// the return may resume the coroutine on the network thread before this returns,
+				// so nothing of the awaiter is touched after the call
+				(mService->*mFunction)(std::get<I>(std::move(mArgs))..., Callback(ResumeCallback<CallAwaiter>{ this }));
+			}
+
+		private:
+			Service* mService;
+			Function mFunction;
+			std::tuple<Args...> mArgs;
+		};
+
+		template<typename ServiceType>
+		class ConnectAwaiter : public ReturnAwaiter<ServiceType*>
+		{
+		public:
+			inline ConnectAwaiter(RakServicePlugin* _plugin, const char* _name, const AddressOrGUID& _target)
+				: mPlugin(_plugin)
+				, mName(_name)
+				, mTarget(_target)
+			{
+			}
+
+			void await_suspend(std::coroutine_handle<> _handle)
+			{
+				this->mHandle = _handle;
+				mPlugin->ConnectService<ServiceType>(mName, mTarget, ResumeCallback<ConnectAwaiter>{ this });
+			}
+
+		private:
+			RakServicePlugin* mPlugin;
+			const char* mName;
+			AddressOrGUID mTarget;
+		};
+#endif
+	}
+
+	// Calls _function on _service with _args and a callback as last argument, the future receives what the callback is called with
+	template<typename Service, typename Base, typename... Params, typename... Args>
+	std::future<typename detail::AsyncResult<Params...>::type> CallFuture(Service* _service, void (Base::*_function)(Params...), Args&&... _args)
+	{
+		typedef typename detail::LastType<Params...>::type Callback;
+		typedef typename detail::AsyncResult<Params...>::type Result;
+		static_assert(detail::is_inplace_function<Callback>::value, "CallFuture needs a function whose last parameter is a ServiceCallback");
+
+		detail::PromiseCallback<Result> callback;
+		auto future = callback.promise.get_future();
+		(_service->*_function)(std::forward<Args>(_args)..., Callback(std::move(callback)));
+		return future;
+	}
+
+	template<typename ServiceType>
+	std::future<ServiceType*> ConnectServiceFuture(RakServicePlugin* _plugin, const char* _name, const AddressOrGUID& _target)
+	{
+		detail::PromiseCallback<ServiceType*> callback;
+		auto future = callback.promise.get_future();
+		_plugin->ConnectService<ServiceType>(_name, _target, std::move(callback));
+		return future;
+	}
+
+#ifdef RAKSERVICE_COROUTINES
+	// Awaitable version of CallFuture. The call is issued when the coroutine suspends and
+	// the coroutine is resumed from _HandleReturn with the callback's arguments.
+	template<typename Service, typename Base, typename... Params, typename... Args>
+	detail::CallAwaiter<Service, void (Base::*)(Params...), typename detail::LastType<Params...>::type, typename std::decay<Args>::type...>
+		CallAsync(Service* _service, void (Base::*_function)(Params...), Args&&... _args)
+	{
+		return { _service, _function, std::forward<Args>(_args)... };
+	}
+
+	template<typename ServiceType>
+	detail::ConnectAwaiter<ServiceType> ConnectServiceAsync(RakServicePlugin* _plugin, const char* _name, const AddressOrGUID& _target)
+	{
+		return { _plugin, _name, _target };
+	}
+#endif
+}
+
+#endif
@@ -0,0 +1,208 @@
+#pragma once
+#ifndef _RAKNET_RAKSERVICEMETRICS_HPP
+#define _RAKNET_RAKSERVICEMETRICS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Per function call metrics of a RakServicePlugin, see RakServicePlugin::SetMetrics.
+//
+// Counters and histograms are updated with relaxed atomics from whatever thread sends,
+// receives or handles a call. GetMetrics copies them into a RakServiceMetricsSnapshot,
+// WriteMetricsText prints a snapshot in the Prometheus text format.
+
+namespace RakNet {
+
+	class RakServiceMetaInfo;
+
+	namespace detail {
+		class AtomicHistogram;
+	}
+
+	// Latency distribution in microseconds.
+	// Buckets are log-linear like those of an HDR histogram: every power of two is split into
+	// SubBuckets linear steps, so a value is known to within 1/SubBuckets of itself.
+	class RakServiceHistogram
+	{
+	public:
+		static const unsigned int SubBucketBits = 4;
+		static const unsigned int SubBuckets = 1u << SubBucketBits;
+		// covers values below 2^32 microseconds, larger ones are counted in the last bucket
+		static const unsigned int BucketCount = (32 - SubBucketBits + 1) * SubBuckets;
+
+		static unsigned int BucketOf(std::uint64_t _value);
+		// smallest and largest value counted in _bucket
+		static std::uint64_t BucketLow(unsigned int _bucket);
+		static std::uint64_t BucketHigh(unsigned int _bucket);
+
+	public:
+		inline RakServiceHistogram()
+			: mCount(0)
+			, mSum(0)
+			, mMax(0)
+			, mBuckets(BucketCount, 0)
+		{
+		}
+
+		inline std::uint64_t count() const { return mCount; }
+		inline std::uint64_t sum() const { return mSum; }
+		inline std::uint64_t max() const { return mMax; }
+		inline double mean() const { return mCount ? double(mSum) / double(mCount) : 0.0; }
+		inline const std::vector<std::uint64_t>& buckets() const { return mBuckets; }
+
+		// upper bound of the bucket holding the value below which _percentile percent of the values are
+		std::uint64_t percentile(double _percentile) const;
+
+	private:
+		friend class detail::AtomicHistogram;
+
+		std::uint64_t mCount;
+		std::uint64_t mSum;
+		std::uint64_t mMax;
+		std::vector<std::uint64_t> mBuckets;
+	};
+
+	struct RakServiceFunctionMetrics
+	{
+		std::string service;
+		std::string function;
+		unsigned int id = 0;
+		// invocations sent through proxies, and the returns their callbacks received
+		std::uint64_t calls = 0;
+		std::uint64_t returns = 0;
+		std::uint64_t bytesSent = 0;
+		// invocations of local services
+		std::uint64_t handled = 0;
+		std::uint64_t bytesReceived = 0;
+		// from registering a callback to its return, as seen by the caller
+		RakServiceHistogram roundTrip;
+		// time the local service function ran
+		RakServiceHistogram handlerTime;
+	};
+
+	struct RakServiceMetricsSnapshot
+	{
+		// functions that sent or received anything, grouped by service
+		std::vector<RakServiceFunctionMetrics> functions;
+	};
+
+	// Prometheus text exposition of _snapshot, with quantiles for the histograms
+	void WriteMetricsText(std::ostream& _out, const RakServiceMetricsSnapshot& _snapshot);
+
+	namespace detail {
+
+		typedef std::chrono::steady_clock MetricsClock;
+
+		inline std::uint64_t MetricsNow()
+		{
+			return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(MetricsClock::now().time_since_epoch()).count());
+		}
+
+		class AtomicHistogram
+		{
+		public:
+			AtomicHistogram();
+
+			void record(std::uint64_t _value);
+			void copyTo(RakServiceHistogram& _histogram) const;
+
+		private:
+			std::atomic<std::uint64_t> mCount;
+			std::atomic<std::uint64_t> mSum;
+			std::atomic<std::uint64_t> mMax;
+			std::atomic<std::uint32_t> mBuckets[RakServiceHistogram::BucketCount];
+		};
+
+		class FunctionMetrics
+		{
+		public:
+			FunctionMetrics();
+
+			inline void recordCall(std::size_t _bytes)
+			{
+				mCalls.fetch_add(1, std::memory_order_relaxed);
+				mBytesSent.fetch_add(_bytes, std::memory_order_relaxed);
+			}
+
+			inline void recordReturn(std::uint64_t _sentAt)
+			{
+				mReturns.fetch_add(1, std::memory_order_relaxed);
+				mRoundTrip.record(MetricsNow() - _sentAt);
+			}
+
+			inline void recordInvoke(std::size_t _bytes)
+			{
+				mHandled.fetch_add(1, std::memory_order_relaxed);
+				mBytesReceived.fetch_add(_bytes, std::memory_order_relaxed);
+			}
+
+			inline void recordHandler(std::uint64_t _micros)
+			{
+				mHandlerTime.record(_micros);
+			}
+
+			// false if the function neither sent nor received anything
+			bool copyTo(RakServiceFunctionMetrics& _metrics) const;
+
+		private:
+			std::atomic<std::uint64_t> mCalls;
+			std::atomic<std::uint64_t> mReturns;
+			std::atomic<std::uint64_t> mBytesSent;
+			std::atomic<std::uint64_t> mHandled;
+			std::atomic<std::uint64_t> mBytesReceived;
+			AtomicHistogram mRoundTrip;
+			AtomicHistogram mHandlerTime;
+		};
+
+		// metrics of all functions of one service type, shared by its instances and proxies
+		class ServiceMetrics
+		{
+		public:
+			explicit ServiceMetrics(const RakServiceMetaInfo* _info);
+
+			inline FunctionMetrics* function(unsigned int _id) const
+			{
+				return _id < mCount ? &mFunctions[_id] : nullptr;
+			}
+
+			void copyTo(RakServiceMetricsSnapshot& _snapshot) const;
+
+		private:
+			const RakServiceMetaInfo* mInfo;
+			std::size_t mCount;
+			std::unique_ptr<FunctionMetrics[]> mFunctions;
+		};
+
+		// records the time from construction to destruction as handler time, if there are metrics
+		class HandlerTimer
+		{
+		public:
+			inline explicit HandlerTimer(FunctionMetrics* _metrics)
+				: mMetrics(_metrics)
+				, mStart(_metrics ? MetricsNow() : 0)
+			{
+			}
+
+			inline ~HandlerTimer()
+			{
+				if (mMetrics)
+					mMetrics->recordHandler(MetricsNow() - mStart);
+			}
+
+		private:
+			HandlerTimer(const HandlerTimer&) = delete;
+			HandlerTimer& operator=(const HandlerTimer&) = delete;
+
+		private:
+			FunctionMetrics* mMetrics;
+			std::uint64_t mStart;
+		};
+	}
+}
+
+#endif
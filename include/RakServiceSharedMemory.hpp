@@ -0,0 +1,77 @@
+#pragma once
+#ifndef _RAKNET_RAKSERVICESHAREDMEMORY_HPP
+#define _RAKNET_RAKSERVICESHAREDMEMORY_HPP
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace RakNet {
+
+	namespace detail {
+		struct SharedSegment;
+		struct SharedRing;
+	}
+
+	// Transport for RakServicePlugin between two processes on the same host, see RakServicePlugin::AddSharedMemoryLink.
+	//
+	// A link is a shared memory segment with one single producer, single consumer ring buffer per
+	// direction. One process creates the segment under a name, the other opens it. Messages are
+	// copied into the ring once and read in place by the peer, without going through a socket.
+	// A reader that has nothing to do can sleep in wait() on a futex the writer wakes.
+	//
+	// Both ends must be used by one thread each, the plugin's network thread. Only available on Linux,
+	// elsewhere Create and Open return nullptr.
+	class RakServiceSharedMemoryLink
+	{
+	public:
+		// _ringBytes per direction, rounded up to a power of two. Messages take their size plus up to 11 bytes.
+		// nullptr if the name is taken, unless _replace removes the segment under it first, e.g. one left
+		// behind by a process that died. A link that is still in use loses its name then.
+		static std::unique_ptr<RakServiceSharedMemoryLink> Create(const std::string& _name, std::uint32_t _ringBytes = 1 << 20, bool _replace = false);
+		// nullptr if there is no segment _name or it is not a link
+		static std::unique_ptr<RakServiceSharedMemoryLink> Open(const std::string& _name);
+
+		// marks this end closed, the creator also removes the name
+		~RakServiceSharedMemoryLink();
+
+		// false if the ring has no room for the message right now
+		bool send(const unsigned char* _data, std::uint32_t _length);
+		// largest message send() can ever take
+		std::uint32_t maxMessageSize() const;
+
+		// next message of the peer, which stays valid until pop(). False if there is none
+		bool peek(const unsigned char*& _data, std::uint32_t& _length);
+		void pop();
+
+		// sleeps until the peer sends something, closes its end or _timeoutMs passed. True if there is a message
+		bool wait(unsigned int _timeoutMs);
+
+		// the peer destroyed its end or wrote a frame that does not fit its ring. Messages it sent
+		// before can still be read, unless the ring is broken
+		bool isPeerClosed() const;
+		inline const std::string& name() const { return mName; }
+
+	private:
+		RakServiceSharedMemoryLink(const std::string& _name, detail::SharedSegment* _segment, std::size_t _size, bool _creator);
+		RakServiceSharedMemoryLink(const RakServiceSharedMemoryLink&) = delete;
+		RakServiceSharedMemoryLink& operator=(const RakServiceSharedMemoryLink&) = delete;
+
+	private:
+		std::string mName;
+		detail::SharedSegment* mSegment;
+		std::size_t mSize;
+		bool mCreator;
+		// both live in the segment
+		detail::SharedRing* mOutgoing;
+		detail::SharedRing* mIncoming;
+		// size of both rings, the copies in the segment could be changed by the peer
+		std::uint32_t mCapacity;
+		// the peer's ring holds a frame that does not fit, nothing more is read from it
+		bool mBroken;
+		// size of the message returned by peek, including its frame
+		std::uint32_t mPeeked;
+	};
+}
+
+#endif
@@ -0,0 +1,156 @@
+#pragma once
+#ifndef _RAKNET_RAKSERVICESIMULATEDNETWORK_HPP
+#define _RAKNET_RAKSERVICESIMULATEDNETWORK_HPP
+
+#include <cstdint>
+#include <memory>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+#include "RakService.hpp"
+
+namespace RakNet {
+
+	// In-memory network of RakServicePlugins driven by a virtual clock, for repeatable benchmarks and
+	// tests with many peers in one process and on one thread.
+	//
+	// Plugins are added as peers instead of being attached to a RakPeer. Every message gets a delivery
+	// time from the conditions of its link: latency plus random jitter, the time the bytes take at the
+	// link's bandwidth and, for lost datagrams of reliable messages, one round trip per resend. Ordered
+	// and sequenced messages are never delivered before the ones sent earlier on their channel.
+	// Unreliable messages that are lost are dropped. Randomness comes from the seed only, so a run with
+	// the same seed and the same calls delivers the same messages at the same virtual times.
+	//
+	//		RakServiceSimulatedNetwork network;
+	//		network.AddPeer(&serverPlugin, serverAddress);
+	//		network.AddPeer(&clientPlugin, clientAddress);
+	//		clientPlugin.ConnectService<Chat>("chat", serverAddress, ...);
+	//		network.RunUntilIdle();
+	class RakServiceSimulatedNetwork
+	{
+	public:
+		struct LinkConditions
+		{
+			// one way delay and the most that is randomly added to it, in microseconds
+			std::uint64_t latency = 1000;
+			std::uint64_t jitter = 0;
+			// chance that a datagram is lost, reliable messages are resent a round trip later
+			double loss = 0.0;
+			// bytes per second the sender can put on the link, 0 for unlimited
+			std::uint64_t bandwidth = 0;
+		};
+
+		struct Stats
+		{
+			std::uint64_t sent = 0;
+			std::uint64_t delivered = 0;
+			// lost unreliable messages, messages between disconnected peers and to unknown addresses
+			std::uint64_t dropped = 0;
+			std::uint64_t resent = 0;
+			std::uint64_t bytes = 0;
+		};
+
+		// resends of a reliable message before it is given up and dropped
+		static const unsigned int MaxResends = 32;
+
+	public:
+		explicit RakServiceSimulatedNetwork(std::uint64_t _seed = 1);
+		// the plugins keep the network as their transport, so they must not send anything afterwards
+		~RakServiceSimulatedNetwork();
+
+		// _plugin sends and receives through the network from now on, as _address. Peers do not connect,
+		// every peer can reach every other until they are disconnected
+		void AddPeer(RakServicePlugin* _plugin, const SystemAddress& _address);
+		// UNASSIGNED_RAKNET_GUID if there is no peer _address
+		RakNetGUID GetGuid(const SystemAddress& _address) const;
+		inline std::size_t GetPeerCount() const { return mPeers.size(); }
+
+		void SetDefaultConditions(const LinkConditions& _conditions);
+		// conditions of the direction from _from to _to
+		void SetConditions(const SystemAddress& _from, const SystemAddress& _to, const LinkConditions& _conditions);
+
+		// Both plugins run OnClosedConnection for the other, messages in flight between them are lost
+		// and new ones are dropped until they are reconnected
+		void Disconnect(const SystemAddress& _a, const SystemAddress& _b);
+		void Reconnect(const SystemAddress& _a, const SystemAddress& _b);
+
+		// Advances the virtual clock by _micros and delivers the messages that become due on the way.
+		// Every plugin runs Update() once per update interval, and a plugin that received messages right
+		// after it handled them.
+		void Advance(std::uint64_t _micros);
+		// advances until nothing is in flight, true unless _maxMicros passed first
+		bool RunUntilIdle(std::uint64_t _maxMicros = 60 * 1000000ull);
+
+		inline std::uint64_t Now() const { return mNow; }
+		inline void SetUpdateInterval(std::uint64_t _micros) { mUpdateInterval = _micros > 0 ? _micros : 1; }
+		inline std::size_t GetInFlightCount() const { return mInFlight.size(); }
+		inline const Stats& GetStats() const { return mStats; }
+
+	private:
+		class Peer;
+
+		struct Message
+		{
+			std::uint64_t deliverAt;
+			// breaks ties in send order
+			std::uint64_t sequence;
+			std::uint32_t from;
+			std::uint32_t to;
+			// epoch of the link when it was sent, messages of an older one were lost with the connection
+			std::uint32_t epoch;
+			std::vector<unsigned char> data;
+		};
+
+		struct MessageOrder
+		{
+			inline bool operator()(const Message& _a, const Message& _b) const
+			{
+				return _a.deliverAt != _b.deliverAt ? _a.deliverAt > _b.deliverAt : _a.sequence > _b.sequence;
+			}
+		};
+
+		struct Link
+		{
+			LinkConditions conditions;
+			bool custom = false;
+			bool disconnected = false;
+			std::uint32_t epoch = 0;
+			// when the sender finished putting the last message on the link
+			std::uint64_t busyUntil = 0;
+			// latest delivery on each ordering channel
+			std::uint64_t orderedUntil[32] = {};
+		};
+
+	private:
+		RakServiceSimulatedNetwork(const RakServiceSimulatedNetwork&) = delete;
+		RakServiceSimulatedNetwork& operator=(const RakServiceSimulatedNetwork&) = delete;
+
+		void _Send(std::uint32_t _from, const BitStream& _stream, const AddressOrGUID& _target, const RakServiceSendOptions& _options);
+		Link& _GetLink(std::uint32_t _from, std::uint32_t _to);
+		std::uint32_t _FindPeer(const SystemAddress& _address) const;
+		// splitmix64
+		std::uint64_t _Random();
+		// in [0, 1)
+		double _RandomUnit();
+		void _UpdateAll();
+
+	private:
+		std::vector<std::unique_ptr<Peer>> mPeers;
+		std::unordered_map<SystemAddress, std::uint32_t, detail::SystemAddressHash> mPeerIndex;
+		// keyed by sender << 32 | receiver, created when the link is first used
+		std::unordered_map<std::uint64_t, Link> mLinks;
+		LinkConditions mDefaultConditions;
+		std::priority_queue<Message, std::vector<Message>, MessageOrder> mInFlight;
+		std::uint64_t mNow;
+		std::uint64_t mNextUpdate;
+		std::uint64_t mUpdateInterval;
+		std::uint64_t mNextSequence;
+		std::uint64_t mRandom;
+		Stats mStats;
+		// peers that received messages at the current time
+		std::vector<std::uint32_t> mReceivers;
+	};
+}
+
+#endif
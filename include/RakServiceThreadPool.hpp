@@ -0,0 +1,74 @@
+#pragma once
+#ifndef _RAKNET_RAKSERVICETHREADPOOL_HPP
+#define _RAKNET_RAKSERVICETHREADPOOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "RakService.hpp"
+
+namespace RakNet {
+
+	// Work-stealing thread pool for RakServicePlugin::SetDispatcher.
+	//
+	// Dispatched tasks are queued on a strand selected by the strand key. A strand is
+	// run by at most one worker at a time, which keeps the tasks of a strand in order.
+	// Strands that became ready are pushed round robin onto the workers' queues and idle
+	// workers steal from the others, so unrelated strands spread over all cores.
+	class RakServiceThreadPool : public RakServiceDispatcher
+	{
+	public:
+		RakServiceThreadPool(unsigned int _threads = std::thread::hardware_concurrency(), std::size_t _strands = 1024);
+		virtual ~RakServiceThreadPool();
+
+		virtual void Dispatch(std::size_t _strand, Task _task) override;
+
+		// runs the remaining tasks and joins all workers
+		void Stop();
+
+		inline std::size_t GetThreadCount() const { return mThreads.size(); }
+
+	private:
+		struct Strand
+		{
+			std::mutex mutex;
+			std::deque<Task> tasks;
+			bool scheduled = false;
+		};
+
+		struct Worker
+		{
+			std::mutex mutex;
+			std::deque<Strand*> strands;
+		};
+
+	private:
+		RakServiceThreadPool(const RakServiceThreadPool&) = delete;
+		RakServiceThreadPool& operator=(const RakServiceThreadPool&) = delete;
+
+		void _Run(std::size_t _worker);
+		void _Schedule(Strand* _strand, std::size_t _worker);
+		Strand* _NextStrand(std::size_t _worker);
+		void _RunStrand(Strand* _strand, std::size_t _worker);
+
+	private:
+		// maximal number of tasks a strand runs before it goes back into the queue
+		static const unsigned int TasksPerTurn = 64;
+
+		std::vector<std::unique_ptr<Strand>> mStrands;
+		std::vector<std::unique_ptr<Worker>> mWorkers;
+		std::vector<std::thread> mThreads;
+		std::mutex mSleepMutex;
+		std::condition_variable mWakeUp;
+		std::atomic<std::size_t> mQueuedStrands;
+		std::atomic<std::size_t> mNextWorker;
+		std::atomic<bool> mStopping;
+	};
+}
+
+#endif
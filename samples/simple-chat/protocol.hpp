@@ -31,14 +31,13 @@ PACKET_END()
 */
 
 
-#define RAK_SERVICE(_name) struct _name : public RakNet::GenericRakService<_name>
 //#define RAK_SLOT(_name, ...) RakNet::ServiceSlot<_name>
 
 
 RAK_SERVICE(TestService)
 {
 	//RAK_SLOT(test) back;
-	virtual void print(RakNet::RakString _test, std::function<void()> done) = 0;
+	virtual void print(RakNet::RakString _test, RakNet::ServiceCallback<void()> done) = 0;
 };
 
 
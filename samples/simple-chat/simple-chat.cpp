@@ -74,7 +74,7 @@ string AskServerIP()
 class TestServiceImpl : public TestService
 {
 public:
-	virtual void print(RakNet::RakString _test, std::function<void() > done) override
+	virtual void print(RakNet::RakString _test, RakNet::ServiceCallback<void()> done) override
 	{
 		cout << _test << std::endl;
 		done();
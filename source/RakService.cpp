@@ -1,7 +1,9 @@
 #include <stdexcept>
+#include <cstring>
 #include "RakService.hpp"
 #include "NetworkIDManager.h"
 #include "MessageIdentifiers.h"
+#include "RakPeerInterface.h"
 
 namespace RakNet {
 
@@ -10,11 +12,724 @@ namespace RakNet {
 		SMI_CONNECT = 1,
 		SMI_RETURN = 2,
 		SMI_INVOKE = 3,
-		SMI_DETACH = 4
+		SMI_DETACH = 4,
+		SMI_BATCH = 5,
+		SMI_NOTIFY = 6,
+		SMI_CHUNK = 7,
+		SMI_CONNECT_MANY = 8,
+		SMI_CANCEL = 9
+	};
+
+	// Names a peer may intern per connection. The reference in SMI_CONNECT_MANY is 0 for a plain
+	// name, token + 1 for an interned one and the next token + 1 to intern the name that follows.
+	static const std::size_t MaxNameTokens = 64;
+
+	// streamed blobs a peer may have open at once, see ConnectionState::receiveChunk
+	static const std::size_t MaxIncomingBlobs = 64;
+
+	// Version 2 header byte: flag, kind in bits 4-6 and function ids below 15 in bits 0-3.
+	// Larger function ids follow as varint, then the service id or return slot as varints.
+	static const unsigned char PackedHeaderFlag = 0x80;
+	static const unsigned char PackedInlineFunctionIds = 0x0F;
+	// set in bits 0-3 of a return to the 16 bit id of a version 1 call, which follows as one varint
+	static const unsigned char PackedCompactReturn = 0x01;
+	enum PackedMessageKind : unsigned char
+	{
+		PMK_INVOKE = 0,
+		PMK_NOTIFY = 1,
+		PMK_RETURN = 2
 	};
 
 
 	namespace detail {
+		StreamPool::StreamPool(std::size_t _maxCached)
+			: mMaxCached(_maxCached)
+		{
+			mFreeStreams.reserve(_maxCached);
+		}
+
+		StreamPool::~StreamPool()
+		{
+			for (auto* stream : mFreeStreams)
+				delete stream;
+		}
+
+		BitStream* StreamPool::acquire()
+		{
+			++mStats.acquired;
+			if (mFreeStreams.empty())
+			{
+				++mStats.allocated;
+				return new BitStream();
+			}
+
+			auto* stream = mFreeStreams.back();
+			mFreeStreams.pop_back();
+			return stream;
+		}
+
+		void StreamPool::release(BitStream* _stream)
+		{
+			RakAssert(_stream);
+			if (mFreeStreams.size() >= mMaxCached)
+			{
+				delete _stream;
+				return;
+			}
+
+			// Reset keeps the already allocated buffer, so the next call can write without reallocating
+			_stream->Reset();
+			mFreeStreams.push_back(_stream);
+		}
+
+		static thread_local InvocationContext* tCurrentInvocation = nullptr;
+
+		InvocationScope::InvocationScope(const RakService* _service, const SystemAddress& _origin, ReturnSlotId _call)
+			: mPrevious(tCurrentInvocation)
+		{
+			mContext.service = _service;
+			mContext.origin = _origin;
+			mContext.call = _call;
+			tCurrentInvocation = &mContext;
+		}
+
+		InvocationScope::~InvocationScope()
+		{
+			tCurrentInvocation = mPrevious;
+		}
+
+		const InvocationContext* InvocationScope::Current()
+		{
+			return tCurrentInvocation;
+		}
+
+		void InvocationScope::SetCall(ReturnSlotId _call)
+		{
+			if (tCurrentInvocation)
+				tCurrentInvocation->call = _call;
+		}
+
+		ReturnSlotTable::ReturnSlotTable(TimerWheel& _timers)
+			: mTimers(_timers)
+			, mFreeHead(IndexMask)
+			, mFreeWideHead(IndexMask)
+			, mUsed(0)
+		{
+		}
+
+		ReturnSlotId ReturnSlotTable::add(ReturnSlot&& _slot, unsigned int _replies, unsigned int _owner, FunctionMetrics* _metrics, std::uint64_t _deadline, bool _compact)
+		{
+			RakAssert(_replies > 0);
+			unsigned int index;
+			if (mFreeHead != IndexMask)
+			{
+				index = mFreeHead;
+				mFreeHead = mEntries[index].nextFree;
+			}
+			else if (mEntries.size() < CompactCapacity)
+			{
+				index = static_cast<unsigned int>(mEntries.size());
+				mEntries.emplace_back();
+			}
+			else if (_compact)
+			{
+				return InvalidId;
+			}
+			else if (mFreeWideHead != IndexMask)
+			{
+				index = mFreeWideHead;
+				mFreeWideHead = mEntries[index].nextFree;
+			}
+			else{
+				RakAssert(mEntries.size() < IndexMask);
+				index = static_cast<unsigned int>(mEntries.size());
+				mEntries.emplace_back();
+			}
+
+			auto& entry = mEntries[index];
+			entry.slot = std::move(_slot);
+			entry.replies = _replies;
+			entry.owner = _owner;
+			entry.used = true;
+			entry.metrics = _metrics;
+			entry.sentAt = _metrics ? MetricsNow() : 0;
+			entry.deadline = _deadline;
+			entry.compact = _compact;
+			++mUsed;
+
+			return (entry.generation << IndexBits) | index;
+		}
+
+		bool ReturnSlotTable::take(ReturnSlotId _id, ReturnSlot& _slot, bool& _more, SlotWindow* _window, unsigned int _from)
+		{
+			const unsigned int index = _id & IndexMask;
+			if (index >= mEntries.size())
+				return false;
+
+			auto& entry = mEntries[index];
+			// a lent out slot has no callback until it is restored
+			if (!entry.used || entry.generation != (_id >> IndexBits) || !entry.slot)
+				return false;
+
+			// every member answers once
+			if (!entry.members.empty())
+			{
+				auto member = std::find(entry.members.begin(), entry.members.end(), _from);
+				if (member == entry.members.end())
+					return false;
+				*member = entry.members.back();
+				entry.members.pop_back();
+			}
+
+			if (entry.metrics)
+				entry.metrics->recordReturn(entry.sentAt);
+
+			_slot = std::move(entry.slot);
+			entry.slot = nullptr;
+			entry.answered = true;
+			_more = --entry.replies > 0;
+			if (!_more)
+			{
+				if (_window)
+					*_window = entry.window;
+				_release(index);
+			}
+
+			return true;
+		}
+
+		void ReturnSlotTable::restore(ReturnSlotId _id, ReturnSlot&& _slot)
+		{
+			auto& entry = mEntries[_id & IndexMask];
+			RakAssert(entry.used && entry.generation == (_id >> IndexBits) && !entry.slot);
+			if (entry.replies == 0)
+			{
+				// the callback answered already, so it is dropped without expiring
+				_release(_id & IndexMask);
+				return;
+			}
+			entry.slot = std::move(_slot);
+		}
+
+		std::size_t ReturnSlotTable::cancel(unsigned int _owner)
+		{
+			std::size_t cancelled = 0;
+			// by index, a dropped callback may register new slots
+			for (unsigned int index = 0; index < mEntries.size(); ++index)
+			{
+				auto& entry = mEntries[index];
+				if (!entry.used)
+					continue;
+
+				if (!entry.members.empty())
+				{
+					const auto first = std::remove(entry.members.begin(), entry.members.end(), _owner);
+					entry.replies -= static_cast<unsigned int>(entry.members.end() - first);
+					entry.members.erase(first, entry.members.end());
+					// a lent out group slot is released by restore()
+					if (entry.replies > 0 || !entry.slot)
+						continue;
+				}
+				else if (entry.owner != _owner || !entry.slot)
+				{
+					continue;
+				}
+
+				ReturnSlot dropped(std::move(entry.slot));
+				entry.slot = nullptr;
+				const bool answered = entry.answered;
+				_release(index);
+				++cancelled;
+				// no answer is coming, futures and coroutines must not wait for it
+				if (!answered)
+					dropped.expire();
+			}
+			return cancelled;
+		}
+
+		bool ReturnSlotTable::remove(ReturnSlotId _id, ReturnSlot& _slot, unsigned int& _owner, SlotWindow* _window)
+		{
+			const unsigned int index = _id & IndexMask;
+			if (index >= mEntries.size())
+				return false;
+
+			auto& entry = mEntries[index];
+			if (!entry.used || entry.generation != (_id >> IndexBits) || !entry.slot)
+				return false;
+
+			ReturnSlot slot(std::move(entry.slot));
+			entry.slot = nullptr;
+			const bool answered = entry.answered;
+			_owner = entry.owner;
+			if (_window)
+				*_window = entry.window;
+			_release(index);
+			if (!answered)
+				_slot = std::move(slot);
+			return true;
+		}
+
+		bool ReturnSlotTable::isDue(ReturnSlotId _id, std::uint64_t _tick) const
+		{
+			const unsigned int index = _id & IndexMask;
+			if (index >= mEntries.size())
+				return false;
+
+			// the slot must still be the one the timer was scheduled for and its deadline must have passed
+			const auto& entry = mEntries[index];
+			return entry.used && entry.generation == (_id >> IndexBits) && entry.deadline != 0 && entry.deadline <= _tick;
+		}
+
+		bool ReturnSlotTable::isPending(ReturnSlotId _id) const
+		{
+			const unsigned int index = _id & IndexMask;
+			return index < mEntries.size() && mEntries[index].used && mEntries[index].generation == (_id >> IndexBits);
+		}
+
+		ReturnSlotId ReturnSlotTable::expand(ReturnSlotId _compact) const
+		{
+			const unsigned int index = _compact & CompactIndexMask;
+			if (index >= CompactCapacity || index >= mEntries.size())
+				return InvalidId;
+
+			const auto& entry = mEntries[index];
+			const ReturnSlotId id = (entry.generation << IndexBits) | index;
+			if (!entry.used || !entry.compact || compact(id) != _compact)
+				return InvalidId;
+			return id;
+		}
+
+		ReturnSlotId ReturnSlotTable::wireId(ReturnSlotId _id) const
+		{
+			const unsigned int index = _id & IndexMask;
+			return index < mEntries.size() && mEntries[index].compact ? compact(_id) : _id;
+		}
+
+		void ReturnSlotTable::setWindow(ReturnSlotId _id, const SlotWindow& _window)
+		{
+			auto& entry = mEntries[_id & IndexMask];
+			RakAssert(entry.used && entry.generation == (_id >> IndexBits));
+			entry.window = _window;
+		}
+
+		void ReturnSlotTable::setMembers(ReturnSlotId _id, std::vector<unsigned int>&& _members)
+		{
+			auto& entry = mEntries[_id & IndexMask];
+			RakAssert(entry.used && entry.generation == (_id >> IndexBits) && entry.replies == _members.size());
+			entry.members = std::move(_members);
+		}
+
+		void ReturnSlotTable::setTimer(ReturnSlotId _id, unsigned int _timer)
+		{
+			auto& entry = mEntries[_id & IndexMask];
+			RakAssert(entry.used && entry.generation == (_id >> IndexBits) && entry.timer == TimerWheel::NoTimer);
+			entry.timer = _timer;
+		}
+
+		void ReturnSlotTable::clearTimer(ReturnSlotId _id)
+		{
+			if (isPending(_id))
+				mEntries[_id & IndexMask].timer = TimerWheel::NoTimer;
+		}
+
+		bool ReturnSlotTable::isGroup(ReturnSlotId _id) const
+		{
+			const unsigned int index = _id & IndexMask;
+			return index < mEntries.size() && !mEntries[index].members.empty();
+		}
+
+		void ReturnSlotTable::_release(unsigned int _index)
+		{
+			auto& entry = mEntries[_index];
+			if (entry.timer != TimerWheel::NoTimer)
+			{
+				mTimers.cancel(entry.timer);
+				entry.timer = TimerWheel::NoTimer;
+			}
+			entry.used = false;
+			entry.answered = false;
+			entry.members.clear();
+			entry.owner = 0;
+			entry.deadline = 0;
+			entry.window = SlotWindow();
+			entry.compact = false;
+			entry.generation = (entry.generation + 1) & GenerationMask;
+			unsigned int& head = _index < CompactCapacity ? mFreeHead : mFreeWideHead;
+			entry.nextFree = head;
+			head = _index;
+			--mUsed;
+		}
+
+		TimerWheel::TimerWheel()
+			: mFree(NoTimer)
+			, mNow(0)
+			, mCount(0)
+		{
+			for (auto& bucket : mBuckets)
+				bucket = NoTimer;
+		}
+
+		unsigned int TimerWheel::schedule(ReturnSlotId _id, std::uint64_t _deadline, std::uint64_t _now)
+		{
+			// an idle wheel is not turned, it jumps to the present with its first timer
+			if (mCount == 0 && _now > mNow)
+				mNow = _now;
+
+			unsigned int node = mFree;
+			if (node != NoTimer)
+			{
+				mFree = mNodes[node].next;
+			}
+			else{
+				node = static_cast<unsigned int>(mNodes.size());
+				mNodes.emplace_back();
+			}
+			mNodes[node].timer.id = _id;
+			mNodes[node].timer.deadline = std::max(_deadline, mNow + 1);
+			_insert(node);
+			++mCount;
+			return node;
+		}
+
+		void TimerWheel::cancel(unsigned int _timer)
+		{
+			auto& node = mNodes[_timer];
+			if (node.prev != NoTimer)
+				mNodes[node.prev].next = node.next;
+			else
+				mBuckets[node.bucket] = node.next;
+			if (node.next != NoTimer)
+				mNodes[node.next].prev = node.prev;
+			_free(_timer);
+			--mCount;
+		}
+
+		void TimerWheel::advance(std::uint64_t _now, std::vector<Timer>& _due)
+		{
+			while (mNow < _now)
+			{
+				if (mCount == 0)
+				{
+					mNow = _now;
+					break;
+				}
+				++mNow;
+
+				// higher levels first, their timers may land in a bucket of a lower level that comes round now
+				for (unsigned int level = Levels - 1; level > 0; --level)
+				{
+					const unsigned int shift = level * LevelBits;
+					if (mNow & ((std::uint64_t(1) << shift) - 1))
+						continue;
+
+					auto& bucket = mBuckets[(level << LevelBits) | ((mNow >> shift) & BucketMask)];
+					unsigned int node = bucket;
+					bucket = NoTimer;
+					while (node != NoTimer)
+					{
+						const unsigned int next = mNodes[node].next;
+						_insert(node);
+						node = next;
+					}
+				}
+
+				auto& bucket = mBuckets[mNow & BucketMask];
+				unsigned int node = bucket;
+				bucket = NoTimer;
+				while (node != NoTimer)
+				{
+					const unsigned int next = mNodes[node].next;
+					_due.push_back(mNodes[node].timer);
+					_free(node);
+					--mCount;
+					node = next;
+				}
+			}
+		}
+
+		void TimerWheel::_insert(unsigned int _node)
+		{
+			// a timer that moves down to the present is due in the bucket of this tick
+			const Timer& timer = mNodes[_node].timer;
+			const std::uint64_t delta = timer.deadline > mNow ? timer.deadline - mNow : 0;
+			for (unsigned int level = 0; level < Levels; ++level)
+			{
+				const unsigned int shift = level * LevelBits;
+				const bool top = level == Levels - 1;
+				if (!top && delta >= (std::uint64_t(1) << (shift + LevelBits)))
+					continue;
+
+				// deadlines beyond the top level wait in its farthest bucket and are placed again from there
+				std::uint64_t at = std::max(timer.deadline, mNow);
+				if (top)
+					at = std::min(at, mNow + (std::uint64_t(1) << (shift + LevelBits)) - 1);
+				_link(_node, (level << LevelBits) | unsigned((at >> shift) & BucketMask));
+				return;
+			}
+		}
+
+		void TimerWheel::_link(unsigned int _node, unsigned int _bucket)
+		{
+			auto& node = mNodes[_node];
+			node.bucket = _bucket;
+			node.prev = NoTimer;
+			node.next = mBuckets[_bucket];
+			if (node.next != NoTimer)
+				mNodes[node.next].prev = _node;
+			mBuckets[_bucket] = _node;
+		}
+
+		void TimerWheel::_free(unsigned int _node)
+		{
+			mNodes[_node].next = mFree;
+			mFree = _node;
+		}
+
+		OutboundQueue::OutboundQueue()
+			: mHead(&mStub)
+			, mTail(&mStub)
+		{
+			mStub.next.store(nullptr, std::memory_order_relaxed);
+		}
+
+		OutboundQueue::~OutboundQueue()
+		{
+			while (auto* message = pop())
+				delete message;
+		}
+
+		void OutboundQueue::push(OutboundMessage* _message)
+		{
+			_message->next.store(nullptr, std::memory_order_relaxed);
+			auto* previous = mHead.exchange(_message, std::memory_order_acq_rel);
+			// between the exchange and this store the message is not reachable from mTail yet
+			previous->next.store(_message, std::memory_order_release);
+		}
+
+		OutboundMessage* OutboundQueue::pop()
+		{
+			auto* tail = mTail;
+			auto* next = tail->next.load(std::memory_order_acquire);
+			if (tail == &mStub)
+			{
+				if (!next)
+					return nullptr;
+				mTail = next;
+				tail = next;
+				next = next->next.load(std::memory_order_acquire);
+			}
+
+			if (next)
+			{
+				mTail = next;
+				return tail;
+			}
+
+			if (tail != mHead.load(std::memory_order_acquire))
+				return nullptr;
+
+			// tail is the last message, put the stub behind it so it can be handed out
+			push(&mStub);
+			next = tail->next.load(std::memory_order_acquire);
+			if (next)
+			{
+				mTail = next;
+				return tail;
+			}
+			return nullptr;
+		}
+
+		// streams acquired outside the network thread come from a pool of the calling thread
+		static StreamPool& LocalStreamPool()
+		{
+			static thread_local StreamPool pool(8);
+			return pool;
+		}
+
+		struct PendingReturn
+		{
+			const BitStream* stream;
+			OutboundMessage::DeferredReturn deferred;
+		};
+
+		// return slots written on this thread that wait for their message to be enqueued
+		static thread_local std::vector<PendingReturn> tPendingReturns;
+
+		struct PendingBlob
+		{
+			const BitStream* stream;
+			OutgoingBlob outgoing;
+		};
+
+		// streamed blobs written on this thread that wait for their message to be sent
+		static thread_local std::vector<PendingBlob> tPendingBlobs;
+
+		struct PendingService
+		{
+			const BitStream* stream;
+			RakService* service;
+		};
+
+		// services introduced on this thread that wait for their message to be enqueued
+		static thread_local std::vector<PendingService> tPendingServices;
+
+		static std::vector<OutgoingBlob> TakePendingBlobs(const BitStream& _stream)
+		{
+			std::vector<OutgoingBlob> blobs;
+			for (auto& entry : tPendingBlobs)
+			{
+				if (entry.stream == &_stream)
+					blobs.push_back(std::move(entry.outgoing));
+			}
+			// like returns, anything else belongs to a message that was never sent
+			tPendingBlobs.clear();
+			return blobs;
+		}
+
+		// payload of a single SMI_CHUNK
+		static const std::size_t BlobChunkBytes = 16 * 1024;
+
+		// group calls are always sent with the fixed size SMI_INVOKE header, so the id is byte aligned
+		static void PatchServiceId(BitStream& _stream, RakServiceId _sid)
+		{
+			BitStream encoded;
+			encoded.Write(_sid);
+			std::memcpy(_stream.GetData() + 2 * sizeof(MessageID), encoded.GetData(), sizeof(RakServiceId));
+		}
+
+		std::size_t SystemAddressHash::operator()(const SystemAddress& _addr) const
+		{
+			const bool wide = sizeof(std::size_t) >= 8;
+			const std::size_t prime = wide ? std::size_t(1099511628211ULL) : std::size_t(16777619u);
+			std::size_t hash = wide ? std::size_t(14695981039346656037ULL) : std::size_t(2166136261u);
+			auto mix = [&](const void* _data, std::size_t _size)
+			{
+				auto* bytes = static_cast<const unsigned char*>(_data);
+				for (std::size_t i = 0; i < _size; ++i)
+					hash = (hash ^ bytes[i]) * prime;
+			};
+
+			mix(&_addr.address.addr4.sin_port, sizeof(_addr.address.addr4.sin_port));
+#if RAKNET_SUPPORT_IPV6 == 1
+			if (_addr.GetIPVersion() == 6)
+			{
+				mix(&_addr.address.addr6.sin6_addr, sizeof(_addr.address.addr6.sin6_addr));
+				return hash;
+			}
+#endif
+			mix(&_addr.address.addr4.sin_addr.s_addr, sizeof(_addr.address.addr4.sin_addr.s_addr));
+			return hash;
+		}
+
+		static void PatchReturnSlotId(BitStream& _stream, BitSize_t _offset, ReturnSlotId _id, unsigned char _version)
+		{
+			// BitStream::Write would clobber the bits behind an unaligned offset, so the id is copied bit by bit
+			BitStream encoded;
+			WriteReturnSlotId(encoded, _id, _version);
+			const unsigned char* src = encoded.GetData();
+			unsigned char* dest = _stream.GetData();
+			for (BitSize_t i = 0; i < encoded.GetNumberOfBitsUsed(); ++i)
+			{
+				const BitSize_t bit = _offset + i;
+				const unsigned char mask = static_cast<unsigned char>(0x80 >> (bit & 7));
+				if (src[i >> 3] & (0x80 >> (i & 7)))
+					dest[bit >> 3] |= mask;
+				else
+					dest[bit >> 3] &= ~mask;
+			}
+		}
+
+		void SerializeBlob::write(SerializationArgs& args, const ServiceBlob& _blob)
+		{
+			args.plugin->_WriteBlob(args, _blob);
+		}
+
+		void DeserializeBlob::read(DeserializationArgs& args, ServiceBlob& _blob)
+		{
+			bool streamed = false;
+			unsigned int size = 0;
+			args.stream.Read(streamed);
+			if (streamed)
+			{
+				unsigned int id = 0;
+				args.stream.Read(id);
+				args.stream.Read(size);
+				_blob = args.plugin->_TakeBlob(args.recvAddress, id, size);
+				return;
+			}
+
+			args.stream.Read(size);
+			args.stream.AlignReadToByteBoundary();
+			if (size == 0 || size > args.stream.GetNumberOfUnreadBits() / 8)
+			{
+				_blob = ServiceBlob();
+				return;
+			}
+
+			_blob = ServiceBlob(args.stream.GetData() + (args.stream.GetReadOffset() >> 3), size);
+			args.stream.IgnoreBytes(size);
+		}
+
+		void SerializeView::write(SerializationArgs& args, const ServiceStringView& _str)
+		{
+			// same layout as RakString::Serialize
+			RakAssert(_str.size() <= 0xFFFF);
+			args.stream.Write(static_cast<unsigned short>(_str.size()));
+			args.stream.WriteAlignedBytes(reinterpret_cast<const unsigned char*>(_str.data()), static_cast<unsigned short>(_str.size()));
+		}
+
+		void SerializeView::write(SerializationArgs& args, const ServiceByteSpan& _bytes)
+		{
+			// same layout as a ServiceBlob that is not streamed
+			RakAssert(_bytes.size() <= 0xFFFFFFFFu);
+			args.stream.Write(false);
+			args.stream.Write(static_cast<unsigned int>(_bytes.size()));
+			args.stream.WriteAlignedBytes(_bytes.data(), static_cast<unsigned int>(_bytes.size()));
+		}
+
+		void DeserializeView::read(DeserializationArgs& args, ServiceStringView& _str)
+		{
+			unsigned short size = 0;
+			args.stream.Read(size);
+			args.stream.AlignReadToByteBoundary();
+			if (size > args.stream.GetNumberOfUnreadBits() / 8)
+			{
+				_str = ServiceStringView();
+				return;
+			}
+
+			_str = ServiceStringView(reinterpret_cast<const char*>(args.stream.GetData() + (args.stream.GetReadOffset() >> 3)), size);
+			args.stream.IgnoreBytes(size);
+		}
+
+		void DeserializeView::read(DeserializationArgs& args, ServiceByteSpan& _bytes)
+		{
+			bool streamed = false;
+			unsigned int size = 0;
+			args.stream.Read(streamed);
+			if (streamed)
+			{
+				// a streamed blob outlives the packet, spans can not take it. Its buffer is released
+				unsigned int id = 0;
+				args.stream.Read(id);
+				args.stream.Read(size);
+				args.plugin->_TakeBlob(args.recvAddress, id, size);
+				_bytes = ServiceByteSpan();
+				return;
+			}
+
+			args.stream.Read(size);
+			args.stream.AlignReadToByteBoundary();
+			if (size > args.stream.GetNumberOfUnreadBits() / 8)
+			{
+				_bytes = ServiceByteSpan();
+				return;
+			}
+
+			_bytes = ServiceByteSpan(args.stream.GetData() + (args.stream.GetReadOffset() >> 3), size);
+			args.stream.IgnoreBytes(size);
+		}
+
 		void SerializeService::write(SerializationArgs& args, RakService* _p)
 		{
 			bool isNull = _p == nullptr;
@@ -23,256 +738,2074 @@ namespace RakNet {
 			if (!isNull)
 			{
 				auto controller = _p->GetServiceController();
+				if (args.version >= WireVersion2)
+				{
+					// proxies, and services of a plugin in this process, may go back to the peer they belong to
+					auto* owner = controller.GetRakServicePlugin();
+					const bool home = controller.IsForeignService() || (owner && owner != args.plugin);
+					args.stream << home;
+					if (home)
+					{
+						RakAssert(args.receiver);
+						RakAssert(!controller.IsForeignService() || (owner == args.plugin && *args.receiver == controller.GetForeignAddress()));
+						WriteVarint(args.stream, controller.GetServiceId());
+						return;
+					}
+				}
 				RakAssert(!controller.IsForeignService());
 				if (!controller.GetRakServicePlugin())
 				{
-					args.plugin->IntroduceService(_p);
+					args.plugin->_IntroduceService(_p, args.stream);
 				}
 				RakAssert(args.plugin == controller.GetRakServicePlugin());
-				args.stream.Write(controller.GetServiceId());
+				if (args.version >= WireVersion2)
+					WriteVarint(args.stream, controller.GetServiceId());
+				else
+					args.stream.Write(controller.GetServiceId());
 			}
 		}
 	}
 
 
-	RakServicePlugin::RakServicePlugin(char channel)
-		: mChannel(channel)
-		, mNextReturnSlotId(42)
-		, mNextServiceId(2)
+	class RakServicePlugin::ConnectionState
 	{
+	public:
+		struct NameToken
+		{
+			unsigned int hash;
+			std::string name;
+		};
+
+		struct QueuedCall
+		{
+			inline QueuedCall(const detail::WindowedCall& _call, detail::ReturnSlotId _rid, const RakServiceSendOptions& _options, detail::PooledStream&& _stream, std::vector<detail::OutgoingBlob>&& _blobs)
+				: call(_call)
+				, rid(_rid)
+				, options(_options)
+				, stream(std::move(_stream))
+				, blobs(std::move(_blobs))
+			{
+			}
+
+			detail::WindowedCall call;
+			detail::ReturnSlotId rid;
+			RakServiceSendOptions options;
+			detail::PooledStream stream;
+			std::vector<detail::OutgoingBlob> blobs;
+		};
+
+		ConnectionState(const SystemAddress& _address, unsigned int _id)
+		{
+			reset(_address, _id);
+		}
+
+		~ConnectionState()
+		{
+			clear();
+		}
+
+		// the vectors keep their capacity, so a pooled state takes its next peer without allocating
+		void reset(const SystemAddress& _address, unsigned int _id)
+		{
+			mAddress = _address;
+			mId = _id;
+			mIndex = SystemIndex(-1);
+			mVersion = detail::WireVersion1;
+		}
+
+		void clear()
+		{
+			for (auto* service : mForeignServices)
+				delete service;
+			mForeignServices.clear();
+			mLocallyKnownServices.clear();
+			mIncomingBlobs.clear();
+			mIncomingBytes = 0;
+			mSentNames.clear();
+			mReceivedNames.clear();
+			mCancelledCalls.clear();
+			mQueuedCalls.clear();
+			mServiceInFlight.clear();
+			mServiceQueued.clear();
+			mLoad = RakServicePeerLoad();
+		}
+
+		inline const SystemAddress& address() const { return mAddress; }
+		inline unsigned int id() const { return mId; }
+		inline SystemIndex index() const { return mIndex; }
+		inline void setIndex(SystemIndex _index) { mIndex = _index; }
+		inline unsigned char version() const { return mVersion; }
+		inline void setVersion(unsigned char _version) { mVersion = _version; }
+		inline const std::vector<RakService*>& foreignServices() const { return mForeignServices; }
+		inline const std::vector<unsigned int>& knownServices() const { return mLocallyKnownServices; }
+
+		bool hasForeignServices() const
+		{
+			return std::any_of(mForeignServices.begin(), mForeignServices.end(), [](RakService* _service) { return _service != nullptr; });
+		}
+
+		void addService(RakService* service)
+		{
+			RakAssert(service);
+			auto controller = service->GetServiceController();
+			const RakServiceId sid = controller.GetServiceId();
+			if (controller.IsForeignService())
+			{
+				if (sid >= mForeignServices.size())
+					mForeignServices.resize(sid + 1, nullptr);
+				RakAssert(!mForeignServices[sid]);
+				mForeignServices[sid] = service;
+			}
+			else{
+				if (sid >= mLocallyKnownServices.size())
+					mLocallyKnownServices.resize(sid + 1, 0);
+				mLocallyKnownServices[sid]++;
+			}
+		}
+
+		inline RakService* getService(RakServiceId sid) const
+		{
+			return sid < mForeignServices.size() ? mForeignServices[sid] : nullptr;
+		}
+
+		// token this side interned _name with, -1 if it did not
+		int findSentName(const ServiceName& _name) const
+		{
+			for (std::size_t i = 0; i < mSentNames.size(); ++i)
+			{
+				if (mSentNames[i].hash == _name.hash() && ServiceStringView(mSentNames[i].name) == _name.view())
+					return int(i);
+			}
+			return -1;
+		}
+
+		// -1 once the table is full, the name is sent plain then
+		int internSentName(const ServiceName& _name)
+		{
+			if (mSentNames.size() >= MaxNameTokens)
+				return -1;
+			mSentNames.push_back(NameToken{ _name.hash(), _name.view().str() });
+			return int(mSentNames.size() - 1);
+		}
+
+		inline std::size_t receivedNameCount() const { return mReceivedNames.size(); }
+
+		inline const NameToken* receivedName(std::size_t _token) const
+		{
+			return _token < mReceivedNames.size() ? &mReceivedNames[_token] : nullptr;
+		}
+
+		// the hash is kept with the name, so interned names are not hashed again
+		bool internReceivedName(const ServiceStringView& _name, unsigned int _hash)
+		{
+			if (mReceivedNames.size() >= MaxNameTokens)
+				return false;
+			mReceivedNames.push_back(NameToken{ _hash, _name.str() });
+			return true;
+		}
+
+		// A blob that would open more than MaxIncomingBlobs or take the received bytes of all open
+		// blobs above _maxBytes is dropped, its message gets an empty ServiceBlob.
+		void receiveChunk(unsigned int _id, unsigned int _size, unsigned int _offset, const unsigned char* _data, std::size_t _length, std::size_t _maxBytes)
+		{
+			auto it = mIncomingBlobs.find(_id);
+			if (it == mIncomingBlobs.end())
+			{
+				// the rest of a dropped blob
+				if (_offset != 0 || mIncomingBlobs.size() >= MaxIncomingBlobs)
+					return;
+				it = mIncomingBlobs.emplace(_id, IncomingBlob()).first;
+				it->second.buffer = std::make_shared<std::vector<unsigned char>>();
+				it->second.size = _size;
+			}
+
+			// chunks are sent reliable ordered, anything else is a broken blob
+			auto& buffer = *it->second.buffer;
+			if (it->second.size != _size || _offset != buffer.size() || _length > _size - _offset || mIncomingBytes + _length > _maxBytes)
+			{
+				dropBlob(it);
+				return;
+			}
+
+			// the buffer grows with the chunks that arrived, the announced size is not allocated up front
+			buffer.insert(buffer.end(), _data, _data + _length);
+			mIncomingBytes += _length;
+		}
+
+		ServiceBlob takeBlob(unsigned int _id, unsigned int _size)
+		{
+			auto it = mIncomingBlobs.find(_id);
+			if (it == mIncomingBlobs.end())
+				return ServiceBlob();
+
+			ServiceBlob blob;
+			mIncomingBytes -= it->second.buffer->size();
+			if (it->second.size == _size && it->second.buffer->size() == _size)
+				blob = ServiceBlob(ServiceBlob::Buffer(std::move(it->second.buffer)));
+			mIncomingBlobs.erase(it);
+			return blob;
+		}
+
+		// the oldest cancel is forgotten once MaxCancelledCalls are kept
+		void cancelCall(detail::ReturnSlotId _rid)
+		{
+			if (isCallCancelled(_rid))
+				return;
+			if (mCancelledCalls.size() >= MaxCancelledCalls)
+				mCancelledCalls.erase(mCancelledCalls.begin());
+			mCancelledCalls.push_back(_rid);
+		}
+
+		inline bool isCallCancelled(detail::ReturnSlotId _rid) const
+		{
+			return std::find(mCancelledCalls.begin(), mCancelledCalls.end(), _rid) != mCancelledCalls.end();
+		}
+
+		bool takeCancelledCall(detail::ReturnSlotId _rid)
+		{
+			auto it = std::find(mCancelledCalls.begin(), mCancelledCalls.end(), _rid);
+			if (it == mCancelledCalls.end())
+				return false;
+			mCancelledCalls.erase(it);
+			return true;
+		}
+
+		inline const RakServicePeerLoad& load() const { return mLoad; }
+		inline RakServicePeerLoad& load() { return mLoad; }
+		inline std::deque<QueuedCall>& queuedCalls() { return mQueuedCalls; }
+
+		inline unsigned int serviceInFlight(RakServiceId _sid) const { return _sid < mServiceInFlight.size() ? mServiceInFlight[_sid] : 0; }
+		inline unsigned int serviceQueued(RakServiceId _sid) const { return _sid < mServiceQueued.size() ? mServiceQueued[_sid] : 0; }
+
+		void addInFlight(RakServiceId _sid, int _delta)
+		{
+			if (_sid >= mServiceInFlight.size())
+				mServiceInFlight.resize(_sid + 1, 0);
+			mServiceInFlight[_sid] += _delta;
+			mLoad.inFlight += _delta;
+		}
+
+		void addQueued(RakServiceId _sid, int _delta)
+		{
+			if (_sid >= mServiceQueued.size())
+				mServiceQueued.resize(_sid + 1, 0);
+			mServiceQueued[_sid] += _delta;
+			mLoad.queued += _delta;
+		}
+
+	private:
+		struct IncomingBlob
+		{
+			std::shared_ptr<std::vector<unsigned char>> buffer;
+			// announced by the first chunk
+			unsigned int size;
+		};
+
+		void dropBlob(std::unordered_map<unsigned int, IncomingBlob>::iterator _it)
+		{
+			mIncomingBytes -= _it->second.buffer->size();
+			mIncomingBlobs.erase(_it);
+		}
+
+	private:
+		ConnectionState(const ConnectionState&) = delete;
+		ConnectionState& operator=(const ConnectionState&) = delete;
+
+	private:
+		SystemAddress mAddress;
+		// tags the return slots the peer has to answer
+		unsigned int mId;
+		SystemIndex mIndex;
+		// wire format both sides speak, proxies created for the peer use it
+		unsigned char mVersion;
+		// both indexed by service id, which peers hand out densely
+		std::vector<RakService*> mForeignServices;
+		std::vector<unsigned int> mLocallyKnownServices;
+		// streamed blobs by id until the message carrying them arrives
+		std::unordered_map<unsigned int, IncomingBlob> mIncomingBlobs;
+		// received bytes of all mIncomingBlobs
+		std::size_t mIncomingBytes = 0;
+		// service names interned by this side and by the peer, indexed by token
+		std::vector<NameToken> mSentNames;
+		std::vector<NameToken> mReceivedNames;
+		// calls of the peer it gave up on and that were not answered yet, oldest first
+		std::vector<detail::ReturnSlotId> mCancelledCalls;
+		// calls to the peer held back by a call window, in the order they were made
+		std::deque<QueuedCall> mQueuedCalls;
+		// both indexed by the peer's service id
+		std::vector<unsigned int> mServiceInFlight;
+		std::vector<unsigned int> mServiceQueued;
+		RakServicePeerLoad mLoad;
+	};
+
+	// closed connections kept around for reuse
+	static const std::size_t ConnectionPoolCapacity = 64;
+	// connection ids are a generation above the index in RakServicePlugin::mConnectionsById, so ids of
+	// closed connections do not name the connection that takes over their index
+	static const unsigned int ConnectionIndexBits = 20;
+	static const unsigned int ConnectionIndexMask = (1u << ConnectionIndexBits) - 1;
+	static const unsigned int ConnectionGenerationMask = (1u << (32 - ConnectionIndexBits)) - 1;
+
+	namespace detail {
+
+		// plugins attached to a RakPeer of this process, see RakServicePlugin::_FindSameProcessPlugin
+		struct SameProcessPlugins
+		{
+			std::mutex mutex;
+			std::vector<RakServicePlugin*> plugins;
+		};
+
+		static SameProcessPlugins& GetSameProcessPlugins()
+		{
+			static SameProcessPlugins registry;
+			return registry;
+		}
+
+		static void UnregisterSameProcessPlugin(RakServicePlugin* _plugin)
+		{
+			auto& registry = GetSameProcessPlugins();
+			std::lock_guard<std::mutex> lock(registry.mutex);
+			registry.plugins.erase(std::remove(registry.plugins.begin(), registry.plugins.end(), _plugin), registry.plugins.end());
+		}
+	}
+
+	static thread_local RakServiceDeadline* tCurrentDeadline = nullptr;
+
+	RakServiceDeadline::RakServiceDeadline(unsigned int _timeoutMs)
+		: mTimeout(_timeoutMs)
+		, mLastCall(detail::ReturnSlotTable::InvalidId)
+		, mPrevious(tCurrentDeadline)
+	{
+		tCurrentDeadline = this;
+	}
+
+	RakServiceDeadline::~RakServiceDeadline()
+	{
+		tCurrentDeadline = mPrevious;
+	}
+
+	RakServiceDeadline* RakServiceDeadline::Current()
+	{
+		return tCurrentDeadline;
+	}
+
+	// the default transport, through the RakPeer the plugin is attached to
+	class RakServicePlugin::RakNetTransport : public RakServiceTransport
+	{
+	public:
+		inline explicit RakNetTransport(RakServicePlugin& _plugin)
+			: mPlugin(_plugin)
+		{
+		}
+
+		virtual void Send(const BitStream& _stream, const AddressOrGUID& _target, const RakServiceSendOptions& _options) override
+		{
+			mPlugin.SendUnified(&_stream, _options.priority, _options.reliability, _options.channel, _target, false);
+		}
+
+		virtual SystemAddress GetSystemAddressFromGuid(const RakNetGUID& _guid) const override
+		{
+			return mPlugin.rakPeerInterface ? mPlugin.rakPeerInterface->GetSystemAddressFromGuid(_guid) : UNASSIGNED_SYSTEM_ADDRESS;
+		}
+
+	private:
+		RakServicePlugin& mPlugin;
+	};
+
+	RakServicePlugin::RakServicePlugin(char channel)
+		: mChannel(channel)
+		, mNextServiceId(2)
+		, mReturnSlots(mDeadlines)
+		, mCallTimeout(0)
+		, mCancelMessages(false)
+		, mReceivedCancels(false)
+		, mExpiredCalls(0)
+		, mWindowed(false)
+		, mQueuedCalls(0)
+		, mWrittenCallStream(nullptr)
+		, mWrittenCall(0)
+		, mNextConnectionId(1)
+		, mBatching(false)
+		, mMaxBatchBytes(0)
+		, mWireVersion(detail::WireVersion1)
+		, mStreamThreshold(0)
+		, mStreamBytesPerUpdate(256 * 1024)
+		, mMaxBlobBytes(64 * 1024 * 1024)
+		, mMaxPendingBlobBytes(64 * 1024 * 1024)
+		, mStreamOptions(LOW_PRIORITY, RELIABLE_ORDERED, 1)
+		, mNextBlobId(1)
+		, mRakNetTransport(new RakNetTransport(*this))
+		, mTransport(mRakNetTransport.get())
+		, mDispatcher(nullptr)
+		, mDispatchOrder(RakServiceDispatchOrder::PER_SERVICE)
+		, mSameProcessCalls(false)
+		, mMetricsEnabled(false)
+		, mNetworkThread(std::thread::id())
+	{
+	}
+
+	RakServicePlugin::~RakServicePlugin()
+	{
+		detail::UnregisterSameProcessPlugin(this);
+	}
+
+	void RakServicePlugin::AddService(const ServiceName& name, RakService* service)
+	{
+		IntroduceService(service);
+		if (!_FindWelcomeService(name.view(), name.hash()))
+			mWelcomeServices.emplace(name.hash(), WelcomeService{ name.view().str(), service });
+	}
+
+	RakService* RakServicePlugin::GetService(const ServiceName& name) const
+	{
+		return _FindWelcomeService(name.view(), name.hash());
+	}
+
+	RakService* RakServicePlugin::RemoveService(const ServiceName& name)
+	{
+		auto range = mWelcomeServices.equal_range(name.hash());
+		for (auto it = range.first; it != range.second; ++it)
+		{
+			if (ServiceStringView(it->second.name) == name.view())
+			{
+				auto* service = it->second.service;
+				mWelcomeServices.erase(it);
+				return service;
+			}
+		}
+		return nullptr;
+	}
+
+	RakService* RakServicePlugin::_FindWelcomeService(const ServiceStringView& _name, unsigned int _hash) const
+	{
+		auto range = mWelcomeServices.equal_range(_hash);
+		for (auto it = range.first; it != range.second; ++it)
+		{
+			if (ServiceStringView(it->second.name) == _name)
+				return it->second.service;
+		}
+		return nullptr;
+	}
+
+	void RakServicePlugin::IntroduceService(RakService* service)
+	{
+		RakAssert(_IsNetworkThread());
+		auto controller = service->GetServiceController();
+		if (controller.GetRakServicePlugin() == this)
+			return;
+		RakAssert(controller.GetRakServicePlugin() == nullptr);
+
+		service->_mServicePlugin = this;
+		service->_mServiceId = mNextServiceId.fetch_add(1, std::memory_order_relaxed);
+		_RegisterService(service);
+	}
+
+	void RakServicePlugin::_IntroduceService(RakService* _service, const BitStream& _stream)
+	{
+		if (_IsNetworkThread())
+		{
+			IntroduceService(_service);
+			return;
+		}
+
+		// the id is known right away, mServices belongs to the network thread and learns it with the message
+		_service->_mServicePlugin = this;
+		_service->_mServiceId = mNextServiceId.fetch_add(1, std::memory_order_relaxed);
+		detail::tPendingServices.push_back(detail::PendingService{ &_stream, _service });
+	}
+
+	void RakServicePlugin::_RegisterService(RakService* _service)
+	{
+		const RakServiceId sid = _service->_mServiceId;
+		if (sid >= mServices.size())
+			mServices.resize(sid + 1, nullptr);
+		mServices[sid] = _service;
+	}
+
+	void RakServicePlugin::SetDispatcher(RakServiceDispatcher* _dispatcher, RakServiceDispatchOrder _order)
+	{
+		mDispatcher = _dispatcher;
+		mDispatchOrder = _order;
+	}
+
+	void RakServicePlugin::SetBatching(bool _enabled, unsigned int _maxBatchBytes)
+	{
+		if (!_enabled)
+			FlushBatches();
+
+		mBatching = _enabled;
+		mMaxBatchBytes = _maxBatchBytes;
+	}
+
+	void RakServicePlugin::FlushBatches()
+	{
+		for (auto& batch : mBatches)
+		{
+			_SendBatch(batch);
+		}
+		mBatches.clear();
+		mBatchIndex.clear();
+	}
+
+	void RakServicePlugin::SetWireVersion(unsigned char _version)
+	{
+		RakAssert(_version >= detail::WireVersion1 && _version <= detail::WireVersion2);
+		mWireVersion = _version;
+	}
+
+	void RakServicePlugin::SetMetrics(bool _enabled)
+	{
+		mMetricsEnabled.store(_enabled, std::memory_order_relaxed);
+	}
+
+	RakServiceMetricsSnapshot RakServicePlugin::GetMetrics() const
+	{
+		RakServiceMetricsSnapshot snapshot;
+		std::lock_guard<std::mutex> lock(mMetricsMutex);
+		for (auto& entry : mMetrics)
+			entry.second->copyTo(snapshot);
+		return snapshot;
+	}
+
+	detail::FunctionMetrics* RakServicePlugin::_GetFunctionMetrics(RakService* _service, ServiceFunctionId _fid)
+	{
+		if (!mMetricsEnabled.load(std::memory_order_relaxed))
+			return nullptr;
+
+		auto* metrics = _service->_mMetrics.load(std::memory_order_acquire);
+		if (!metrics)
+		{
+			const RakServiceMetaInfo* info = _service->_GetMetaInfo();
+			std::lock_guard<std::mutex> lock(mMetricsMutex);
+			auto& entry = mMetrics[info];
+			if (!entry)
+				entry.reset(new detail::ServiceMetrics(info));
+			metrics = entry.get();
+			_service->_mMetrics.store(metrics, std::memory_order_release);
+		}
+		return metrics->function(_fid);
+	}
+
+	void RakServicePlugin::SetStreaming(bool _enabled, unsigned int _thresholdBytes, char _channel, unsigned int _bytesPerUpdate)
+	{
+		RakAssert(!_enabled || (_thresholdBytes > 0 && _bytesPerUpdate > 0));
+		mStreamThreshold.store(_enabled ? _thresholdBytes : 0, std::memory_order_relaxed);
+		mStreamOptions.channel = _channel;
+		mStreamBytesPerUpdate = _bytesPerUpdate;
+	}
+
+	void RakServicePlugin::SetTransport(RakServiceTransport* _transport)
+	{
+		RakAssert(_IsNetworkThread());
+		mTransport = _transport ? _transport : mRakNetTransport.get();
+	}
+
+	bool RakServicePlugin::HandleMessage(const SystemAddress& _sender, const unsigned char* _data, unsigned int _length)
+	{
+		if (_length <= sizeof(MessageID) || MessageID(_data[0]) != ID_RPC_PLUGIN)
+			return false;
+
+		_SetNetworkThread();
+		// views read from the message point into _data
+		BitStream stream(const_cast<unsigned char*>(_data) + sizeof(MessageID), _length - sizeof(MessageID), false);
+		_HandlePackage(stream, _sender);
+		return true;
+	}
+
+	void RakServicePlugin::AddSharedMemoryLink(const SystemAddress& _address, std::unique_ptr<RakServiceSharedMemoryLink> _link)
+	{
+		RakAssert(_link && _IsNetworkThread());
+		RakAssert(!_FindSharedMemoryPeer(_address));
+		std::unique_ptr<SharedMemoryPeer> peer(new SharedMemoryPeer());
+		peer->address = _address;
+		peer->link = std::move(_link);
+		mSharedMemoryLinks.push_back(std::move(peer));
+	}
+
+	void RakServicePlugin::RemoveSharedMemoryLink(const SystemAddress& _address)
+	{
+		RakAssert(_IsNetworkThread());
+		auto it = std::find_if(mSharedMemoryLinks.begin(), mSharedMemoryLinks.end(), [&](const std::unique_ptr<SharedMemoryPeer>& _peer)
+		{
+			return _peer->address == _address;
+		});
+		if (it == mSharedMemoryLinks.end())
+			return;
+
+		// unlink first, the disconnect handlers must not send into the closed link
+		std::unique_ptr<SharedMemoryPeer> peer(std::move(*it));
+		mSharedMemoryLinks.erase(it);
+		OnClosedConnection(_address, UNASSIGNED_RAKNET_GUID, LCR_CLOSED_BY_USER);
+	}
+
+	RakServiceSharedMemoryLink* RakServicePlugin::GetSharedMemoryLink(const SystemAddress& _address) const
+	{
+		auto* peer = _FindSharedMemoryPeer(_address);
+		return peer ? peer->link.get() : nullptr;
+	}
+
+	void RakServicePlugin::OnAttach(void)
+	{
+		_SetNetworkThread();
+
+		auto& registry = detail::GetSameProcessPlugins();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		registry.plugins.push_back(this);
+	}
+
+	void RakServicePlugin::OnDetach(void)
+	{
+		detail::UnregisterSameProcessPlugin(this);
+		_DrainOutboundQueue();
+		FlushBatches();
+	}
+
+	void RakServicePlugin::Update(void)
+	{
+		_SetNetworkThread();
+		_DrainOutboundQueue();
+		_ExpireCalls();
+		FlushBatches();
+		_PumpTransfers();
+		_PumpSharedMemory();
+	}
+
+	PluginReceiveResult RakServicePlugin::OnReceive(Packet *packet)
+	{
+		return HandleMessage(packet->systemAddress, packet->data, packet->length) ? RR_STOP_PROCESSING_AND_DEALLOCATE : RR_CONTINUE_PROCESSING;
+	}
+
+	void RakServicePlugin::OnClosedConnection(const SystemAddress &systemAddress, RakNetGUID rakNetGUID, PI2_LostConnectionReason /*lostConnectionReason*/)
+	{
+		auto it = mConnections.find(systemAddress);
+		if (it == mConnections.end())
+			return;
+
+		// unlink first, so handlers that reach out to the address again get a fresh state
+		std::unique_ptr<ConnectionState> connection(std::move(it->second));
+		mConnections.erase(it);
+		const SystemIndex index = connection->index();
+		if (index < mConnectionSlots.size() && mConnectionSlots[index] == connection.get())
+			mConnectionSlots[index] = nullptr;
+		mConnectionsById[connection->id() & ConnectionIndexMask] = nullptr;
+		mFreeConnectionIndices.push_back(connection->id() & ConnectionIndexMask);
+
+		// held back calls are dropped with the other slots of the peer
+		mQueuedCalls -= connection->load().queued;
+		_SetCongested(connection.get(), false);
+		mReturnSlots.cancel(connection->id());
+
+		mTransfers.erase(std::remove_if(mTransfers.begin(), mTransfers.end(), [&](const std::unique_ptr<OutgoingTransfer>& _transfer)
+		{
+			return _transfer->target.systemAddress == systemAddress
+				|| (rakNetGUID != UNASSIGNED_RAKNET_GUID && _transfer->target.rakNetGuid == rakNetGUID);
+		}), mTransfers.end());
+
+		const SystemAddress& address = connection->address();
+		for (RakServiceId sid = 0; sid < connection->knownServices().size(); ++sid)
+		{
+			auto* service = connection->knownServices()[sid] ? _FindService(sid) : nullptr;
+			if (service && service->_mDisconnectHandler)
+			{
+				detail::InvocationScope scope(service, address);
+				service->_mDisconnectHandler(service, address);
+			}
+		}
+
+		for (auto* service : connection->foreignServices())
+		{
+			if (service && service->_mDisconnectHandler)
+				service->_mDisconnectHandler(service, address);
+		}
+
+		connection->clear();
+		if (mConnectionPool.size() < ConnectionPoolCapacity)
+			mConnectionPool.push_back(std::move(connection));
+	}
+
+
+	void RakServicePlugin::_ConnectService(const ServiceName& name, AddressOrGUID systemIdentifier, ServiceFunctionReturnSlot handler)
+	{
+		auto* connection = _FindNegotiatedConnection(systemIdentifier);
+		if (connection)
+		{
+			_ConnectServices(connection, &name, 1, std::move(handler));
+			return;
+		}
+
+		auto conStream = _AcquireStream();
+		detail::SerializationArgs sargs(*conStream, this);
+		conStream->Write(MessageID(ID_RPC_PLUGIN));
+		conStream->Write(MessageID(ServiceMessageIds::SMI_CONNECT));
+		detail::SerializeView::write(sargs, name.view());
+		// off the network thread the owner of the slot is resolved when the message is drained
+		SystemAddress target = systemIdentifier.systemAddress;
+		if (target == UNASSIGNED_SYSTEM_ADDRESS && _IsNetworkThread())
+			target = mTransport->GetSystemAddressFromGuid(systemIdentifier.rakNetGuid);
+		if (target != UNASSIGNED_SYSTEM_ADDRESS)
+			sargs.target = &target;
+		_WriteReturn(sargs, std::move(handler));
+		// connects are never held back by call windows
+		mWrittenCallStream = nullptr;
+		// peers without versions stop reading after the return slot
+		if (mWireVersion > detail::WireVersion1)
+			conStream->Write(mWireVersion);
+
+		_Send(*conStream, systemIdentifier, RakServiceSendOptions());
+	}
+
+	bool RakServicePlugin::_ConnectSameProcess(const ServiceName* _names, std::size_t _count, const AddressOrGUID& _target, RakService** _services)
+	{
+		auto* plugin = _FindSameProcessPlugin(_target);
+		if (!plugin)
+			return false;
+
+		// calls through proxies are on their way, direct calls would overtake them
+		auto it = mConnections.find(_ResolveAddress(_target));
+		if (it != mConnections.end() && it->second->hasForeignServices())
+			return false;
+
+		// the peer runs the disconnect handlers of the services once it loses the connection to us
+		const SystemAddress origin = plugin->rakPeerInterface->GetSystemAddressFromGuid(rakPeerInterface->GetMyGUID());
+		if (origin == UNASSIGNED_SYSTEM_ADDRESS)
+			return false;
+
+		for (std::size_t i = 0; i < _count; ++i)
+			_services[i] = plugin->_WelcomeConnect(origin, _names[i].view(), _names[i].hash());
+		return true;
+	}
+
+	RakServicePlugin* RakServicePlugin::_FindSameProcessPlugin(const AddressOrGUID& _target) const
+	{
+		// peers are only found through RakPeers
+		if (!mSameProcessCalls || !rakPeerInterface || mTransport != mRakNetTransport.get() || !_IsNetworkThread())
+			return nullptr;
+
+		const RakNetGUID guid = _target.systemAddress != UNASSIGNED_SYSTEM_ADDRESS
+			? rakPeerInterface->GetGuidFromSystemAddress(_target.systemAddress)
+			: _target.rakNetGuid;
+		if (guid == UNASSIGNED_RAKNET_GUID)
+			return nullptr;
+
+		auto& registry = detail::GetSameProcessPlugins();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		for (auto* plugin : registry.plugins)
+		{
+			// services that are dispatched or pumped by another thread keep going through the network
+			if (plugin == this || plugin->mChannel != mChannel || !plugin->rakPeerInterface || plugin->rakPeerInterface->GetMyGUID() != guid)
+				continue;
+			if (plugin->mDispatcher || plugin->mTransport != plugin->mRakNetTransport.get() || !plugin->_IsNetworkThread())
+				return nullptr;
+			return plugin;
+		}
+		return nullptr;
+	}
+
+	RakService* RakServicePlugin::_FindSameProcessService(const SystemAddress& _addr, RakServiceId _sid)
+	{
+		auto* plugin = _FindSameProcessPlugin(_addr);
+		if (!plugin)
+			return nullptr;
+		// a peer this plugin never talked to has no proxies either
+		auto* connection = _FindConnection(_addr);
+		if (connection && connection->hasForeignServices())
+			return nullptr;
+		return plugin->_FindService(_sid);
+	}
+
+	void RakServicePlugin::_ConnectServices(ConnectionState* _connection, const ServiceName* _names, std::size_t _count, ServiceFunctionReturnSlot _handler)
+	{
+		RakAssert(_count > 0 && _count <= MaxConnectBatch);
+		auto conStream = _AcquireStream();
+		detail::SerializationArgs sargs(*conStream, this);
+		sargs.version = _connection->version();
+		conStream->Write(MessageID(ID_RPC_PLUGIN));
+		conStream->Write(MessageID(ServiceMessageIds::SMI_CONNECT_MANY));
+		detail::WriteVarint(*conStream, _count);
+		for (std::size_t i = 0; i < _count; ++i)
+		{
+			int token = _connection->findSentName(_names[i]);
+			if (token >= 0)
+			{
+				detail::WriteVarint(*conStream, unsigned(token) + 1);
+				continue;
+			}
+
+			token = _connection->internSentName(_names[i]);
+			detail::WriteVarint(*conStream, token >= 0 ? unsigned(token) + 1 : 0u);
+			detail::SerializeView::write(sargs, _names[i].view());
+		}
+
+		const SystemAddress target = _connection->address();
+		sargs.target = &target;
+		_WriteReturn(sargs, std::move(_handler));
+		mWrittenCallStream = nullptr;
+		_Send(*conStream, target, RakServiceSendOptions());
+	}
+
+	RakServicePlugin::ConnectionState* RakServicePlugin::_FindNegotiatedConnection(const AddressOrGUID& _target)
+	{
+		// the interned names live in the connection state, which only the network thread touches
+		if (!_IsNetworkThread())
+			return nullptr;
+
+		const SystemAddress addr = _ResolveAddress(_target);
+		if (addr == UNASSIGNED_SYSTEM_ADDRESS)
+			return nullptr;
+
+		auto it = mConnections.find(addr);
+		if (it == mConnections.end() || it->second->version() < detail::WireVersion2)
+			return nullptr;
+		return it->second.get();
+	}
+
+	void RakServicePlugin::_Send(const BitStream& _stream, const AddressOrGUID& _target, const RakServiceSendOptions& _options)
+	{
+		if (!_IsNetworkThread())
+		{
+			_EnqueueOutbound(_stream, _target, _options);
+			return;
+		}
+
+		if (!detail::tPendingBlobs.empty())
+		{
+			auto blobs = detail::TakePendingBlobs(_stream);
+			if (!blobs.empty())
+			{
+				_SendStreamed(_stream, _target, std::move(blobs));
+				return;
+			}
+		}
+
+		if (!mBatching)
+		{
+			_SendUnbatched(_stream, _target, _options);
+			return;
+		}
+
+		// a guid that is not connected has no address to batch for
+		const SystemAddress target = _ResolveAddress(_target);
+		if (target == UNASSIGNED_SYSTEM_ADDRESS)
+		{
+			_SendUnbatched(_stream, _target, _options);
+			return;
+		}
+
+		// without ID_RPC_PLUGIN, which the batch carries once for all messages
+		const unsigned int length = _stream.GetNumberOfBytesUsed() - sizeof(MessageID);
+		const unsigned int entrySize = sizeof(unsigned short) + length;
+		auto it = mBatchIndex.find(target);
+
+		if (entrySize + 2 * sizeof(MessageID) > mMaxBatchBytes || length > 0xFFFF)
+		{
+			// too big to be batched, but it must not overtake what is already queued for the target
+			if (it != mBatchIndex.end())
+				_SendBatch(mBatches[it->second]);
+			_SendUnbatched(_stream, target, _options);
+			return;
+		}
+
+		if (it == mBatchIndex.end())
+		{
+			it = mBatchIndex.emplace(target, mBatches.size()).first;
+			mBatches.emplace_back(target, _AcquireStream());
+		}
+
+		auto& batch = mBatches[it->second];
+		if (batch.messages > 0 && (!(batch.options == _options) || batch.stream->GetNumberOfBytesUsed() + entrySize > mMaxBatchBytes))
+			_SendBatch(batch);
+
+		if (batch.messages == 0)
+		{
+			batch.options = _options;
+			batch.stream->Write(MessageID(ID_RPC_PLUGIN));
+			batch.stream->Write(MessageID(ServiceMessageIds::SMI_BATCH));
+		}
+
+		batch.stream->Write(static_cast<unsigned short>(length));
+		batch.stream->WriteAlignedBytes(_stream.GetData() + sizeof(MessageID), length);
+		++batch.messages;
+	}
+
+	void RakServicePlugin::_SendUnbatched(const BitStream& _stream, const AddressOrGUID& _target, const RakServiceSendOptions& _options)
+	{
+		if (!mSharedMemoryLinks.empty())
+		{
+			if (auto* peer = _FindSharedMemoryPeer(_ResolveAddress(_target)))
+			{
+				_SendSharedMemory(*peer, _stream);
+				return;
+			}
+		}
+
+		RakServiceSendOptions options = _options;
+		if (options.channel == RakServiceSendOptions::DefaultChannel)
+			options.channel = mChannel;
+		mTransport->Send(_stream, _target, options);
+	}
+
+	void RakServicePlugin::_SendBatch(OutgoingBatch& _batch)
+	{
+		if (_batch.messages == 0)
+			return;
+
+		_SendUnbatched(*_batch.stream, _batch.target, _batch.options);
+		_batch.stream->Reset();
+		_batch.messages = 0;
+	}
+
+	void RakServicePlugin::_SendStreamed(const BitStream& _stream, const AddressOrGUID& _target, std::vector<detail::OutgoingBlob>&& _blobs)
+	{
+		auto message = _AcquireStream();
+		message->WriteBits(_stream.GetData(), _stream.GetNumberOfBitsUsed(), false);
+		mTransfers.emplace_back(new OutgoingTransfer(_target, std::move(message), std::move(_blobs)));
+	}
+
+	void RakServicePlugin::_PumpTransfers()
+	{
+		unsigned int budget = mStreamBytesPerUpdate;
+		while (budget > 0 && !mTransfers.empty())
+		{
+			// one chunk per transfer and pass, the first transfer is never blocked
+			for (std::size_t i = 0; i < mTransfers.size() && budget > 0;)
+			{
+				auto& transfer = *mTransfers[i];
+
+				// transfers to the same peer run one after another, so their messages keep their order
+				bool blocked = false;
+				for (std::size_t j = 0; j < i && !blocked; ++j)
+				{
+					const auto& other = mTransfers[j]->target;
+					blocked = other.systemAddress == transfer.target.systemAddress && other.rakNetGuid == transfer.target.rakNetGuid;
+				}
+				if (blocked)
+				{
+					++i;
+					continue;
+				}
+
+				if (transfer.blob < transfer.blobs.size())
+				{
+					const auto& outgoing = transfer.blobs[transfer.blob];
+					const std::size_t length = std::min(std::min(detail::BlobChunkBytes, std::size_t(budget)), outgoing.blob.size() - transfer.offset);
+
+					auto chunk = _AcquireStream();
+					chunk->Write(MessageID(ID_RPC_PLUGIN));
+					chunk->Write(MessageID(ServiceMessageIds::SMI_CHUNK));
+					chunk->Write(outgoing.id);
+					chunk->Write(static_cast<unsigned int>(outgoing.blob.size()));
+					chunk->Write(static_cast<unsigned int>(transfer.offset));
+					chunk->WriteAlignedBytes(outgoing.blob.data() + transfer.offset, static_cast<unsigned int>(length));
+					_SendUnbatched(*chunk, transfer.target, mStreamOptions);
+
+					budget -= static_cast<unsigned int>(length);
+					transfer.offset += length;
+					if (transfer.offset == outgoing.blob.size())
+					{
+						++transfer.blob;
+						transfer.offset = 0;
+					}
+				}
+
+				if (transfer.blob == transfer.blobs.size())
+				{
+					_SendUnbatched(*transfer.message, transfer.target, mStreamOptions);
+					mTransfers.erase(mTransfers.begin() + i);
+				}
+				else{
+					++i;
+				}
+			}
+		}
+	}
+
+	RakServicePlugin::SharedMemoryPeer* RakServicePlugin::_FindSharedMemoryPeer(const SystemAddress& _address) const
+	{
+		for (auto& peer : mSharedMemoryLinks)
+		{
+			if (peer->address == _address)
+				return peer.get();
+		}
+		return nullptr;
+	}
+
+	void RakServicePlugin::_SendSharedMemory(SharedMemoryPeer& _peer, const BitStream& _stream)
+	{
+		if (_peer.broken)
+			return;
+
+		const unsigned int length = _stream.GetNumberOfBytesUsed();
+		if (length > _peer.link->maxMessageSize())
+		{
+			// the peer would miss a message of an ordered stream, so the link goes like a lost connection
+			_peer.broken = true;
+			_peer.backlog.clear();
+			return;
+		}
+
+		if (_peer.backlog.empty() && _peer.link->send(_stream.GetData(), length))
+			return;
+		_peer.backlog.emplace_back(_stream.GetData(), _stream.GetData() + length);
+	}
+
+	void RakServicePlugin::_PumpSharedMemory()
+	{
+		for (std::size_t i = 0; i < mSharedMemoryLinks.size();)
+		{
+			SharedMemoryPeer* peer = mSharedMemoryLinks[i].get();
+			if (peer->broken)
+			{
+				RemoveSharedMemoryLink(peer->address);
+				continue;
+			}
+
+			while (!peer->backlog.empty() && peer->link->send(peer->backlog.front().data(), static_cast<std::uint32_t>(peer->backlog.front().size())))
+				peer->backlog.pop_front();
+
+			const unsigned char* data = nullptr;
+			std::uint32_t length = 0;
+			bool removed = false;
+			while (!removed && peer->link->peek(data, length))
+			{
+				// the message is released from the ring once it was handled
+				HandleMessage(peer->address, data, length);
+
+				// handlers may have removed the link
+				removed = i >= mSharedMemoryLinks.size() || mSharedMemoryLinks[i].get() != peer;
+				if (!removed)
+					peer->link->pop();
+			}
+			if (removed)
+				continue;
+
+			if (peer->link->isPeerClosed() && !peer->link->peek(data, length))
+			{
+				RemoveSharedMemoryLink(peer->address);
+				continue;
+			}
+			++i;
+		}
+	}
+
+	void RakServicePlugin::_WriteBlob(detail::SerializationArgs& sargs, const ServiceBlob& _blob)
+	{
+		RakAssert(_blob.size() <= 0xFFFFFFFFu);
+		const unsigned int threshold = mStreamThreshold.load(std::memory_order_relaxed);
+		const bool streamed = threshold > 0 && _blob.size() > threshold;
+		sargs.stream.Write(streamed);
+		if (!streamed)
+		{
+			sargs.stream.Write(static_cast<unsigned int>(_blob.size()));
+			sargs.stream.WriteAlignedBytes(_blob.data(), static_cast<unsigned int>(_blob.size()));
+			return;
+		}
+
+		// the chunks are sent after the call returned, so a borrowed blob is copied now
+		detail::PendingBlob pending;
+		pending.stream = &sargs.stream;
+		pending.outgoing.id = mNextBlobId.fetch_add(1, std::memory_order_relaxed);
+		pending.outgoing.blob = _blob;
+		pending.outgoing.blob.own();
+		sargs.stream.Write(pending.outgoing.id);
+		sargs.stream.Write(static_cast<unsigned int>(_blob.size()));
+		detail::tPendingBlobs.push_back(std::move(pending));
+	}
+
+	ServiceBlob RakServicePlugin::_TakeBlob(const SystemAddress& _address, unsigned int _id, unsigned int _size)
+	{
+		return _GetConnection(_address)->takeBlob(_id, _size);
+	}
+
+	RakServicePlugin::ReturnSlotId RakServicePlugin::_RegisterReturn(ServiceFunctionReturnSlot _callback)
+	{
+		RakAssert(_IsNetworkThread());
+		return mReturnSlots.add(std::move(_callback));
+	}
+
+	void RakServicePlugin::_WriteReturn(detail::SerializationArgs& sargs, ServiceFunctionReturnSlot _callback)
+	{
+		// nobody is going to answer, e.g. a call on an empty group
+		if (sargs.replies == 0)
+		{
+			detail::WriteReturnSlotId(sargs.stream, detail::ReturnSlotTable::InvalidId, sargs.version);
+			return;
+		}
+
+		RakServiceDeadline* deadline = RakServiceDeadline::Current();
+		const unsigned int timeout = deadline ? deadline->timeout() : mCallTimeout.load(std::memory_order_relaxed);
+		const bool compact = sargs.version < detail::WireVersion2;
+
+		if (_IsNetworkThread())
+		{
+			const unsigned int owner = sargs.target ? _GetConnection(*sargs.target)->id() : 0;
+			const ReturnSlotId rid = _AddReturn(std::move(_callback), sargs.replies, owner, sargs.metrics, timeout, compact);
+			if (sargs.group && rid != detail::ReturnSlotTable::InvalidId)
+				_SetGroupMembers(rid, *sargs.group);
+			if (deadline)
+				deadline->_SetLastCall(rid);
+			if (sargs.target && rid != detail::ReturnSlotTable::InvalidId)
+			{
+				mWrittenCallStream = &sargs.stream;
+				mWrittenCall = rid;
+			}
+			detail::WriteReturnSlotId(sargs.stream, compact ? detail::ReturnSlotTable::compact(rid) : rid, sargs.version);
+			return;
+		}
+
+		// the slot table belongs to the network thread, the real id is patched in when the message is drained
+		detail::PendingReturn pending;
+		pending.stream = &sargs.stream;
+		pending.deferred.offset = sargs.stream.GetWriteOffset();
+		pending.deferred.replies = sargs.replies;
+		pending.deferred.slot = std::move(_callback);
+		pending.deferred.metrics = sargs.metrics;
+		pending.deferred.timeout = timeout;
+		pending.deferred.compact = compact;
+		detail::tPendingReturns.push_back(std::move(pending));
+		detail::WriteReturnSlotId(sargs.stream, ReturnSlotId(0), sargs.version);
+	}
+
+	detail::PooledStream RakServicePlugin::_AcquireStream()
+	{
+		if (!_IsNetworkThread())
+			return detail::PooledStream(detail::LocalStreamPool());
+		return detail::PooledStream(mStreamPool);
+	}
+
+	bool RakServicePlugin::_IsNetworkThread() const
+	{
+		const auto networkThread = mNetworkThread.load(std::memory_order_relaxed);
+		return networkThread == std::thread::id() || networkThread == std::this_thread::get_id();
+	}
+
+	void RakServicePlugin::_SetNetworkThread()
+	{
+		const auto current = std::this_thread::get_id();
+		if (mNetworkThread.load(std::memory_order_relaxed) != current)
+			mNetworkThread.store(current, std::memory_order_relaxed);
+	}
+
+	void RakServicePlugin::_EnqueueOutbound(const BitStream& _stream, const AddressOrGUID& _target, const RakServiceSendOptions& _options, const std::vector<detail::GroupMember>* _group, const detail::WindowedCall* _call)
+	{
+		auto* message = new detail::OutboundMessage();
+		message->stream.WriteBits(_stream.GetData(), _stream.GetNumberOfBitsUsed(), false);
+		message->target = _target;
+		message->options = _options;
+		if (_group)
+			message->group = *_group;
+		if (_call)
+			message->call = *_call;
+
+		auto& pending = detail::tPendingReturns;
+		for (auto& entry : pending)
+		{
+			if (entry.stream == &_stream)
+				message->returns.push_back(std::move(entry.deferred));
+		}
+		// a thread serializes one message at a time, anything else belongs to a message that was never sent
+		pending.clear();
+
+		if (!detail::tPendingBlobs.empty())
+			message->blobs = detail::TakePendingBlobs(_stream);
+
+		for (const auto& entry : detail::tPendingServices)
+		{
+			if (entry.stream == &_stream)
+				message->services.push_back(entry.service);
+		}
+		detail::tPendingServices.clear();
+
+		mOutboundQueue.push(message);
+	}
+
+	void RakServicePlugin::_DrainOutboundQueue()
+	{
+		while (auto* message = mOutboundQueue.pop())
+		{
+			std::unique_ptr<detail::OutboundMessage> owner(message);
+			// the peer may call a service as soon as the message arrives
+			for (auto* service : message->services)
+				_RegisterService(service);
+			// 0 is a valid slot id, InvalidId is never pending
+			ReturnSlotId call = detail::ReturnSlotTable::InvalidId;
+			if (!message->returns.empty())
+			{
+				// group calls are answered by several peers, their slots belong to none of them
+				const unsigned int connection = message->group.empty() ? _GetConnectionOwner(message->target) : 0;
+				for (auto& deferred : message->returns)
+				{
+					const ReturnSlotId rid = _AddReturn(std::move(deferred.slot), deferred.replies, connection, deferred.metrics, deferred.timeout, deferred.compact);
+					if (!message->group.empty() && rid != detail::ReturnSlotTable::InvalidId)
+						_SetGroupMembers(rid, message->group);
+					if (deferred.compact)
+						detail::PatchReturnSlotId(message->stream, deferred.offset, detail::ReturnSlotTable::compact(rid), detail::WireVersion1);
+					else
+						detail::PatchReturnSlotId(message->stream, deferred.offset, rid, detail::WireVersion2);
+					if (call == detail::ReturnSlotTable::InvalidId)
+						call = rid;
+				}
+			}
+
+			// hand streamed blobs to _Send the way they are passed on the network thread
+			for (auto& outgoing : message->blobs)
+			{
+				detail::PendingBlob pending;
+				pending.stream = &message->stream;
+				pending.outgoing = std::move(outgoing);
+				detail::tPendingBlobs.push_back(std::move(pending));
+			}
+
+			if (!message->group.empty())
+				_SendGroup(message->stream, message->group, message->options);
+			else if (mWindowed && call != detail::ReturnSlotTable::InvalidId && message->call.meta)
+				_SendCall(message->stream, _ResolveAddress(message->target), message->options, message->call, call);
+			else
+				_Send(message->stream, message->target, message->options);
+		}
+	}
+
+	RakServicePlugin::ReturnSlotId RakServicePlugin::_AddReturn(ServiceFunctionReturnSlot&& _slot, unsigned int _replies, unsigned int _owner, detail::FunctionMetrics* _metrics, unsigned int _timeoutMs, bool _compact)
+	{
+		const std::uint64_t now = _timeoutMs ? _DeadlineNow() : 0;
+		const ReturnSlotId rid = mReturnSlots.add(std::move(_slot), _replies, _owner, _metrics, _timeoutMs ? now + _timeoutMs : 0, _compact);
+		if (rid == detail::ReturnSlotTable::InvalidId)
+		{
+			// the message still goes out, its answer is dropped like a late one
+			_slot.expire();
+			return rid;
+		}
+
+		if (_timeoutMs)
+			mReturnSlots.setTimer(rid, mDeadlines.schedule(rid, now + _timeoutMs, now));
+		return rid;
+	}
+
+	void RakServicePlugin::_SetGroupMembers(ReturnSlotId _rid, const std::vector<detail::GroupMember>& _members)
+	{
+		// members that disconnect are taken out of the slot by cancel(), so it does not wait for them
+		std::vector<unsigned int> connections;
+		connections.reserve(_members.size());
+		for (const auto& member : _members)
+			connections.push_back(_GetConnection(member.address)->id());
+		mReturnSlots.setMembers(_rid, std::move(connections));
+	}
+
+	std::uint64_t RakServicePlugin::_DeadlineNow() const
+	{
+		return mTransport->GetTimeUS() / 1000;
+	}
+
+	void RakServicePlugin::_ExpireCalls()
+	{
+		if (mDeadlines.size() == 0)
+			return;
+
+		const std::uint64_t now = _DeadlineNow();
+		// expired callbacks may make new calls, those are scheduled into the wheel, not into this list
+		std::vector<detail::TimerWheel::Timer> due;
+		due.swap(mDueTimers);
+		mDeadlines.advance(now, due);
+		// the timers are out of the wheel, slots released by the callbacks below must not cancel them
+		for (const auto& timer : due)
+			mReturnSlots.clearTimer(timer.id);
+		for (const auto& timer : due)
+		{
+			ServiceFunctionReturnSlot slot;
+			unsigned int owner;
+			detail::SlotWindow window;
+			// an earlier callback of this list may have answered or cancelled the slot
+			if (!mReturnSlots.isDue(timer.id, now))
+				continue;
+			const ReturnSlotId wireRid = mReturnSlots.wireId(timer.id);
+			if (!mReturnSlots.remove(timer.id, slot, owner, &window))
+				continue;
+			++mExpiredCalls;
+			_DropCall(timer.id, wireRid, slot, owner, window);
+		}
+		due.clear();
+		mDueTimers.swap(due);
+	}
+
+	bool RakServicePlugin::CancelCall(ReturnSlotId _call)
+	{
+		RakAssert(_IsNetworkThread());
+		ServiceFunctionReturnSlot slot;
+		unsigned int owner;
+		detail::SlotWindow window;
+		const ReturnSlotId wireRid = mReturnSlots.wireId(_call);
+		if (!mReturnSlots.remove(_call, slot, owner, &window))
+			return false;
+		_DropCall(_call, wireRid, slot, owner, window);
+		return true;
+	}
+
+	void RakServicePlugin::_DropCall(ReturnSlotId _rid, ReturnSlotId _wireRid, ServiceFunctionReturnSlot& _slot, unsigned int _owner, const detail::SlotWindow& _window)
+	{
+		const bool windowed = _window.state != detail::SlotWindowState::NONE;
+		auto* connection = (mCancelMessages || windowed) && _owner ? _FindConnectionById(_owner) : nullptr;
+		// a held back call never reached the peer
+		if (connection && mCancelMessages && _window.state != detail::SlotWindowState::QUEUED)
+		{
+			auto stream = _AcquireStream();
+			stream->Write(MessageID(ID_RPC_PLUGIN));
+			stream->Write(MessageID(ServiceMessageIds::SMI_CANCEL));
+			stream->Write(_wireRid);
+			_Send(*stream, connection->address(), RakServiceSendOptions());
+		}
+		if (connection && windowed)
+			_ReleaseWindow(connection, _rid, _window);
+
+		// the slot is free already, so the callback may call again
+		_slot.expire();
 	}
 
-	RakServicePlugin::~RakServicePlugin()
+	bool RakServicePlugin::IsCallCancelled(const SystemAddress& _origin, ReturnSlotId _call)
 	{
+		RakAssert(_IsNetworkThread());
+		if (!mReceivedCancels)
+			return false;
+		auto it = mConnections.find(_origin);
+		return it != mConnections.end() && it->second->isCallCancelled(_call);
 	}
 
-	void RakServicePlugin::AddService(const char* name, RakService* service)
+	bool RakServicePlugin::_TakeCancelledReturn(const SystemAddress& _address, ReturnSlotId _rid)
 	{
-		IntroduceService(service);
-		mWelcomeServices.emplace(name, service);
+		// answers from other threads are sent anyway, the caller ignores them
+		if (!mReceivedCancels || !_IsNetworkThread())
+			return false;
+		auto it = mConnections.find(_address);
+		return it != mConnections.end() && it->second->takeCancelledCall(_rid);
 	}
 
-	RakService* RakServicePlugin::GetService(const char* name)
+	void RakServicePlugin::_HandleCancel(BitStream& _stream, const SystemAddress& _sender)
 	{
-		auto it = mWelcomeServices.find(name);
-		return it == mWelcomeServices.end() ? nullptr : it->second;
+		ReturnSlotId rid;
+		if (!_stream.Read(rid))
+			return;
+		mReceivedCancels = true;
+		_GetConnection(_sender)->cancelCall(rid);
 	}
 
-	RakService* RakServicePlugin::RemoveService(const char* name)
+	void RakServicePlugin::_BeginReturn(detail::SerializationArgs& sargs, ReturnSlotId rid, bool _compact)
 	{
-		auto it = mWelcomeServices.find(name);
-		if (it == mWelcomeServices.end())
-			return nullptr;
+		sargs.stream.Write(MessageID(ID_RPC_PLUGIN));
+		if (sargs.version >= detail::WireVersion2)
+		{
+			if (_compact)
+			{
+				sargs.stream.Write(static_cast<unsigned char>(PackedHeaderFlag | (PMK_RETURN << 4) | PackedCompactReturn));
+				detail::WriteVarint(sargs.stream, rid);
+				return;
+			}
+			sargs.stream.Write(static_cast<unsigned char>(PackedHeaderFlag | (PMK_RETURN << 4)));
+			detail::WriteVarint(sargs.stream, rid & detail::ReturnSlotTable::IndexMask);
+			detail::WriteVarint(sargs.stream, rid >> detail::ReturnSlotTable::IndexBits);
+			return;
+		}
 
-		auto* service = it->second;
-		mWelcomeServices.erase(it);
-		return service;
+		sargs.stream.Write(MessageID(ServiceMessageIds::SMI_RETURN));
+		detail::WriteReturnSlotId(sargs.stream, rid, detail::WireVersion1);
 	}
 
-	void RakServicePlugin::IntroduceService(RakService* service)
+	void RakServicePlugin::_EndReturn(detail::SerializationArgs& sargs, const SystemAddress& _address, const RakServiceSendOptions& _options)
 	{
-		auto controller = service->GetServiceController();
-		if (controller.GetRakServicePlugin() == this)
+		_Send(sargs.stream, _address, _options);
+	}
+
+	void RakServicePlugin::_EndCall(const BitStream& stream, const SystemAddress& _address, const RakServiceSendOptions& _options, const detail::WindowedCall& _call)
+	{
+		if (!_IsNetworkThread())
+		{
+			_EnqueueOutbound(stream, _address, _options, nullptr, &_call);
 			return;
-		RakAssert(controller.GetRakServicePlugin() == nullptr);
+		}
 
-		service->_mServicePlugin = this;
-		service->_mServiceId = mNextServiceId++;
+		const ReturnSlotId rid = mWrittenCallStream == &stream ? mWrittenCall : detail::ReturnSlotTable::InvalidId;
+		mWrittenCallStream = nullptr;
+		if (mWindowed && rid != detail::ReturnSlotTable::InvalidId)
+			_SendCall(stream, _address, _options, _call, rid);
+		else
+			_Send(stream, _address, _options);
+	}
 
-		mServices.emplace(controller.GetServiceId(), service);
+	void RakServicePlugin::SetCallWindow(const RakServiceCallWindow& _window)
+	{
+		RakAssert(_IsNetworkThread());
+		mCallWindow = _window;
+		mWindowed = true;
+		// a wider window lets held back calls go
+		for (auto& entry : mConnections)
+			_PumpWindow(entry.second.get());
 	}
 
-	void RakServicePlugin::OnAttach(void)
+	void RakServicePlugin::_SetServiceCallWindow(const RakServiceMetaInfo* _meta, const RakServiceCallWindow& _window)
 	{
+		RakAssert(_IsNetworkThread());
+		if (_window.maxInFlight == 0)
+			mServiceWindows.erase(_meta);
+		else
+			mServiceWindows[_meta] = _window;
+		mWindowed = true;
+		for (auto& entry : mConnections)
+			_PumpWindow(entry.second.get());
 	}
 
-	void RakServicePlugin::OnDetach(void)
+	RakServicePeerLoad RakServicePlugin::GetPeerLoad(const SystemAddress& _address) const
 	{
+		RakAssert(_IsNetworkThread());
+		auto it = mConnections.find(_address);
+		return it == mConnections.end() ? RakServicePeerLoad() : it->second->load();
 	}
 
-	PluginReceiveResult RakServicePlugin::OnReceive(Packet *packet)
+	const RakServiceCallWindow* RakServicePlugin::_FullWindow(const ConnectionState* _connection, const detail::WindowedCall& _call) const
 	{
-		if(MessageID(packet->data[0]) == ID_RPC_PLUGIN)
+		if (!mServiceWindows.empty())
 		{
-			BitStream stream(packet->data + sizeof(MessageID), packet->bitSize - sizeof(MessageID), false);
-			_HandlePackage(stream, packet);
-			return RR_STOP_PROCESSING_AND_DEALLOCATE;
+			auto it = mServiceWindows.find(_call.meta);
+			if (it != mServiceWindows.end() && _connection->serviceInFlight(_call.sid) >= it->second.maxInFlight)
+				return &it->second;
 		}
-
-		return RR_CONTINUE_PROCESSING;
+		if (mCallWindow.maxInFlight && _connection->load().inFlight >= mCallWindow.maxInFlight)
+			return &mCallWindow;
+		return nullptr;
 	}
 
-	void RakServicePlugin::OnClosedConnection(const SystemAddress &systemAddress, RakNetGUID rakNetGUID, PI2_LostConnectionReason lostConnectionReason)
+	void RakServicePlugin::_SendCall(const BitStream& _stream, const SystemAddress& _address, const RakServiceSendOptions& _options, const detail::WindowedCall& _call, ReturnSlotId _rid)
 	{
+		// the address of a disconnected peer has no state worth creating, nobody answers anyway
+		auto it = mConnections.find(_address);
+		if (it == mConnections.end())
+		{
+			_Send(_stream, _address, _options);
+			return;
+		}
+
+		auto* connection = it->second.get();
+		// later calls queue behind held back ones, so a peer sees calls in the order they were made
+		const RakServiceCallWindow* window = _FullWindow(connection, _call);
+		if (!window && connection->serviceQueued(_call.sid) > 0)
+		{
+			auto service = mServiceWindows.find(_call.meta);
+			window = service != mServiceWindows.end() ? &service->second : &mCallWindow;
+		}
+		if (window)
+		{
+			_HoldCall(connection, _stream, _options, _call, _rid, *window);
+			return;
+		}
+
+		detail::SlotWindow slotWindow;
+		slotWindow.state = detail::SlotWindowState::IN_FLIGHT;
+		slotWindow.service = _call.sid;
+		mReturnSlots.setWindow(_rid, slotWindow);
+		connection->addInFlight(_call.sid, 1);
+		_Send(_stream, _address, _options);
 	}
 
+	void RakServicePlugin::_HoldCall(ConnectionState* _connection, const BitStream& _stream, const RakServiceSendOptions& _options, const detail::WindowedCall& _call, ReturnSlotId _rid, const RakServiceCallWindow& _window)
+	{
+		std::vector<detail::OutgoingBlob> blobs;
+		if (!detail::tPendingBlobs.empty())
+			blobs = detail::TakePendingBlobs(_stream);
+
+		auto& queue = _connection->queuedCalls();
+		// the call that is given up, the coalesced one or this one if it is rejected
+		bool drop = false;
+		ReturnSlotId dropped = _rid;
+		if (_window.policy == RakServiceWindowPolicy::COALESCE)
+		{
+			auto it = std::find_if(queue.begin(), queue.end(), [&](const ConnectionState::QueuedCall& _queued)
+			{
+				return _queued.call.sid == _call.sid && _queued.call.fid == _call.fid;
+			});
+			if (it != queue.end())
+			{
+				// the new call takes the place of the old one, so it keeps the old one's position
+				drop = true;
+				dropped = it->rid;
+				it->rid = _rid;
+				it->options = _options;
+				it->stream->Reset();
+				it->stream->WriteBits(_stream.GetData(), _stream.GetNumberOfBitsUsed(), false);
+				it->blobs = std::move(blobs);
+				++_connection->load().coalesced;
+			}
+		}
+
+		if (!drop)
+		{
+			const bool serviceWindow = &_window != &mCallWindow;
+			const std::size_t queued = serviceWindow ? _connection->serviceQueued(_call.sid) : _connection->load().queued;
+			if (_window.policy == RakServiceWindowPolicy::REJECT || (_window.maxQueued && queued >= _window.maxQueued))
+			{
+				// nothing is held back, so a rejection alone does not congest the peer
+				drop = true;
+				++_connection->load().rejected;
+			}
+			else{
+				auto stream = _AcquireStream();
+				stream->WriteBits(_stream.GetData(), _stream.GetNumberOfBitsUsed(), false);
+				queue.emplace_back(_call, _rid, _options, std::move(stream), std::move(blobs));
+				_connection->addQueued(_call.sid, 1);
+				++mQueuedCalls;
+				_SetCongested(_connection, true);
+			}
+		}
+
+		detail::SlotWindow slotWindow;
+		slotWindow.state = detail::SlotWindowState::QUEUED;
+		slotWindow.service = _call.sid;
+		if (!drop || dropped != _rid)
+			mReturnSlots.setWindow(_rid, slotWindow);
+
+		// the dropped call never reached the peer, its slot is released without a cancel message
+		ServiceFunctionReturnSlot slot;
+		unsigned int owner;
+		if (drop && mReturnSlots.remove(dropped, slot, owner))
+			slot.expire();
+	}
 
-	void RakServicePlugin::_ConnectService(const char* name, AddressOrGUID systemIdentifier, std::function<void(detail::DeserializationArgs&)> handler)
+	void RakServicePlugin::_ReleaseWindow(ConnectionState* _connection, ReturnSlotId _rid, const detail::SlotWindow& _window)
 	{
-		auto slotId = _RegisterReturn(handler);
-		BitStream conStream;
-		conStream.Write(MessageID(ID_RPC_PLUGIN));
-		conStream.Write(MessageID(ServiceMessageIds::SMI_CONNECT));
-		conStream.Write(RakNet::RakString(name));
-		conStream.Write(slotId);
-		
-		SendUnified(&conStream, HIGH_PRIORITY, RELIABLE_ORDERED, mChannel, systemIdentifier, false);
+		if (_window.state == detail::SlotWindowState::IN_FLIGHT)
+		{
+			_connection->addInFlight(_window.service, -1);
+			_PumpWindow(_connection);
+			return;
+		}
+
+		auto& queue = _connection->queuedCalls();
+		auto it = std::find_if(queue.begin(), queue.end(), [&](const ConnectionState::QueuedCall& _queued) { return _queued.rid == _rid; });
+		if (it == queue.end())
+			return;
+		queue.erase(it);
+		_connection->addQueued(_window.service, -1);
+		--mQueuedCalls;
+		if (queue.empty())
+			_SetCongested(_connection, false);
 	}
 
-	RakServicePlugin::ReturnSlotId RakServicePlugin::_RegisterReturn(ServiceFunctionReturnSlot _callback)
+	void RakServicePlugin::_PumpWindow(ConnectionState* _connection)
 	{
-		auto slotId = mNextReturnSlotId++;
+		auto& queue = _connection->queuedCalls();
+		const std::uint64_t now = _DeadlineNow();
+		for (auto it = queue.begin(); it != queue.end();)
+		{
+			// a full peer window holds back every call, a full service window only the calls to its service
+			if (mCallWindow.maxInFlight && _connection->load().inFlight >= mCallWindow.maxInFlight)
+				break;
+			// calls that are due stay until _ExpireCalls drops them, sending them would only waste the window
+			if (_FullWindow(_connection, it->call) || mReturnSlots.isDue(it->rid, now))
+			{
+				++it;
+				continue;
+			}
+
+			ConnectionState::QueuedCall queued(std::move(*it));
+			it = queue.erase(it);
+			_connection->addQueued(queued.call.sid, -1);
+			--mQueuedCalls;
 
-		auto ret = mReturnSlots.emplace(slotId, std::move(_callback));
-		RakAssert(ret.second);
+			detail::SlotWindow slotWindow;
+			slotWindow.state = detail::SlotWindowState::IN_FLIGHT;
+			slotWindow.service = queued.call.sid;
+			mReturnSlots.setWindow(queued.rid, slotWindow);
+			_connection->addInFlight(queued.call.sid, 1);
+
+			for (auto& outgoing : queued.blobs)
+			{
+				detail::PendingBlob pending;
+				pending.stream = queued.stream.get();
+				pending.outgoing = std::move(outgoing);
+				detail::tPendingBlobs.push_back(std::move(pending));
+			}
+			// _Send may run handlers that change the queue, so the iterator is found again
+			const std::size_t index = it - queue.begin();
+			_Send(*queued.stream, _connection->address(), queued.options);
+			it = queue.begin() + std::min(index, queue.size());
+		}
 
-		return slotId;
+		if (queue.empty())
+			_SetCongested(_connection, false);
 	}
 
-	void RakServicePlugin::_BeginReturn(detail::SerializationArgs& sargs, ReturnSlotId rid)
+	void RakServicePlugin::_SetCongested(ConnectionState* _connection, bool _congested)
 	{
-		sargs.stream.Write(MessageID(ID_RPC_PLUGIN));
-		sargs.stream.Write(MessageID(ServiceMessageIds::SMI_RETURN));
-		sargs.stream.Write(rid);
+		auto& load = _connection->load();
+		if (load.congested == _congested)
+			return;
+		load.congested = _congested;
+		if (mCongestionHandler)
+			mCongestionHandler(_connection->address(), _congested);
 	}
 
-	void RakServicePlugin::_EndReturn(detail::SerializationArgs& sargs, const SystemAddress& _address)
+	void RakServicePlugin::_SendGroup(BitStream& _stream, const std::vector<detail::GroupMember>& _members, const RakServiceSendOptions& _options)
 	{
-		SendUnified(&sargs.stream, HIGH_PRIORITY, RELIABLE_ORDERED, mChannel, _address, false);
+		if (!_IsNetworkThread())
+		{
+			_EnqueueOutbound(_stream, UNASSIGNED_SYSTEM_ADDRESS, _options, &_members);
+			return;
+		}
+
+		// the blobs are shared by every member's transfer
+		std::vector<detail::OutgoingBlob> blobs;
+		if (!detail::tPendingBlobs.empty())
+			blobs = detail::TakePendingBlobs(_stream);
+
+		// members are ordered by service id, so the header is patched once per distinct id and the
+		// members that share it get the message in one send
+		for (std::size_t first = 0, last = 0; first < _members.size(); first = last)
+		{
+			while (last < _members.size() && _members[last].sid == _members[first].sid)
+				++last;
+			detail::PatchServiceId(_stream, _members[first].sid);
+			if (blobs.empty())
+			{
+				_SendToMembers(_stream, &_members[first], last - first, _options);
+				continue;
+			}
+			for (std::size_t i = first; i < last; ++i)
+				_SendStreamed(_stream, _members[i].address, std::vector<detail::OutgoingBlob>(blobs));
+		}
 	}
 
-	void RakServicePlugin::_EndCall(const BitStream& stream, const SystemAddress& _address)
+	void RakServicePlugin::_SendToMembers(const BitStream& _stream, const detail::GroupMember* _members, std::size_t _count, const RakServiceSendOptions& _options)
 	{
-		SendUnified(&stream, HIGH_PRIORITY, RELIABLE_ORDERED, mChannel, _address, false);
+		mGroupTargets.clear();
+		for (std::size_t i = 0; i < _count; ++i)
+		{
+			const SystemAddress& address = _members[i].address;
+			// the call must not overtake what is already batched for the member
+			if (mBatching)
+			{
+				auto it = mBatchIndex.find(address);
+				if (it != mBatchIndex.end())
+					_SendBatch(mBatches[it->second]);
+			}
+			if (!mSharedMemoryLinks.empty())
+			{
+				if (auto* peer = _FindSharedMemoryPeer(address))
+				{
+					_SendSharedMemory(*peer, _stream);
+					continue;
+				}
+			}
+			mGroupTargets.push_back(address);
+		}
+
+		if (mGroupTargets.empty())
+			return;
+
+		RakServiceSendOptions options = _options;
+		if (options.channel == RakServiceSendOptions::DefaultChannel)
+			options.channel = mChannel;
+		mTransport->SendToMany(_stream, mGroupTargets.data(), mGroupTargets.size(), options);
 	}
 
-	void RakServicePlugin::_HandlePackage(BitStream& _stream, Packet* packet)
+	void RakServicePlugin::_HandlePackage(BitStream& _stream, const SystemAddress& _sender, bool _batched)
 	{
-		ServiceMessageIds pid = ServiceMessageIds(*_stream.GetData());
+		const unsigned char header = *_stream.GetData();
 		_stream.IgnoreBytes(1);
+		if (header & PackedHeaderFlag)
+		{
+			_HandlePacked(_stream, _sender, header);
+			return;
+		}
+
+		ServiceMessageIds pid = ServiceMessageIds(header);
 
 		switch (pid)
 		{
 		case ServiceMessageIds::SMI_CONNECT:
-			_HandleConnect(_stream, packet);
+			_HandleConnect(_stream, _sender);
 			break;
 		case ServiceMessageIds::SMI_RETURN:
-			_HandleReturn(_stream, packet);
+			_HandleReturn(_stream, _sender);
 			break;
 		case ServiceMessageIds::SMI_INVOKE:
-			_HandleInvoke(_stream, packet);
+			_HandleInvoke(_stream, _sender);
+			break;
+		case ServiceMessageIds::SMI_NOTIFY:
+			_HandleNotify(_stream, _sender);
 			break;
 		case ServiceMessageIds::SMI_DETACH:
 			break;
+		case ServiceMessageIds::SMI_BATCH:
+			// batches are never nested by the sender, a peer nesting them could exhaust the stack
+			if (!_batched)
+				_HandleBatch(_stream, _sender);
+			break;
+		case ServiceMessageIds::SMI_CHUNK:
+			_HandleChunk(_stream, _sender);
+			break;
+		case ServiceMessageIds::SMI_CONNECT_MANY:
+			_HandleConnectMany(_stream, _sender);
+			break;
+		case ServiceMessageIds::SMI_CANCEL:
+			_HandleCancel(_stream, _sender);
+			break;
 		default:
 			break;
 		}
 	}
 
-	void RakServicePlugin::_HandleConnect(BitStream& _stream, Packet* packet)
+	void RakServicePlugin::_HandleBatch(BitStream& _stream, const SystemAddress& _sender)
+	{
+		// every entry is a 16 bit length followed by the byte aligned message
+		while (_stream.GetNumberOfUnreadBits() >= 8 * sizeof(unsigned short))
+		{
+			unsigned short length;
+			_stream.Read(length);
+			_stream.AlignReadToByteBoundary();
+			if (_stream.GetNumberOfUnreadBits() < 8u * length || length == 0)
+				break;
+
+			BitStream message(_stream.GetData() + (_stream.GetReadOffset() >> 3), length, false);
+			_HandlePackage(message, _sender, true);
+			_stream.IgnoreBytes(length);
+		}
+	}
+
+	void RakServicePlugin::_HandleChunk(BitStream& _stream, const SystemAddress& _sender)
+	{
+		unsigned int id, size, offset;
+		if (!_stream.Read(id) || !_stream.Read(size) || !_stream.Read(offset) || size > mMaxBlobBytes)
+			return;
+
+		_stream.AlignReadToByteBoundary();
+		const std::size_t length = _stream.GetNumberOfUnreadBits() / 8;
+		_GetConnection(_sender)->receiveChunk(id, size, offset, _stream.GetData() + (_stream.GetReadOffset() >> 3), length, mMaxPendingBlobBytes);
+	}
+
+	void RakServicePlugin::_HandleConnect(BitStream& _stream, const SystemAddress& _sender)
+	{
+		const auto& recvAddr = _sender;
+		detail::DeserializationArgs args(_stream, this, recvAddr);
+		ServiceStringView serviceName;
+		detail::DeserializeView::read(args, serviceName);
+		ReturnSlotId rid;
+		if (!detail::ReadReturnSlotId(_stream, rid, detail::WireVersion1))
+			return;
+
+		RakService* service = _WelcomeConnect(recvAddr, serviceName, ServiceName::Hash(serviceName.data(), serviceName.size()));
+
+		// newer peers append the highest wire format they speak, the answer already uses the common one
+		unsigned char offered = detail::WireVersion1;
+		if (_stream.GetNumberOfUnreadBits() >= 8)
+			_stream.Read(offered);
+		const unsigned char version = std::max(detail::WireVersion1, std::min(offered, mWireVersion));
+		_GetConnection(recvAddr)->setVersion(version);
+
+		ServiceCallback<void(RakService*)> retFunc = detail::MakeInkoation<RakService*>(this, rid, recvAddr, nullptr, version, true);
+		retFunc(service);
+	}
+
+	void RakServicePlugin::_HandleConnectMany(BitStream& _stream, const SystemAddress& _sender)
 	{
-		const auto& recvAddr = packet->systemAddress;
-		RakNet::RakString serviceName;
-		_stream.Read(serviceName);
+		const auto& recvAddr = _sender;
+		auto* connection = _GetConnection(recvAddr);
+		detail::DeserializationArgs args(_stream, this, recvAddr);
+
+		unsigned long long count = 0;
+		if (!detail::ReadVarint(_stream, count) || count == 0 || count > MaxConnectBatch)
+			return;
+
+		RakService* services[MaxConnectBatch];
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			unsigned long long reference = 0;
+			if (!detail::ReadVarint(_stream, reference))
+				return;
 
-		RakService* service = GetService(serviceName.C_String());
+			if (reference == 0 || reference == connection->receivedNameCount() + 1)
+			{
+				ServiceStringView name;
+				detail::DeserializeView::read(args, name);
+				const unsigned int hash = ServiceName::Hash(name.data(), name.size());
+				if (reference != 0 && !connection->internReceivedName(name, hash))
+					return;
+				services[i] = _WelcomeConnect(recvAddr, name, hash);
+				continue;
+			}
+
+			auto* token = connection->receivedName(std::size_t(reference - 1));
+			if (!token)
+				return;
+			services[i] = _WelcomeConnect(recvAddr, ServiceStringView(token->name), token->hash);
+		}
+
+		ReturnSlotId rid;
+		if (!_stream.Read(rid))
+			return;
+
+		auto stream = _AcquireStream();
+		detail::SerializationArgs sargs(*stream, this);
+		sargs.version = connection->version();
+		_BeginReturn(sargs, rid);
+		for (std::size_t i = 0; i < count; ++i)
+			detail::SerializeService::write(sargs, services[i]);
+		_EndReturn(sargs, recvAddr, RakServiceSendOptions());
+	}
 
+	RakService* RakServicePlugin::_WelcomeConnect(const SystemAddress& _addr, const ServiceStringView& _name, unsigned int _hash)
+	{
+		RakService* service = _FindWelcomeService(_name, _hash);
 		if (service)
 		{
-			service->_mRecvAddress = recvAddr;
-			service->OnConnect();
-			service->_mRecvAddress = UNASSIGNED_SYSTEM_ADDRESS;
+			{
+				detail::InvocationScope scope(service, _addr);
+				service->OnConnect();
+			}
 
 			// add service
-			_AddForeignServiceHandle(recvAddr, service);
+			_AddForeignServiceHandle(_addr, service);
 		}
-
-		BitStream retStream;
-		detail::DeserializationArgs args(_stream, this, recvAddr);
-		std::function<void(RakService*)> retFunc;
-		detail::DeserializeFunction::read(args, retFunc);
-		retFunc(service);
+		return service;
 	}
 
-	void RakServicePlugin::_HandleReturn(BitStream& _stream, Packet* packet)
+	void RakServicePlugin::_HandleReturn(BitStream& _stream, const SystemAddress& _sender)
 	{
 		ReturnSlotId rid;
-		_stream.Read(rid);
+		if (!detail::ReadReturnSlotId(_stream, rid, detail::WireVersion1))
+			return;
+		_DeliverReturn(mReturnSlots.expand(rid), _stream, _sender, detail::WireVersion1);
+	}
+
+	void RakServicePlugin::_HandlePacked(BitStream& _stream, const SystemAddress& _sender, unsigned char _header)
+	{
+		// only peers that were offered version 2 send it, from now on they get it as well
+		auto* connection = _GetConnection(_sender);
+		if (connection->version() < detail::WireVersion2 && mWireVersion >= detail::WireVersion2)
+			connection->setVersion(detail::WireVersion2);
+
+		unsigned long long first = 0, second = 0;
+		const unsigned char kind = (_header >> 4) & 0x07;
+		if (kind == PMK_RETURN)
+		{
+			if (_header & PackedCompactReturn)
+			{
+				if (detail::ReadVarint(_stream, first) && first <= 0xFFFF)
+					_DeliverReturn(mReturnSlots.expand(static_cast<ReturnSlotId>(first)), _stream, _sender, detail::WireVersion2);
+				return;
+			}
+			if (!detail::ReadVarint(_stream, first) || !detail::ReadVarint(_stream, second))
+				return;
+			_DeliverReturn(static_cast<ReturnSlotId>((second << detail::ReturnSlotTable::IndexBits) | first), _stream, _sender, detail::WireVersion2);
+			return;
+		}
+
+		first = _header & PackedInlineFunctionIds;
+		if (first == PackedInlineFunctionIds && !detail::ReadVarint(_stream, first))
+			return;
+		if (!detail::ReadVarint(_stream, second) || first > 0xFF || second > 0xFFFF)
+			return;
+
+		if (kind == PMK_INVOKE)
+			_DeliverInvoke(RakServiceId(second), ServiceFunctionId(first), _stream, _sender, detail::WireVersion2);
+		else if (kind == PMK_NOTIFY)
+			_DeliverNotify(RakServiceId(second), ServiceFunctionId(first), _stream, _sender, detail::WireVersion2);
+	}
 
-		auto it = mReturnSlots.find(rid);
-		if (it == mReturnSlots.end())
+	void RakServicePlugin::_DeliverReturn(ReturnSlotId rid, BitStream& _stream, const SystemAddress& _sender, unsigned char _version)
+	{
+		// the slot is released before the callback runs, so the callback may register new returns
+		ServiceFunctionReturnSlot slot;
+		bool more;
+		detail::SlotWindow window;
+		const unsigned int from = mReturnSlots.isGroup(rid) ? _GetConnection(_sender)->id() : 0;
+		if (!mReturnSlots.take(rid, slot, more, &window, from))
 			return;
+		// held back calls go out before the callback makes new ones
+		if (window.state != detail::SlotWindowState::NONE)
+			_ReleaseWindow(_GetConnection(_sender), rid, window);
 
 		// call function
-		detail::DeserializationArgs sargs(_stream, this, packet->systemAddress);
-		it->second(sargs);
+		detail::DeserializationArgs sargs(_stream, this, _sender);
+		sargs.version = _version;
+		slot(sargs);
+
+		// group calls keep their slot until every member answered
+		if (more)
+			mReturnSlots.restore(rid, std::move(slot));
 	}
 
-	void RakServicePlugin::_HandleInvoke(BitStream& _stream, Packet* packet)
+	void RakServicePlugin::_HandleInvoke(BitStream& _stream, const SystemAddress& _sender)
 	{
 		RakServiceId sid;
-		_stream.Read(sid);
+		ServiceFunctionId fid;
+		if (!_stream.Read(sid) || !_stream.Read(fid))
+			return;
+		_DeliverInvoke(sid, fid, _stream, _sender, detail::WireVersion1);
+	}
 
-		auto it = mServices.find(sid);
-		if (it != mServices.end())
+	void RakServicePlugin::_DeliverInvoke(RakServiceId sid, ServiceFunctionId fid, BitStream& _stream, const SystemAddress& _sender, unsigned char _version)
+	{
+		auto* service = _FindService(sid);
+		if (service)
 		{
-			auto* service = it->second;
-			ServiceFunctionId fid;
-			_stream.Read(fid);
-			detail::DeserializationArgs sargs(_stream, this, packet->systemAddress);
-			service->_mRecvAddress = packet->systemAddress;
-			service->_Invoke(sargs, fid);
-			service->_mRecvAddress = UNASSIGNED_SYSTEM_ADDRESS;
+			auto* funcInfo = service->_GetMetaInfo()->function(fid);
+			detail::DeserializationArgs sargs(_stream, this, _sender, funcInfo ? &funcInfo->sendOptions() : nullptr);
+			sargs.version = _version;
+			_InvokeService(service, fid, sargs);
 		}
 	}
 
-	class RakServicePlugin::ForeignServiceTable
+	void RakServicePlugin::_HandleNotify(BitStream& _stream, const SystemAddress& _sender)
 	{
-	public:
-		void addService(RakService* service)
+		RakServiceId sid;
+		ServiceFunctionId fid;
+		if (!_stream.ReadCompressed(sid) || !_stream.Read(fid))
+			return;
+		_DeliverNotify(sid, fid, _stream, _sender, detail::WireVersion1);
+	}
+
+	void RakServicePlugin::_DeliverNotify(RakServiceId sid, ServiceFunctionId fid, BitStream& _stream, const SystemAddress& _sender, unsigned char _version)
+	{
+		auto* service = _FindService(sid);
+		if (!service)
+			return;
+
+		// a notification never answers, so it must not reach functions that expect callbacks
+		auto* funcInfo = service->_GetMetaInfo()->function(fid);
+		if (!funcInfo || !funcInfo->isOneWay())
+			return;
+
+		detail::DeserializationArgs sargs(_stream, this, _sender);
+		sargs.version = _version;
+		_InvokeService(service, fid, sargs);
+	}
+
+	void RakServicePlugin::_InvokeService(RakService* _service, ServiceFunctionId _fid, detail::DeserializationArgs& _args)
+	{
+		auto* metrics = _GetFunctionMetrics(_service, _fid);
+		if (metrics)
+			metrics->recordInvoke(_args.stream.GetNumberOfBytesUsed());
+
+		if (!mDispatcher)
 		{
-			RakAssert(service);
-			auto controller = service->GetServiceController();
-			if (controller.IsForeignService())
+			detail::InvocationScope scope(_service, _args.recvAddress);
+			detail::HandlerTimer timer(metrics);
+			_service->_Invoke(_args, _fid);
+			return;
+		}
+
+		// arguments are still deserialized here, only the handler itself runs on the dispatcher
+		detail::DispatchTarget target;
+		target.dispatcher = mDispatcher;
+		target.service = _service;
+		target.origin = _args.recvAddress;
+		target.metrics = metrics;
+		switch (mDispatchOrder)
+		{
+		case RakServiceDispatchOrder::PER_SERVICE:
+			target.strand = _service->GetServiceController().GetServiceId();
+			break;
+		case RakServiceDispatchOrder::PER_PEER:
+			target.strand = detail::SystemAddressHash()(_args.recvAddress);
+			break;
+		default:
+			target.strand = detail::SystemAddressHash()(_args.recvAddress) * 31 + _service->GetServiceController().GetServiceId();
+			break;
+		}
+
+		_args.dispatch = &target;
+		_service->_Invoke(_args, _fid);
+	}
+
+	RakServicePlugin::ConnectionState* RakServicePlugin::_GetConnection(const SystemAddress& addr)
+	{
+		// addresses of received packets carry their connection's index
+		const SystemIndex index = addr.systemIndex;
+		const bool indexed = index != SystemIndex(-1);
+		if (indexed && index < mConnectionSlots.size())
+		{
+			auto* connection = mConnectionSlots[index];
+			if (connection && connection->address() == addr)
+				return connection;
+		}
+
+		auto it = mConnections.find(addr);
+		if (it == mConnections.end())
+		{
+			std::unique_ptr<ConnectionState> connection;
+			unsigned int index;
+			if (mFreeConnectionIndices.empty())
 			{
-				auto res = mServices.emplace(controller.GetServiceId(), std::unique_ptr<RakService>(service));
-				RakAssert(res.second);
+				RakAssert(mConnectionsById.size() < ConnectionIndexMask);
+				index = static_cast<unsigned int>(mConnectionsById.size());
+				mConnectionsById.push_back(nullptr);
 			}
 			else{
-				mLocallyKnownServices[controller.GetServiceId()]++;
+				index = mFreeConnectionIndices.back();
+				mFreeConnectionIndices.pop_back();
 			}
+			// 0 is no connection, so generations start at 1
+			const unsigned int id = (mNextConnectionId << ConnectionIndexBits) | index;
+			mNextConnectionId = (mNextConnectionId & ConnectionGenerationMask) == ConnectionGenerationMask ? 1 : mNextConnectionId + 1;
+			if (mConnectionPool.empty())
+			{
+				connection.reset(new ConnectionState(addr, id));
+			}
+			else{
+				connection = std::move(mConnectionPool.back());
+				mConnectionPool.pop_back();
+				connection->reset(addr, id);
+			}
+			mConnectionsById[index] = connection.get();
+			it = mConnections.emplace(addr, std::move(connection)).first;
 		}
 
-		RakService* getService(RakServiceId sid)
+		// RakNet reuses indices of closed connections, so an occupied slot is simply taken over
+		auto* connection = it->second.get();
+		if (indexed)
 		{
-			auto it = mServices.find(sid);
-			return it == mServices.end() ? nullptr : it->second.get();
+			if (index >= mConnectionSlots.size())
+				mConnectionSlots.resize(index + 1, nullptr);
+			mConnectionSlots[index] = connection;
+			connection->setIndex(index);
 		}
+		return connection;
+	}
 
-	private:
-		std::unordered_map<RakServiceId, std::unique_ptr<RakService>> mServices;
-		std::unordered_map<RakServiceId, unsigned int> mLocallyKnownServices;
-	};
-
-	RakServicePlugin::ForeignServiceTable* RakServicePlugin::_GetForeignServiceTable(const SystemAddress& addr)
+	RakServicePlugin::ConnectionState* RakServicePlugin::_FindConnection(const SystemAddress& _addr) const
 	{
-		auto it = mForeignServices.find(addr);
-
-		if (it == mForeignServices.end())
+		const SystemIndex index = _addr.systemIndex;
+		if (index != SystemIndex(-1) && index < mConnectionSlots.size())
 		{
-			std::unique_ptr<ForeignServiceTable> table(new ForeignServiceTable());
-			auto* tablePtr = table.get();
-			mForeignServices.emplace_hint(it, addr, std::move(table));
-
-			return tablePtr;
+			auto* connection = mConnectionSlots[index];
+			if (connection && connection->address() == _addr)
+				return connection;
 		}
 
-		return it->second.get();
+		auto it = mConnections.find(_addr);
+		return it == mConnections.end() ? nullptr : it->second.get();
+	}
+
+	RakServicePlugin::ConnectionState* RakServicePlugin::_FindConnectionById(unsigned int _id) const
+	{
+		const unsigned int index = _id & ConnectionIndexMask;
+		if (index >= mConnectionsById.size())
+			return nullptr;
+		auto* connection = mConnectionsById[index];
+		return connection && connection->id() == _id ? connection : nullptr;
+	}
+
+	unsigned int RakServicePlugin::_GetConnectionOwner(const AddressOrGUID& _target)
+	{
+		const SystemAddress address = _ResolveAddress(_target);
+		return address == UNASSIGNED_SYSTEM_ADDRESS ? 0 : _GetConnection(address)->id();
+	}
+
+	SystemAddress RakServicePlugin::_ResolveAddress(const AddressOrGUID& _target) const
+	{
+		if (_target.systemAddress != UNASSIGNED_SYSTEM_ADDRESS)
+			return _target.systemAddress;
+		return mTransport->GetSystemAddressFromGuid(_target.rakNetGuid);
 	}
 
 	RakService* RakServicePlugin::_GetForeignService(const SystemAddress& addr, RakServiceId sid)
 	{
-		return _GetForeignServiceTable(addr)->getService(sid);
+		return _GetConnection(addr)->getService(sid);
 	}
 
 	void RakServicePlugin::_AddForeignService(const SystemAddress& addr, RakServiceId sid, RakService* serivce)
@@ -280,14 +2813,68 @@ namespace RakNet {
 		RakAssert(serivce->GetServiceController().GetRakServicePlugin() == nullptr);
 		serivce->_mServicePlugin = this;
 		serivce->_mServiceId = sid;
-		_GetForeignServiceTable(addr)->addService(serivce);
+		serivce->_mForeignAddress = addr;
+		auto* connection = _GetConnection(addr);
+		serivce->_mWireVersion = connection->version();
+		connection->addService(serivce);
 	}
 
 	void RakServicePlugin::_AddForeignServiceHandle(const SystemAddress& addr, RakService* service)
 	{
 		RakAssert(service);
 		RakAssert(!service->GetServiceController().IsForeignService());
-		_GetForeignServiceTable(addr)->addService(service);
+		_GetConnection(addr)->addService(service);
+	}
+
+	/********************************** RakServiceMetaInfo **********************************/
+	const RakServiceFunctionMetaInfo* RakServiceMetaInfo::function(ServiceFunctionId _id) const
+	{
+		// function tables are usually ordered by id
+		if (mBeginFunctions + _id < mEndFunctions && mBeginFunctions[_id].id() == _id)
+			return mBeginFunctions + _id;
+
+		for (auto& info : functions())
+		{
+			if (info.id() == _id)
+				return &info;
+		}
+		return nullptr;
+	}
+
+	/************************************** ServiceBlob *************************************/
+	ServiceBlob::ServiceBlob(const void* _data, std::size_t _size)
+		: mData(nullptr)
+		, mSize(0)
+	{
+		if (_size > 0)
+		{
+			auto* bytes = static_cast<const unsigned char*>(_data);
+			mBuffer = std::make_shared<const std::vector<unsigned char>>(bytes, bytes + _size);
+			mData = mBuffer->data();
+			mSize = _size;
+		}
+	}
+
+	ServiceBlob::ServiceBlob(Buffer _buffer)
+		: mBuffer(std::move(_buffer))
+		, mData(mBuffer ? mBuffer->data() : nullptr)
+		, mSize(mBuffer ? mBuffer->size() : 0)
+	{
+	}
+
+	ServiceBlob ServiceBlob::Borrow(const void* _data, std::size_t _size)
+	{
+		ServiceBlob blob;
+		blob.mData = static_cast<const unsigned char*>(_data);
+		blob.mSize = _size;
+		return blob;
+	}
+
+	ServiceBlob& ServiceBlob::own()
+	{
+		if (!owned())
+			*this = ServiceBlob(mData, mSize);
+		return *this;
 	}
 
 	/************************************** RakService **************************************/
@@ -308,17 +2895,75 @@ namespace RakNet {
 	{
 	}
 
-	void RakService::_BeginCall(BitStream& stream, ServiceFunctionId _funcId)
+	void RakService::_BeginCall(detail::SerializationArgs& sargs, ServiceFunctionId _funcId)
 	{
+		auto& stream = sargs.stream;
+		auto* funcInfo = _GetMetaInfo()->function(_funcId);
+		sargs.metrics = _mServicePlugin->_GetFunctionMetrics(this, _funcId);
 		stream.Write(MessageID(ID_RPC_PLUGIN));
-		stream.Write(MessageID(ServiceMessageIds::SMI_INVOKE));
-		stream.Write(RakServiceId(_mServiceId));
+		if (_mGroup)
+		{
+			// members may know the service under different ids, _SendGroup writes the right one for each
+			stream.Write(MessageID(ServiceMessageIds::SMI_INVOKE));
+			stream.Write(RakServiceId(0));
+			sargs.replies = static_cast<unsigned int>(_mGroup->size());
+			sargs.group = _mGroup.get();
+		}
+		else if (_mWireVersion >= detail::WireVersion2)
+		{
+			const bool oneWay = funcInfo && funcInfo->isOneWay();
+			const unsigned char kind = oneWay ? PMK_NOTIFY : PMK_INVOKE;
+			const unsigned char inlineId = _funcId < PackedInlineFunctionIds ? _funcId : PackedInlineFunctionIds;
+			stream.Write(static_cast<unsigned char>(PackedHeaderFlag | (kind << 4) | inlineId));
+			if (inlineId == PackedInlineFunctionIds)
+				detail::WriteVarint(stream, _funcId);
+			detail::WriteVarint(stream, _mServiceId);
+			sargs.version = _mWireVersion;
+			sargs.receiver = &_mForeignAddress;
+			if (!oneWay)
+				sargs.target = &_mForeignAddress;
+			return;
+		}
+		else if (funcInfo && funcInfo->isOneWay())
+		{
+			stream.Write(MessageID(ServiceMessageIds::SMI_NOTIFY));
+			stream.WriteCompressed(RakServiceId(_mServiceId));
+		}
+		else{
+			stream.Write(MessageID(ServiceMessageIds::SMI_INVOKE));
+			stream.Write(RakServiceId(_mServiceId));
+			sargs.target = &_mForeignAddress;
+		}
 		stream.Write(_funcId);
 	}
 
-	void RakService::_EndCall(const BitStream& _stream, const SystemAddress& _address)
+	void RakService::_EndCall(BitStream& _stream, ServiceFunctionId _funcId, const SystemAddress& _address)
+	{
+		auto* funcInfo = _GetMetaInfo()->function(_funcId);
+		const RakServiceSendOptions options = funcInfo ? funcInfo->sendOptions() : RakServiceSendOptions();
+		if (auto* metrics = _mServicePlugin->_GetFunctionMetrics(this, _funcId))
+			metrics->recordCall(_stream.GetNumberOfBytesUsed());
+		if (_mGroup)
+			_mServicePlugin->_SendGroup(_stream, *_mGroup, options);
+		else{
+			detail::WindowedCall call;
+			call.meta = _GetMetaInfo();
+			call.sid = _mServiceId;
+			call.fid = _funcId;
+			_mServicePlugin->_EndCall(_stream, _address, options, call);
+		}
+	}
+
+	const SystemAddress& RakService::InvokeOrigin() const
+	{
+		auto* context = detail::InvocationScope::Current();
+		return context && context->service == this ? context->origin : UNASSIGNED_SYSTEM_ADDRESS;
+	}
+
+	detail::ReturnSlotId RakService::InvokeCallId() const
 	{
-		_mServicePlugin->_EndCall(_stream, _address);
+		auto* context = detail::InvocationScope::Current();
+		return context && context->service == this ? context->call : 0;
 	}
 
 	bool RakService::_IsForeignService() const
@@ -0,0 +1,193 @@
+#include <algorithm>
+#include "RakServiceMetrics.hpp"
+#include "RakService.hpp"
+
+namespace RakNet {
+
+	unsigned int RakServiceHistogram::BucketOf(std::uint64_t _value)
+	{
+		if (_value < SubBuckets)
+			return static_cast<unsigned int>(_value);
+		if (_value > 0xFFFFFFFFu)
+			return BucketCount - 1;
+
+		unsigned int msb = 0;
+		while (_value >> (msb + 1))
+			++msb;
+		// the SubBucketBits bits below the highest one pick the step within its power of two
+		const unsigned int step = static_cast<unsigned int>(_value >> (msb - SubBucketBits)) & (SubBuckets - 1);
+		return (msb - SubBucketBits + 1) * SubBuckets + step;
+	}
+
+	std::uint64_t RakServiceHistogram::BucketLow(unsigned int _bucket)
+	{
+		const unsigned int octave = _bucket / SubBuckets;
+		const unsigned int step = _bucket % SubBuckets;
+		if (octave == 0)
+			return step;
+		return std::uint64_t(SubBuckets + step) << (octave - 1);
+	}
+
+	std::uint64_t RakServiceHistogram::BucketHigh(unsigned int _bucket)
+	{
+		return _bucket + 1 < BucketCount ? BucketLow(_bucket + 1) - 1 : 0xFFFFFFFFu;
+	}
+
+	std::uint64_t RakServiceHistogram::percentile(double _percentile) const
+	{
+		if (!mCount)
+			return 0;
+
+		const double wanted = _percentile <= 0.0 ? 1.0 : (_percentile >= 100.0 ? double(mCount) : double(mCount) * _percentile / 100.0);
+		std::uint64_t seen = 0;
+		for (unsigned int i = 0; i < BucketCount; ++i)
+		{
+			seen += mBuckets[i];
+			if (double(seen) >= wanted)
+				return std::min(BucketHigh(i), mMax);
+		}
+		return mMax;
+	}
+
+	namespace {
+
+		void WriteLabels(std::ostream& _out, const RakServiceFunctionMetrics& _function)
+		{
+			_out << "{service=\"" << _function.service << "\",function=\"" << _function.function << "\"";
+		}
+
+		void WriteCounter(std::ostream& _out, const char* _name, const RakServiceMetricsSnapshot& _snapshot, std::uint64_t RakServiceFunctionMetrics::*_value)
+		{
+			_out << "# TYPE " << _name << " counter\n";
+			for (auto& function : _snapshot.functions)
+			{
+				_out << _name;
+				WriteLabels(_out, function);
+				_out << "} " << function.*_value << "\n";
+			}
+		}
+
+		void WriteSummary(std::ostream& _out, const char* _name, const RakServiceMetricsSnapshot& _snapshot, RakServiceHistogram RakServiceFunctionMetrics::*_histogram)
+		{
+			static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+			_out << "# TYPE " << _name << " summary\n";
+			for (auto& function : _snapshot.functions)
+			{
+				const RakServiceHistogram& histogram = function.*_histogram;
+				if (!histogram.count())
+					continue;
+
+				for (double quantile : quantiles)
+				{
+					_out << _name;
+					WriteLabels(_out, function);
+					_out << ",quantile=\"" << quantile << "\"} " << double(histogram.percentile(quantile * 100.0)) / 1e6 << "\n";
+				}
+				_out << _name << "_sum";
+				WriteLabels(_out, function);
+				_out << "} " << double(histogram.sum()) / 1e6 << "\n";
+				_out << _name << "_count";
+				WriteLabels(_out, function);
+				_out << "} " << histogram.count() << "\n";
+			}
+		}
+	}
+
+	void WriteMetricsText(std::ostream& _out, const RakServiceMetricsSnapshot& _snapshot)
+	{
+		WriteCounter(_out, "rakservice_calls_total", _snapshot, &RakServiceFunctionMetrics::calls);
+		WriteCounter(_out, "rakservice_returns_total", _snapshot, &RakServiceFunctionMetrics::returns);
+		WriteCounter(_out, "rakservice_sent_bytes_total", _snapshot, &RakServiceFunctionMetrics::bytesSent);
+		WriteCounter(_out, "rakservice_handled_total", _snapshot, &RakServiceFunctionMetrics::handled);
+		WriteCounter(_out, "rakservice_received_bytes_total", _snapshot, &RakServiceFunctionMetrics::bytesReceived);
+		WriteSummary(_out, "rakservice_round_trip_seconds", _snapshot, &RakServiceFunctionMetrics::roundTrip);
+		WriteSummary(_out, "rakservice_handler_seconds", _snapshot, &RakServiceFunctionMetrics::handlerTime);
+	}
+
+	namespace detail {
+
+		AtomicHistogram::AtomicHistogram()
+			: mCount(0)
+			, mSum(0)
+			, mMax(0)
+		{
+			for (auto& bucket : mBuckets)
+				bucket.store(0, std::memory_order_relaxed);
+		}
+
+		void AtomicHistogram::record(std::uint64_t _value)
+		{
+			mBuckets[RakServiceHistogram::BucketOf(_value)].fetch_add(1, std::memory_order_relaxed);
+			mCount.fetch_add(1, std::memory_order_relaxed);
+			mSum.fetch_add(_value, std::memory_order_relaxed);
+
+			std::uint64_t max = mMax.load(std::memory_order_relaxed);
+			while (_value > max && !mMax.compare_exchange_weak(max, _value, std::memory_order_relaxed))
+			{
+			}
+		}
+
+		void AtomicHistogram::copyTo(RakServiceHistogram& _histogram) const
+		{
+			// not a consistent cut while calls are recorded, the count is taken from the buckets so it matches them
+			_histogram.mCount = 0;
+			for (unsigned int i = 0; i < RakServiceHistogram::BucketCount; ++i)
+			{
+				_histogram.mBuckets[i] = mBuckets[i].load(std::memory_order_relaxed);
+				_histogram.mCount += _histogram.mBuckets[i];
+			}
+			_histogram.mSum = mSum.load(std::memory_order_relaxed);
+			_histogram.mMax = mMax.load(std::memory_order_relaxed);
+		}
+
+		FunctionMetrics::FunctionMetrics()
+			: mCalls(0)
+			, mReturns(0)
+			, mBytesSent(0)
+			, mHandled(0)
+			, mBytesReceived(0)
+		{
+		}
+
+		bool FunctionMetrics::copyTo(RakServiceFunctionMetrics& _metrics) const
+		{
+			_metrics.calls = mCalls.load(std::memory_order_relaxed);
+			_metrics.returns = mReturns.load(std::memory_order_relaxed);
+			_metrics.bytesSent = mBytesSent.load(std::memory_order_relaxed);
+			_metrics.handled = mHandled.load(std::memory_order_relaxed);
+			_metrics.bytesReceived = mBytesReceived.load(std::memory_order_relaxed);
+			if (!_metrics.calls && !_metrics.handled)
+				return false;
+
+			mRoundTrip.copyTo(_metrics.roundTrip);
+			mHandlerTime.copyTo(_metrics.handlerTime);
+			return true;
+		}
+
+		ServiceMetrics::ServiceMetrics(const RakServiceMetaInfo* _info)
+			: mInfo(_info)
+			, mCount(0)
+		{
+			// function ids index the meta info's functions
+			for (auto& function : _info->functions())
+				mCount = std::max<std::size_t>(mCount, std::size_t(function.id()) + 1);
+			mFunctions.reset(new FunctionMetrics[mCount]);
+		}
+
+		void ServiceMetrics::copyTo(RakServiceMetricsSnapshot& _snapshot) const
+		{
+			for (auto& function : mInfo->functions())
+			{
+				RakServiceFunctionMetrics metrics;
+				if (!mFunctions[function.id()].copyTo(metrics))
+					continue;
+
+				metrics.service = mInfo->name();
+				metrics.function = function.name();
+				metrics.id = function.id();
+				_snapshot.functions.push_back(std::move(metrics));
+			}
+		}
+	}
+}
@@ -0,0 +1,319 @@
+#include "RakServiceSharedMemory.hpp"
+
+#if defined(__linux__)
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+namespace RakNet {
+
+#if defined(__linux__)
+
+	namespace detail {
+
+		static_assert(sizeof(std::atomic<std::uint32_t>) == sizeof(std::uint32_t) && ATOMIC_INT_LOCK_FREE == 2, "futexes need plain 32 bit atomics");
+
+		static const std::uint32_t SharedSegmentMagic = 0x52534C4B;
+		// frames start at multiples of it, so a frame's length never wraps around the end of the ring
+		static const std::uint32_t SharedFrameAlignment = 8;
+		// length of a frame that tells the reader to continue at the start of the ring
+		static const std::uint32_t SharedWrapMarker = 0xFFFFFFFFu;
+
+		// Written by one process and read by the other. head and tail count all bytes ever written and
+		// read, they wrap around at 2^32 together with the capacity, which is a power of two.
+		struct SharedRing
+		{
+			alignas(64) std::atomic<std::uint32_t> head;
+			alignas(64) std::atomic<std::uint32_t> tail;
+			// set while the reader sleeps on head
+			alignas(64) std::atomic<std::uint32_t> sleeping;
+			// set once the writer destroyed its end
+			std::atomic<std::uint32_t> closed;
+			std::uint32_t capacity;
+
+			inline unsigned char* data() { return reinterpret_cast<unsigned char*>(this + 1); }
+		};
+
+		struct SharedSegment
+		{
+			// written last by the creator, a segment without it is not ready
+			std::atomic<std::uint32_t> magic;
+			std::uint32_t ringBytes;
+
+			inline SharedRing* ring(unsigned int _index)
+			{
+				unsigned char* base = reinterpret_cast<unsigned char*>(this) + RingOffset;
+				return reinterpret_cast<SharedRing*>(base + _index * (sizeof(SharedRing) + ringBytes));
+			}
+
+			static const std::size_t RingOffset = 64;
+		};
+
+		static inline std::uint32_t FrameSize(std::uint32_t _length)
+		{
+			return (sizeof(std::uint32_t) + _length + SharedFrameAlignment - 1) & ~(SharedFrameAlignment - 1);
+		}
+
+		static inline std::size_t SegmentSize(std::uint32_t _ringBytes)
+		{
+			return SharedSegment::RingOffset + 2 * (sizeof(SharedRing) + _ringBytes);
+		}
+
+		static inline std::string SegmentName(const std::string& _name)
+		{
+			return _name.empty() || _name[0] != '/' ? "/" + _name : _name;
+		}
+
+		static void FutexWake(std::atomic<std::uint32_t>& _word)
+		{
+			// not FUTEX_PRIVATE_FLAG, the waiter is another process
+			syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&_word), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+		}
+
+		static void FutexWait(std::atomic<std::uint32_t>& _word, std::uint32_t _expected, unsigned int _timeoutMs)
+		{
+			timespec timeout;
+			timeout.tv_sec = _timeoutMs / 1000;
+			timeout.tv_nsec = long(_timeoutMs % 1000) * 1000000;
+			syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&_word), FUTEX_WAIT, _expected, &timeout, nullptr, 0);
+		}
+	}
+
+	std::unique_ptr<RakServiceSharedMemoryLink> RakServiceSharedMemoryLink::Create(const std::string& _name, std::uint32_t _ringBytes, bool _replace)
+	{
+		std::uint32_t ringBytes = 64;
+		while (ringBytes < _ringBytes && ringBytes < (1u << 31))
+			ringBytes <<= 1;
+
+		const std::string name = detail::SegmentName(_name);
+		if (_replace)
+			shm_unlink(name.c_str());
+		const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+		if (fd < 0)
+			return nullptr;
+
+		const std::size_t size = detail::SegmentSize(ringBytes);
+		void* memory = ftruncate(fd, off_t(size)) == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+		close(fd);
+		if (memory == MAP_FAILED)
+		{
+			shm_unlink(name.c_str());
+			return nullptr;
+		}
+
+		auto* segment = new (memory) detail::SharedSegment();
+		segment->ringBytes = ringBytes;
+		for (unsigned int i = 0; i < 2; ++i)
+		{
+			auto* ring = new (segment->ring(i)) detail::SharedRing();
+			ring->head.store(0, std::memory_order_relaxed);
+			ring->tail.store(0, std::memory_order_relaxed);
+			ring->sleeping.store(0, std::memory_order_relaxed);
+			ring->closed.store(0, std::memory_order_relaxed);
+			ring->capacity = ringBytes;
+		}
+		segment->magic.store(detail::SharedSegmentMagic, std::memory_order_release);
+
+		return std::unique_ptr<RakServiceSharedMemoryLink>(new RakServiceSharedMemoryLink(name, segment, size, true));
+	}
+
+	std::unique_ptr<RakServiceSharedMemoryLink> RakServiceSharedMemoryLink::Open(const std::string& _name)
+	{
+		const std::string name = detail::SegmentName(_name);
+		const int fd = shm_open(name.c_str(), O_RDWR, 0600);
+		if (fd < 0)
+			return nullptr;
+
+		struct stat info;
+		void* memory = MAP_FAILED;
+		std::size_t size = 0;
+		if (fstat(fd, &info) == 0 && std::size_t(info.st_size) >= detail::SegmentSize(64))
+		{
+			size = std::size_t(info.st_size);
+			memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		}
+		close(fd);
+		if (memory == MAP_FAILED)
+			return nullptr;
+
+		auto* segment = static_cast<detail::SharedSegment*>(memory);
+		if (segment->magic.load(std::memory_order_acquire) != detail::SharedSegmentMagic || detail::SegmentSize(segment->ringBytes) != size)
+		{
+			munmap(memory, size);
+			return nullptr;
+		}
+
+		return std::unique_ptr<RakServiceSharedMemoryLink>(new RakServiceSharedMemoryLink(name, segment, size, false));
+	}
+
+	RakServiceSharedMemoryLink::RakServiceSharedMemoryLink(const std::string& _name, detail::SharedSegment* _segment, std::size_t _size, bool _creator)
+		: mName(_name)
+		, mSegment(_segment)
+		, mSize(_size)
+		, mCreator(_creator)
+		, mOutgoing(_segment->ring(_creator ? 0 : 1))
+		, mIncoming(_segment->ring(_creator ? 1 : 0))
+		, mCapacity(_segment->ringBytes)
+		, mBroken(false)
+		, mPeeked(0)
+	{
+	}
+
+	RakServiceSharedMemoryLink::~RakServiceSharedMemoryLink()
+	{
+		mOutgoing->closed.store(1, std::memory_order_seq_cst);
+		if (mOutgoing->sleeping.load(std::memory_order_seq_cst))
+			detail::FutexWake(mOutgoing->head);
+
+		munmap(mSegment, mSize);
+		if (mCreator)
+			shm_unlink(mName.c_str());
+	}
+
+	bool RakServiceSharedMemoryLink::send(const unsigned char* _data, std::uint32_t _length)
+	{
+		if (_length > maxMessageSize())
+			return false;
+
+		auto& ring = *mOutgoing;
+		const std::uint32_t frame = detail::FrameSize(_length);
+		std::uint32_t head = ring.head.load(std::memory_order_relaxed);
+		const std::uint32_t tail = ring.tail.load(std::memory_order_acquire);
+		std::uint32_t offset = head & (mCapacity - 1);
+		const std::uint32_t toEnd = mCapacity - offset;
+
+		// frames are never split, one that does not fit before the end starts over at the beginning
+		const std::uint32_t needed = toEnd < frame ? toEnd + frame : frame;
+		if (head - tail > mCapacity || needed > mCapacity - (head - tail))
+			return false;
+
+		if (toEnd < frame)
+		{
+			std::memcpy(ring.data() + offset, &detail::SharedWrapMarker, sizeof(std::uint32_t));
+			head += toEnd;
+			offset = 0;
+		}
+
+		std::memcpy(ring.data() + offset, &_length, sizeof(std::uint32_t));
+		std::memcpy(ring.data() + offset + sizeof(std::uint32_t), _data, _length);
+		ring.head.store(head + frame, std::memory_order_seq_cst);
+
+		if (ring.sleeping.load(std::memory_order_seq_cst))
+			detail::FutexWake(ring.head);
+		return true;
+	}
+
+	std::uint32_t RakServiceSharedMemoryLink::maxMessageSize() const
+	{
+		// with half the ring a frame always fits once the reader caught up, wherever the head is
+		return mCapacity / 2 - sizeof(std::uint32_t);
+	}
+
+	bool RakServiceSharedMemoryLink::peek(const unsigned char*& _data, std::uint32_t& _length)
+	{
+		auto& ring = *mIncoming;
+		std::uint32_t tail = ring.tail.load(std::memory_order_relaxed);
+		const std::uint32_t head = ring.head.load(std::memory_order_acquire);
+		if (mBroken || head == tail)
+			return false;
+		if (head - tail > mCapacity)
+		{
+			mBroken = true;
+			return false;
+		}
+
+		std::uint32_t offset = tail & (mCapacity - 1);
+		std::uint32_t length = 0;
+		std::memcpy(&length, ring.data() + offset, sizeof(std::uint32_t));
+		if (length == detail::SharedWrapMarker)
+		{
+			tail += mCapacity - offset;
+			if (head - tail > mCapacity)
+			{
+				mBroken = true;
+				return false;
+			}
+			ring.tail.store(tail, std::memory_order_release);
+			if (head == tail)
+				return false;
+			offset = 0;
+			std::memcpy(&length, ring.data(), sizeof(std::uint32_t));
+		}
+
+		// the peer's frame has to lie within what it published and within the ring
+		if (length > mCapacity || detail::FrameSize(length) > head - tail || offset + detail::FrameSize(length) > mCapacity)
+		{
+			mBroken = true;
+			return false;
+		}
+
+		_data = ring.data() + offset + sizeof(std::uint32_t);
+		_length = length;
+		mPeeked = detail::FrameSize(length);
+		return true;
+	}
+
+	void RakServiceSharedMemoryLink::pop()
+	{
+		if (!mPeeked)
+			return;
+
+		auto& ring = *mIncoming;
+		ring.tail.store(ring.tail.load(std::memory_order_relaxed) + mPeeked, std::memory_order_release);
+		mPeeked = 0;
+	}
+
+	bool RakServiceSharedMemoryLink::wait(unsigned int _timeoutMs)
+	{
+		auto& ring = *mIncoming;
+		const std::uint32_t tail = ring.tail.load(std::memory_order_relaxed);
+		if (ring.head.load(std::memory_order_acquire) != tail)
+			return true;
+
+		// the writer checks sleeping after it moved head, so either it sees the flag or we see its head
+		ring.sleeping.store(1, std::memory_order_seq_cst);
+		const std::uint32_t head = ring.head.load(std::memory_order_seq_cst);
+		if (head == tail && !ring.closed.load(std::memory_order_seq_cst))
+			detail::FutexWait(ring.head, head, _timeoutMs);
+		ring.sleeping.store(0, std::memory_order_relaxed);
+
+		return ring.head.load(std::memory_order_acquire) != tail;
+	}
+
+	bool RakServiceSharedMemoryLink::isPeerClosed() const
+	{
+		return mBroken || mIncoming->closed.load(std::memory_order_acquire) != 0;
+	}
+
+#else
+
+	std::unique_ptr<RakServiceSharedMemoryLink> RakServiceSharedMemoryLink::Create(const std::string&, std::uint32_t, bool)
+	{
+		return nullptr;
+	}
+
+	std::unique_ptr<RakServiceSharedMemoryLink> RakServiceSharedMemoryLink::Open(const std::string&)
+	{
+		return nullptr;
+	}
+
+	// no link can be created, so none of these is ever called
+	RakServiceSharedMemoryLink::~RakServiceSharedMemoryLink() {}
+	bool RakServiceSharedMemoryLink::send(const unsigned char*, std::uint32_t) { return false; }
+	std::uint32_t RakServiceSharedMemoryLink::maxMessageSize() const { return 0; }
+	bool RakServiceSharedMemoryLink::peek(const unsigned char*&, std::uint32_t&) { return false; }
+	void RakServiceSharedMemoryLink::pop() {}
+	bool RakServiceSharedMemoryLink::wait(unsigned int) { return false; }
+	bool RakServiceSharedMemoryLink::isPeerClosed() const { return true; }
+
+#endif
+}
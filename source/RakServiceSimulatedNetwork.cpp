@@ -0,0 +1,301 @@
+#include <algorithm>
+#include "RakServiceSimulatedNetwork.hpp"
+
+namespace RakNet {
+
+	static const std::uint32_t NoPeer = 0xFFFFFFFFu;
+
+	class RakServiceSimulatedNetwork::Peer : public RakServiceTransport
+	{
+	public:
+		inline Peer(RakServiceSimulatedNetwork& _network, std::uint32_t _index, RakServicePlugin* _plugin, const SystemAddress& _address)
+			: network(_network)
+			, index(_index)
+			, plugin(_plugin)
+			, address(_address)
+			, guid(std::uint64_t(_index) + 1)
+		{
+		}
+
+		virtual void Send(const BitStream& _stream, const AddressOrGUID& _target, const RakServiceSendOptions& _options) override
+		{
+			network._Send(index, _stream, _target, _options);
+		}
+
+		virtual SystemAddress GetSystemAddressFromGuid(const RakNetGUID& _guid) const override
+		{
+			// guids are the peer's index plus one
+			const std::uint64_t peer = _guid.g - 1;
+			return peer < network.mPeers.size() ? network.mPeers[std::size_t(peer)]->address : UNASSIGNED_SYSTEM_ADDRESS;
+		}
+
+		// deadlines run on the virtual clock
+		virtual std::uint64_t GetTimeUS() const override
+		{
+			return network.mNow;
+		}
+
+		RakServiceSimulatedNetwork& network;
+		const std::uint32_t index;
+		RakServicePlugin* const plugin;
+		const SystemAddress address;
+		const RakNetGUID guid;
+	};
+
+	RakServiceSimulatedNetwork::RakServiceSimulatedNetwork(std::uint64_t _seed)
+		: mNow(0)
+		, mNextUpdate(1000)
+		, mUpdateInterval(1000)
+		, mNextSequence(0)
+		, mRandom(_seed)
+	{
+	}
+
+	RakServiceSimulatedNetwork::~RakServiceSimulatedNetwork()
+	{
+	}
+
+	void RakServiceSimulatedNetwork::AddPeer(RakServicePlugin* _plugin, const SystemAddress& _address)
+	{
+		RakAssert(_plugin && _FindPeer(_address) == NoPeer);
+		const std::uint32_t index = static_cast<std::uint32_t>(mPeers.size());
+		mPeers.emplace_back(new Peer(*this, index, _plugin, _address));
+		mPeerIndex.emplace(_address, index);
+		_plugin->SetTransport(mPeers.back().get());
+	}
+
+	RakNetGUID RakServiceSimulatedNetwork::GetGuid(const SystemAddress& _address) const
+	{
+		const std::uint32_t peer = _FindPeer(_address);
+		return peer == NoPeer ? UNASSIGNED_RAKNET_GUID : mPeers[peer]->guid;
+	}
+
+	void RakServiceSimulatedNetwork::SetDefaultConditions(const LinkConditions& _conditions)
+	{
+		mDefaultConditions = _conditions;
+	}
+
+	void RakServiceSimulatedNetwork::SetConditions(const SystemAddress& _from, const SystemAddress& _to, const LinkConditions& _conditions)
+	{
+		const std::uint32_t from = _FindPeer(_from);
+		const std::uint32_t to = _FindPeer(_to);
+		RakAssert(from != NoPeer && to != NoPeer);
+		auto& link = _GetLink(from, to);
+		link.conditions = _conditions;
+		link.custom = true;
+	}
+
+	void RakServiceSimulatedNetwork::Disconnect(const SystemAddress& _a, const SystemAddress& _b)
+	{
+		const std::uint32_t a = _FindPeer(_a);
+		const std::uint32_t b = _FindPeer(_b);
+		RakAssert(a != NoPeer && b != NoPeer);
+		auto& there = _GetLink(a, b);
+		auto& back = _GetLink(b, a);
+		if (there.disconnected)
+			return;
+
+		for (Link* link : { &there, &back })
+		{
+			link->disconnected = true;
+			++link->epoch;
+			link->busyUntil = 0;
+			std::fill(std::begin(link->orderedUntil), std::end(link->orderedUntil), 0);
+		}
+
+		mPeers[a]->plugin->OnClosedConnection(mPeers[b]->address, mPeers[b]->guid, LCR_CONNECTION_LOST);
+		mPeers[b]->plugin->OnClosedConnection(mPeers[a]->address, mPeers[a]->guid, LCR_CONNECTION_LOST);
+	}
+
+	void RakServiceSimulatedNetwork::Reconnect(const SystemAddress& _a, const SystemAddress& _b)
+	{
+		const std::uint32_t a = _FindPeer(_a);
+		const std::uint32_t b = _FindPeer(_b);
+		RakAssert(a != NoPeer && b != NoPeer);
+		_GetLink(a, b).disconnected = false;
+		_GetLink(b, a).disconnected = false;
+	}
+
+	void RakServiceSimulatedNetwork::Advance(std::uint64_t _micros)
+	{
+		const std::uint64_t end = mNow + _micros;
+		for (;;)
+		{
+			const bool deliver = !mInFlight.empty() && mInFlight.top().deliverAt <= mNextUpdate;
+			const std::uint64_t next = deliver ? mInFlight.top().deliverAt : mNextUpdate;
+			if (next > end)
+				break;
+			mNow = next;
+
+			// handlers may send with no latency, those messages are delivered in this round as well
+			mReceivers.clear();
+			while (!mInFlight.empty() && mInFlight.top().deliverAt == mNow)
+			{
+				// only the order of the queue depends on the key, the payload can be moved out before pop()
+				Message message = std::move(const_cast<Message&>(mInFlight.top()));
+				mInFlight.pop();
+
+				const auto& link = _GetLink(message.from, message.to);
+				if (link.disconnected || link.epoch != message.epoch)
+				{
+					++mStats.dropped;
+					continue;
+				}
+
+				++mStats.delivered;
+				mPeers[message.to]->plugin->HandleMessage(mPeers[message.from]->address, message.data.data(), static_cast<unsigned int>(message.data.size()));
+				mReceivers.push_back(message.to);
+			}
+
+			if (mNow == mNextUpdate)
+			{
+				mNextUpdate += mUpdateInterval;
+				_UpdateAll();
+				continue;
+			}
+
+			std::sort(mReceivers.begin(), mReceivers.end());
+			mReceivers.erase(std::unique(mReceivers.begin(), mReceivers.end()), mReceivers.end());
+			for (std::uint32_t peer : mReceivers)
+				mPeers[peer]->plugin->Update();
+		}
+		mNow = end;
+	}
+
+	bool RakServiceSimulatedNetwork::RunUntilIdle(std::uint64_t _maxMicros)
+	{
+		const std::uint64_t limit = mNow + _maxMicros;
+
+		// sends the application queued or batched since the last update
+		_UpdateAll();
+		for (;;)
+		{
+			std::uint64_t next = 0;
+			if (!mInFlight.empty())
+			{
+				next = mInFlight.top().deliverAt;
+			}
+			else{
+				const bool transferring = std::any_of(mPeers.begin(), mPeers.end(), [](const std::unique_ptr<Peer>& _peer)
+				{
+					return _peer->plugin->GetPendingTransferCount() > 0;
+				});
+				if (!transferring)
+					return true;
+				next = mNextUpdate;
+			}
+
+			if (next > limit)
+			{
+				Advance(limit - mNow);
+				return false;
+			}
+			Advance(next - mNow);
+		}
+	}
+
+	void RakServiceSimulatedNetwork::_Send(std::uint32_t _from, const BitStream& _stream, const AddressOrGUID& _target, const RakServiceSendOptions& _options)
+	{
+		const unsigned int length = _stream.GetNumberOfBytesUsed();
+		++mStats.sent;
+		mStats.bytes += length;
+
+		std::uint32_t to = NoPeer;
+		if (_target.systemAddress != UNASSIGNED_SYSTEM_ADDRESS)
+			to = _FindPeer(_target.systemAddress);
+		else if (_target.rakNetGuid != UNASSIGNED_RAKNET_GUID && _target.rakNetGuid.g - 1 < mPeers.size())
+			to = static_cast<std::uint32_t>(_target.rakNetGuid.g - 1);
+		if (to == NoPeer || to == _from)
+		{
+			++mStats.dropped;
+			return;
+		}
+
+		auto& link = _GetLink(_from, to);
+		if (link.disconnected)
+		{
+			++mStats.dropped;
+			return;
+		}
+
+		const LinkConditions& conditions = link.custom ? link.conditions : mDefaultConditions;
+		std::uint64_t deliverAt = mNow;
+		if (conditions.bandwidth > 0)
+		{
+			// messages queue up behind each other on the sender's side of the link
+			link.busyUntil = std::max(link.busyUntil, mNow) + (std::uint64_t(length) * 1000000 + conditions.bandwidth - 1) / conditions.bandwidth;
+			deliverAt = link.busyUntil;
+		}
+		deliverAt += conditions.latency;
+		if (conditions.jitter > 0)
+			deliverAt += _Random() % (conditions.jitter + 1);
+
+		const PacketReliability reliability = _options.reliability;
+		const bool reliable = reliability != UNRELIABLE && reliability != UNRELIABLE_SEQUENCED && reliability != UNRELIABLE_WITH_ACK_RECEIPT;
+		const bool ordered = reliability == RELIABLE_ORDERED || reliability == RELIABLE_ORDERED_WITH_ACK_RECEIPT
+			|| reliability == RELIABLE_SEQUENCED || reliability == UNRELIABLE_SEQUENCED;
+
+		if (conditions.loss > 0.0)
+		{
+			unsigned int resends = 0;
+			while (_RandomUnit() < conditions.loss)
+			{
+				if (!reliable || resends == MaxResends)
+				{
+					++mStats.dropped;
+					return;
+				}
+				// the sender notices after a round trip without an ack
+				++resends;
+				deliverAt += 2 * conditions.latency + conditions.jitter;
+			}
+			mStats.resent += resends;
+		}
+
+		if (ordered)
+		{
+			auto& previous = link.orderedUntil[static_cast<unsigned char>(_options.channel) % 32];
+			deliverAt = std::max(deliverAt, previous);
+			previous = deliverAt;
+		}
+
+		Message message;
+		message.deliverAt = deliverAt;
+		message.sequence = mNextSequence++;
+		message.from = _from;
+		message.to = to;
+		message.epoch = link.epoch;
+		message.data.assign(_stream.GetData(), _stream.GetData() + length);
+		mInFlight.push(std::move(message));
+	}
+
+	RakServiceSimulatedNetwork::Link& RakServiceSimulatedNetwork::_GetLink(std::uint32_t _from, std::uint32_t _to)
+	{
+		return mLinks[std::uint64_t(_from) << 32 | _to];
+	}
+
+	std::uint32_t RakServiceSimulatedNetwork::_FindPeer(const SystemAddress& _address) const
+	{
+		auto it = mPeerIndex.find(_address);
+		return it == mPeerIndex.end() ? NoPeer : it->second;
+	}
+
+	std::uint64_t RakServiceSimulatedNetwork::_Random()
+	{
+		std::uint64_t z = (mRandom += 0x9E3779B97F4A7C15ull);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+
+	double RakServiceSimulatedNetwork::_RandomUnit()
+	{
+		return double(_Random() >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+	void RakServiceSimulatedNetwork::_UpdateAll()
+	{
+		for (auto& peer : mPeers)
+			peer->plugin->Update();
+	}
+}
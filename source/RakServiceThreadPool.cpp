@@ -0,0 +1,157 @@
+#include "RakServiceThreadPool.hpp"
+
+namespace RakNet {
+
+	RakServiceThreadPool::RakServiceThreadPool(unsigned int _threads, std::size_t _strands)
+		: mQueuedStrands(0)
+		, mNextWorker(0)
+		, mStopping(false)
+	{
+		if (_threads == 0)
+			_threads = 1;
+		RakAssert(_strands > 0);
+
+		mStrands.reserve(_strands);
+		for (std::size_t i = 0; i < _strands; ++i)
+			mStrands.emplace_back(new Strand());
+
+		mWorkers.reserve(_threads);
+		for (unsigned int i = 0; i < _threads; ++i)
+			mWorkers.emplace_back(new Worker());
+
+		mThreads.reserve(_threads);
+		for (unsigned int i = 0; i < _threads; ++i)
+			mThreads.emplace_back(&RakServiceThreadPool::_Run, this, i);
+	}
+
+	RakServiceThreadPool::~RakServiceThreadPool()
+	{
+		Stop();
+	}
+
+	void RakServiceThreadPool::Dispatch(std::size_t _strand, Task _task)
+	{
+		auto* strand = mStrands[_strand % mStrands.size()].get();
+		bool schedule = false;
+		{
+			std::lock_guard<std::mutex> lock(strand->mutex);
+			strand->tasks.push_back(std::move(_task));
+			if (!strand->scheduled)
+			{
+				strand->scheduled = true;
+				schedule = true;
+			}
+		}
+
+		if (schedule)
+			_Schedule(strand, mNextWorker++ % mWorkers.size());
+	}
+
+	void RakServiceThreadPool::Stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mSleepMutex);
+			mStopping = true;
+		}
+		mWakeUp.notify_all();
+
+		for (auto& thread : mThreads)
+		{
+			if (thread.joinable())
+				thread.join();
+		}
+		mThreads.clear();
+	}
+
+	void RakServiceThreadPool::_Run(std::size_t _worker)
+	{
+		while (true)
+		{
+			if (auto* strand = _NextStrand(_worker))
+			{
+				_RunStrand(strand, _worker);
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(mSleepMutex);
+			mWakeUp.wait(lock, [this] { return mStopping || mQueuedStrands > 0; });
+			if (mStopping && mQueuedStrands == 0)
+				return;
+		}
+	}
+
+	void RakServiceThreadPool::_Schedule(Strand* _strand, std::size_t _worker)
+	{
+		{
+			// counted before it is published, so a worker that takes it right away never counts below zero.
+			// Taking the lock makes sure no worker misses the wake up between its check and its wait
+			std::lock_guard<std::mutex> lock(mSleepMutex);
+			++mQueuedStrands;
+		}
+
+		{
+			auto& worker = *mWorkers[_worker];
+			std::lock_guard<std::mutex> lock(worker.mutex);
+			worker.strands.push_back(_strand);
+		}
+		mWakeUp.notify_one();
+	}
+
+	RakServiceThreadPool::Strand* RakServiceThreadPool::_NextStrand(std::size_t _worker)
+	{
+		const std::size_t count = mWorkers.size();
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			// own queue first, then steal from the others
+			auto& worker = *mWorkers[(_worker + i) % count];
+			std::lock_guard<std::mutex> lock(worker.mutex);
+			if (worker.strands.empty())
+				continue;
+
+			Strand* strand;
+			if (i == 0)
+			{
+				strand = worker.strands.front();
+				worker.strands.pop_front();
+			}
+			else{
+				strand = worker.strands.back();
+				worker.strands.pop_back();
+			}
+			--mQueuedStrands;
+			return strand;
+		}
+		return nullptr;
+	}
+
+	void RakServiceThreadPool::_RunStrand(Strand* _strand, std::size_t _worker)
+	{
+		for (unsigned int i = 0; i < TasksPerTurn; ++i)
+		{
+			Task task;
+			{
+				std::lock_guard<std::mutex> lock(_strand->mutex);
+				if (_strand->tasks.empty())
+				{
+					_strand->scheduled = false;
+					return;
+				}
+				task = std::move(_strand->tasks.front());
+				_strand->tasks.pop_front();
+			}
+			task();
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(_strand->mutex);
+			if (_strand->tasks.empty())
+			{
+				_strand->scheduled = false;
+				return;
+			}
+		}
+
+		// give other strands a chance, this one stays scheduled and keeps its order
+		_Schedule(_strand, _worker);
+	}
+}
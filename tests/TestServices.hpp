@@ -0,0 +1,16 @@
+#pragma once
+#include "RakService.hpp"
+
+// The services rakservice-tests calls across RakServiceSimulatedNetwork
+RAK_SERVICE(Counter)
+{
+	virtual void add(int _value, RakNet::ServiceCallback<void(int)> _done) = 0;
+	RAK_ONEWAY virtual void note(int _value) = 0;
+	// other send options than note, so batches are split between them
+	RAK_ONEWAY RAK_SEND_OPTIONS(MEDIUM_PRIORITY, RELIABLE_ORDERED) virtual void urgent(int _value) = 0;
+};
+
+RAK_SERVICE(Storage)
+{
+	virtual void put(RakNet::ServiceBlob _data, RakNet::ServiceCallback<void(unsigned int)> _done) = 0;
+};
@@ -0,0 +1,724 @@
+// rakservice-tests runs RakServicePlugins on a RakServiceSimulatedNetwork and checks what the peers
+// see: the order of batched messages, nested batches and truncated messages, group calls, calls that
+// expire when their peer disconnects, version 1 and 2 peers talking to each other, the limits on
+// streamed blobs and the call windows. It also checks the return slot table, the timer wheel, the
+// strands of RakServiceThreadPool, the shared memory ring and the histogram buckets on their own.
+// It prints every failed check and exits with 1 if there was one.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include "MessageIdentifiers.h"
+
+#include "RakServiceAsync.hpp"
+#include "RakServiceMetrics.hpp"
+#include "RakServiceSharedMemory.hpp"
+#include "RakServiceSimulatedNetwork.hpp"
+#include "RakServiceThreadPool.hpp"
+#include "TestServices.hpp"
+
+using namespace RakNet;
+
+namespace {
+
+	int gFailures = 0;
+
+#define TEST_CHECK(_condition) \
+	do \
+	{ \
+		if (!(_condition)) \
+		{ \
+			std::printf("%s:%d: %s failed\n", __FUNCTION__, __LINE__, #_condition); \
+			++gFailures; \
+		} \
+	} while (false)
+
+	class CounterImpl : public Counter
+	{
+	public:
+		virtual void add(int _value, ServiceCallback<void(int)> _done) override
+		{
+			seen.push_back(_value);
+			if (hold)
+				held.push_back(std::move(_done));
+			else
+				_done(_value + 1);
+		}
+
+		virtual void note(int _value) override
+		{
+			seen.push_back(_value);
+		}
+
+		virtual void urgent(int _value) override
+		{
+			seen.push_back(_value);
+		}
+
+		// answers the oldest held calls
+		void release(std::size_t _count)
+		{
+			for (std::size_t i = 0; i < _count && !held.empty(); ++i)
+			{
+				auto done = std::move(held.front());
+				held.erase(held.begin());
+				done(0);
+			}
+		}
+
+		bool hold = false;
+		std::vector<int> seen;
+		std::vector<ServiceCallback<void(int)>> held;
+	};
+
+	class StorageImpl : public Storage
+	{
+	public:
+		virtual void put(ServiceBlob _data, ServiceCallback<void(unsigned int)> _done) override
+		{
+			sizes.push_back(_data.size());
+			_done(static_cast<unsigned int>(_data.size()));
+		}
+
+		std::vector<std::size_t> sizes;
+	};
+
+	// a server with Counter and Storage and a client connected to both
+	struct Scenario
+	{
+		explicit Scenario(unsigned char _serverVersion = 2, unsigned char _clientVersion = 2)
+			: serverAddress("10.0.0.1", 1)
+			, clientAddress("10.0.0.2", 2)
+		{
+			server.SetWireVersion(_serverVersion);
+			client.SetWireVersion(_clientVersion);
+			network.AddPeer(&server, serverAddress);
+			network.AddPeer(&client, clientAddress);
+			server.AddService("counter", &counter);
+			server.AddService("storage", &storage);
+			client.ConnectService<Counter>("counter", serverAddress, [this](Counter* _counter) { counterProxy = _counter; });
+			client.ConnectService<Storage>("storage", serverAddress, [this](Storage* _storage) { storageProxy = _storage; });
+			network.RunUntilIdle();
+		}
+
+		CounterImpl counter;
+		StorageImpl storage;
+		RakServicePlugin server;
+		RakServicePlugin client;
+		RakServiceSimulatedNetwork network;
+		SystemAddress serverAddress;
+		SystemAddress clientAddress;
+		Counter* counterProxy = nullptr;
+		Storage* storageProxy = nullptr;
+	};
+
+	void TestBatchingKeepsOrder()
+	{
+		for (unsigned char version = 1; version <= 2; ++version)
+		{
+			Scenario scenario(version, version);
+			TEST_CHECK(scenario.counterProxy);
+			scenario.client.SetBatching(true, 200);
+
+			// runs of calls with different send options, which must not be reordered by their batches
+			std::vector<int> expected;
+			int answers = 0;
+			for (int i = 0; i < 300; ++i)
+			{
+				if (i % 7 == 0)
+					scenario.counterProxy->add(i, [&](int) { ++answers; });
+				else if ((i / 3) % 2)
+					scenario.counterProxy->urgent(i);
+				else
+					scenario.counterProxy->note(i);
+				expected.push_back(i);
+			}
+			const auto sent = scenario.network.GetStats().sent;
+			scenario.network.RunUntilIdle();
+			TEST_CHECK(scenario.counter.seen == expected);
+			TEST_CHECK(answers == 43);
+			// runs with the same options still share their batches
+			TEST_CHECK(scenario.network.GetStats().sent - sent < 200);
+		}
+	}
+
+	void TestNestedBatchesIgnored()
+	{
+		Scenario scenario;
+		TEST_CHECK(scenario.counterProxy);
+
+		// 20000 batches, each the only entry of the one around it, with an empty batch innermost
+		const unsigned char BatchMessage = 5;
+		const unsigned int depth = 20000;
+		std::vector<unsigned char> message(1, ID_RPC_PLUGIN);
+		for (unsigned int i = 0; i < depth; ++i)
+		{
+			BitStream entry;
+			entry.Write(MessageID(BatchMessage));
+			entry.Write(static_cast<unsigned short>(1 + 3 * (depth - 1 - i)));
+			message.insert(message.end(), entry.GetData(), entry.GetData() + entry.GetNumberOfBytesUsed());
+		}
+		message.push_back(BatchMessage);
+		scenario.server.HandleMessage(scenario.clientAddress, message.data(), static_cast<unsigned int>(message.size()));
+
+		int answer = 0;
+		scenario.counterProxy->add(1, [&](int _value) { answer = _value; });
+		scenario.network.RunUntilIdle();
+		TEST_CHECK(answer == 2);
+	}
+
+	void TestTruncatedMessages()
+	{
+		Scenario scenario;
+		TEST_CHECK(scenario.counterProxy);
+
+		// connect, invoke and notify headers that end early are dropped
+		const unsigned char ConnectMessage = 1;
+		const unsigned char InvokeMessage = 3;
+		const unsigned char NotifyMessage = 6;
+		const unsigned char truncated[][3] = {
+			{ ID_RPC_PLUGIN, ConnectMessage, 0 },
+			{ ID_RPC_PLUGIN, InvokeMessage, 2 },
+			{ ID_RPC_PLUGIN, NotifyMessage, 0 },
+		};
+		const auto sent = scenario.network.GetStats().sent;
+		for (const auto& message : truncated)
+			scenario.server.HandleMessage(scenario.clientAddress, message, sizeof(message));
+		scenario.network.RunUntilIdle();
+		TEST_CHECK(scenario.counter.seen.empty());
+		TEST_CHECK(scenario.network.GetStats().sent == sent);
+	}
+
+	// a server connected to the Counter of every client, the last client gives it another service id
+	struct GroupScenario
+	{
+		explicit GroupScenario(std::size_t _memberCount)
+			: serverAddress("10.0.0.1", 1)
+		{
+			network.AddPeer(&server, serverAddress);
+			for (std::size_t i = 0; i < _memberCount; ++i)
+			{
+				const SystemAddress address = memberAddress(i);
+				clients.emplace_back(new RakServicePlugin());
+				counters.emplace_back(new CounterImpl());
+				network.AddPeer(clients.back().get(), address);
+				if (i + 1 == _memberCount)
+					clients.back()->AddService("other", &other);
+				clients.back()->AddService("counter", counters.back().get());
+				server.ConnectService<Counter>("counter", address, [this](Counter* _counter) { members.push_back(_counter); });
+			}
+			network.RunUntilIdle();
+		}
+
+		static SystemAddress memberAddress(std::size_t _member)
+		{
+			return SystemAddress("10.0.0.2", static_cast<unsigned short>(10 + _member));
+		}
+
+		RakServiceSimulatedNetwork network;
+		RakServicePlugin server;
+		SystemAddress serverAddress;
+		std::vector<std::unique_ptr<RakServicePlugin>> clients;
+		std::vector<std::unique_ptr<CounterImpl>> counters;
+		std::vector<Counter*> members;
+		CounterImpl other;
+	};
+
+	void TestGroupCallsKeepOrder()
+	{
+		const std::size_t memberCount = 4;
+		GroupScenario scenario(memberCount);
+		scenario.server.SetBatching(true, 200);
+		TEST_CHECK(scenario.members.size() == memberCount);
+
+		auto group = scenario.server.MakeGroup(scenario.members);
+		int answers = 0;
+		scenario.members[0]->note(1);
+		group->note(2);
+		group->add(3, [&](int) { ++answers; });
+		scenario.members[0]->note(4);
+		scenario.network.RunUntilIdle();
+		TEST_CHECK(scenario.counters[0]->seen == std::vector<int>({ 1, 2, 3, 4 }));
+		for (std::size_t i = 1; i < memberCount; ++i)
+			TEST_CHECK(scenario.counters[i]->seen == std::vector<int>({ 2, 3 }));
+		TEST_CHECK(answers == int(memberCount));
+		TEST_CHECK(scenario.server.GetPendingReturnCount() == 0);
+	}
+
+#ifdef RAKSERVICE_COROUTINES
+	struct DetachedTask
+	{
+		struct promise_type
+		{
+			DetachedTask get_return_object() { return DetachedTask(); }
+			std::suspend_never initial_suspend() { return{}; }
+			std::suspend_never final_suspend() noexcept { return{}; }
+			void return_void() {}
+			void unhandled_exception() { std::terminate(); }
+		};
+	};
+
+	DetachedTask AwaitAdd(Counter* _counter, int& _result)
+	{
+		try
+		{
+			_result = co_await CallAsync(_counter, &Counter::add, 1);
+		}
+		catch (const RakServiceCallExpired&)
+		{
+			_result = -1;
+		}
+	}
+#endif
+
+	void TestDisconnectExpiresCalls()
+	{
+		Scenario scenario;
+		TEST_CHECK(scenario.counterProxy);
+		scenario.counter.hold = true;
+
+		auto future = CallFuture(scenario.counterProxy, &Counter::add, 1);
+		int expired = 0;
+		scenario.counterProxy->add(2, OnExpired([](int) {}, [&]() { ++expired; }));
+#ifdef RAKSERVICE_COROUTINES
+		int awaited = 0;
+		AwaitAdd(scenario.counterProxy, awaited);
+#endif
+		scenario.network.RunUntilIdle();
+		TEST_CHECK(scenario.client.GetPendingReturnCount() > 0);
+
+		scenario.network.Disconnect(scenario.serverAddress, scenario.clientAddress);
+		TEST_CHECK(expired == 1);
+		TEST_CHECK(scenario.client.GetPendingReturnCount() == 0);
+		TEST_CHECK(future.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+		bool threw = false;
+		try
+		{
+			future.get();
+		}
+		catch (const RakServiceCallExpired&)
+		{
+			threw = true;
+		}
+		TEST_CHECK(threw);
+#ifdef RAKSERVICE_COROUTINES
+		TEST_CHECK(awaited == -1);
+#endif
+	}
+
+	void TestGroupCallsAnswerOnce()
+	{
+		GroupScenario scenario(3);
+		TEST_CHECK(scenario.members.size() == 3);
+		auto group = scenario.server.MakeGroup(scenario.members);
+		scenario.server.SetCallTimeout(100);
+
+		// futures and coroutines take the first answer, other callbacks get every one and never expire after it
+		for (int held = 0; held <= 1; ++held)
+		{
+			scenario.counters[0]->hold = held != 0;
+			auto future = CallFuture(group.get(), &Counter::add, 1);
+#ifdef RAKSERVICE_COROUTINES
+			int awaited = 0;
+			AwaitAdd(group.get(), awaited);
+#endif
+			int answers = 0;
+			int expired = 0;
+			group->add(1, OnExpired([&](int) { ++answers; }, [&]() { ++expired; }));
+			int plainAnswers = 0;
+			group->add(1, [&](int) { ++plainAnswers; });
+			scenario.network.RunUntilIdle();
+			scenario.network.Advance(200 * 1000);
+			TEST_CHECK(future.get() == 2);
+#ifdef RAKSERVICE_COROUTINES
+			TEST_CHECK(awaited == 2);
+#endif
+			TEST_CHECK(answers == 3 - held && expired == 0);
+			TEST_CHECK(plainAnswers == 3 - held);
+			TEST_CHECK(scenario.server.GetPendingReturnCount() == 0);
+		}
+
+		// without any answer they expire once
+		for (auto& counter : scenario.counters)
+			counter->hold = true;
+		auto future = CallFuture(group.get(), &Counter::add, 1);
+		int expired = 0;
+		group->add(1, OnExpired([](int) {}, [&]() { ++expired; }));
+		scenario.network.RunUntilIdle();
+		scenario.network.Advance(200 * 1000);
+		TEST_CHECK(expired == 1);
+		bool threw = false;
+		try
+		{
+			future.get();
+		}
+		catch (const RakServiceCallExpired&)
+		{
+			threw = true;
+		}
+		TEST_CHECK(threw);
+	}
+
+	void TestGroupCallsLoseMembers()
+	{
+		GroupScenario scenario(3);
+		TEST_CHECK(scenario.members.size() == 3);
+		auto group = scenario.server.MakeGroup(scenario.members);
+
+		// a member that disconnects before it answers is not waited for
+		scenario.counters[0]->hold = true;
+		int answers = 0;
+		int expired = 0;
+		group->add(1, OnExpired([&](int) { ++answers; }, [&]() { ++expired; }));
+		scenario.network.RunUntilIdle();
+		TEST_CHECK(answers == 2 && scenario.server.GetPendingReturnCount() == 1);
+		scenario.network.Disconnect(scenario.serverAddress, GroupScenario::memberAddress(0));
+		TEST_CHECK(expired == 0 && scenario.server.GetPendingReturnCount() == 0);
+
+		// the call expires once the last member that could answer is gone
+		auto rest = scenario.server.MakeGroup(std::vector<Counter*>({ scenario.members[1], scenario.members[2] }));
+		scenario.counters[1]->hold = true;
+		scenario.counters[2]->hold = true;
+		rest->add(1, OnExpired([&](int) { ++answers; }, [&]() { ++expired; }));
+		scenario.network.RunUntilIdle();
+		scenario.network.Disconnect(scenario.serverAddress, GroupScenario::memberAddress(1));
+		TEST_CHECK(expired == 0 && scenario.server.GetPendingReturnCount() == 1);
+		scenario.network.Disconnect(scenario.serverAddress, GroupScenario::memberAddress(2));
+		TEST_CHECK(answers == 2 && expired == 1 && scenario.server.GetPendingReturnCount() == 0);
+	}
+
+	void TestWireVersionInterop()
+	{
+		for (unsigned char serverVersion = 1; serverVersion <= 2; ++serverVersion)
+		{
+			for (unsigned char clientVersion = 1; clientVersion <= 2; ++clientVersion)
+			{
+				Scenario scenario(serverVersion, clientVersion);
+				TEST_CHECK(scenario.counterProxy);
+				if (!scenario.counterProxy)
+					continue;
+
+				int sum = 0;
+				for (int i = 0; i < 100; ++i)
+					scenario.counterProxy->add(i, [&](int _value) { sum += _value; });
+				scenario.network.RunUntilIdle();
+				TEST_CHECK(sum == 5050);
+
+				// version 1 return slots are 16 bits, so at most 4095 calls wait at once
+				const bool compact = serverVersion == 1 || clientVersion == 1;
+				scenario.counter.hold = true;
+				int expired = 0;
+				for (int i = 0; i < 4100; ++i)
+					scenario.counterProxy->add(i, OnExpired([](int) {}, [&]() { ++expired; }));
+				scenario.network.RunUntilIdle();
+				TEST_CHECK(expired == (compact ? 5 : 0));
+				scenario.counter.release(scenario.counter.held.size());
+				scenario.network.RunUntilIdle();
+				TEST_CHECK(scenario.client.GetPendingReturnCount() == 0);
+			}
+		}
+	}
+
+	void TestChunkReassemblyLimits()
+	{
+		Scenario scenario;
+		TEST_CHECK(scenario.storageProxy);
+		scenario.client.SetStreaming(true, 4096, 1, 64 * 1024);
+		scenario.server.SetMaxPendingBlobBytes(100000);
+
+		// the first blob is over the limit and arrives empty, the next one fits
+		std::vector<unsigned char> large(200000, 1);
+		std::vector<unsigned char> small(50000, 2);
+		int answers = 0;
+		scenario.storageProxy->put(ServiceBlob(large.data(), large.size()), [&](unsigned int) { ++answers; });
+		scenario.storageProxy->put(ServiceBlob(small.data(), small.size()), [&](unsigned int) { ++answers; });
+		scenario.network.RunUntilIdle();
+		TEST_CHECK(answers == 2);
+		TEST_CHECK(scenario.storage.sizes == std::vector<std::size_t>({ 0, 50000 }));
+
+		// a peer that starts many blobs announcing 64 MiB each and never finishes them; the server
+		// must neither allocate the announced sizes nor keep more than a bounded number of them open
+		const unsigned char ChunkMessage = 7;
+		for (unsigned int id = 1000; id < 1200; ++id)
+		{
+			BitStream chunk;
+			chunk.Write(MessageID(ID_RPC_PLUGIN));
+			chunk.Write(MessageID(ChunkMessage));
+			chunk.Write(id);
+			chunk.Write(64u * 1024 * 1024);
+			chunk.Write(0u);
+			const unsigned char data[16] = {};
+			chunk.WriteAlignedBytes(data, sizeof(data));
+			scenario.server.HandleMessage(scenario.clientAddress, chunk.GetData(), chunk.GetNumberOfBytesUsed());
+		}
+
+		// with its open blobs used up, the peer's next streamed blob is dropped
+		scenario.storage.sizes.clear();
+		scenario.storageProxy->put(ServiceBlob(small.data(), small.size()), [&](unsigned int) { ++answers; });
+		scenario.network.RunUntilIdle();
+		TEST_CHECK(answers == 3);
+		TEST_CHECK(scenario.storage.sizes == std::vector<std::size_t>({ 0 }));
+	}
+
+	void TestCallWindows()
+	{
+		Scenario scenario;
+		TEST_CHECK(scenario.counterProxy);
+		std::vector<bool> congestion;
+		scenario.client.SetCongestionHandler([&](const SystemAddress&, bool _congested) { congestion.push_back(_congested); });
+		scenario.counter.hold = true;
+
+		// QUEUE: calls over the window wait and go out in order
+		RakServiceCallWindow window;
+		window.maxInFlight = 3;
+		scenario.client.SetCallWindow(window);
+		int answers = 0;
+		int expired = 0;
+		for (int i = 0; i < 10; ++i)
+			scenario.counterProxy->add(i, OnExpired([&](int) { ++answers; }, [&]() { ++expired; }));
+		scenario.network.RunUntilIdle();
+		TEST_CHECK(scenario.counter.held.size() == 3);
+		TEST_CHECK(scenario.client.GetQueuedCallCount() == 7);
+		TEST_CHECK(congestion == std::vector<bool>({ true }));
+		while (!scenario.counter.held.empty())
+		{
+			scenario.counter.release(1);
+			scenario.network.RunUntilIdle();
+			TEST_CHECK(scenario.client.GetPeerLoad(scenario.serverAddress).inFlight <= 3);
+		}
+		TEST_CHECK(answers == 10 && expired == 0);
+		TEST_CHECK(scenario.counter.seen == std::vector<int>({ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 }));
+		TEST_CHECK(congestion == std::vector<bool>({ true, false }));
+
+		// REJECT: calls over the window expire right away, nothing is held back
+		scenario.counter.seen.clear();
+		congestion.clear();
+		answers = 0;
+		window.policy = RakServiceWindowPolicy::REJECT;
+		scenario.client.SetCallWindow(window);
+		for (int i = 0; i < 5; ++i)
+			scenario.counterProxy->add(i, OnExpired([&](int) { ++answers; }, [&]() { ++expired; }));
+		TEST_CHECK(expired == 2);
+		TEST_CHECK(scenario.client.GetPeerLoad(scenario.serverAddress).rejected == 2);
+		TEST_CHECK(congestion.empty() && !scenario.client.GetPeerLoad(scenario.serverAddress).congested);
+		scenario.network.RunUntilIdle();
+		scenario.counter.release(3);
+		scenario.network.RunUntilIdle();
+		TEST_CHECK(answers == 3 && scenario.counter.seen.size() == 3);
+
+		// COALESCE: a held back call of the same function is replaced by the newer one
+		scenario.counter.seen.clear();
+		answers = 0;
+		expired = 0;
+		window.policy = RakServiceWindowPolicy::COALESCE;
+		window.maxInFlight = 1;
+		scenario.client.SetCallWindow(window);
+		for (int i = 0; i < 6; ++i)
+			scenario.counterProxy->add(i, OnExpired([&](int) { ++answers; }, [&]() { ++expired; }));
+		TEST_CHECK(scenario.client.GetPeerLoad(scenario.serverAddress).queued == 1);
+		TEST_CHECK(scenario.client.GetPeerLoad(scenario.serverAddress).coalesced == 4);
+		TEST_CHECK(expired == 4);
+		for (int i = 0; i < 2; ++i)
+		{
+			scenario.network.RunUntilIdle();
+			scenario.counter.release(1);
+		}
+		scenario.network.RunUntilIdle();
+		TEST_CHECK(answers == 2);
+		TEST_CHECK(scenario.counter.seen == std::vector<int>({ 0, 5 }));
+		TEST_CHECK(scenario.client.GetPendingReturnCount() == 0);
+	}
+	void TestReturnSlotReuse()
+	{
+		typedef detail::ReturnSlotTable Table;
+		detail::TimerWheel timers;
+		Table table(timers);
+		auto slot = []() { return detail::ReturnSlot([](detail::DeserializationArgs&) {}); };
+		detail::ReturnSlot taken;
+		bool more = false;
+
+		// a reused slot gets a new generation, the old id does not reach its callback
+		const detail::ReturnSlotId first = table.add(slot(), 1, 0, nullptr, 0, true);
+		TEST_CHECK(table.take(first, taken, more) && !more);
+		const detail::ReturnSlotId second = table.add(slot(), 1, 0, nullptr, 0, true);
+		TEST_CHECK((second & Table::IndexMask) == (first & Table::IndexMask) && second != first);
+		TEST_CHECK(!table.isPending(first) && table.isPending(second));
+		TEST_CHECK(!table.take(first, taken, more));
+
+		// compact ids fit 16 bits and name their slot as long as it is pending
+		TEST_CHECK(Table::compact(second) <= 0xFFFF);
+		TEST_CHECK(table.wireId(second) == Table::compact(second));
+		TEST_CHECK(table.expand(Table::compact(second)) == second);
+		TEST_CHECK(table.expand(Table::compact(first)) == Table::InvalidId);
+
+		// once every compact index is taken compact slots fail and others get the indices above
+		while (table.size() < Table::CompactCapacity)
+			TEST_CHECK(table.add(slot(), 1, 0, nullptr, 0, true) != Table::InvalidId);
+		detail::ReturnSlot refused = slot();
+		TEST_CHECK(table.add(std::move(refused), 1, 0, nullptr, 0, true) == Table::InvalidId && refused);
+		const detail::ReturnSlotId wide = table.add(slot());
+		TEST_CHECK((wide & Table::IndexMask) >= Table::CompactCapacity && table.wireId(wide) == wide);
+
+		// a slot's timer leaves the wheel with the slot
+		const detail::ReturnSlotId timed = table.add(slot(), 1, 0, nullptr, 50);
+		table.setTimer(timed, timers.schedule(timed, 50, 0));
+		TEST_CHECK(timers.size() == 1);
+		TEST_CHECK(table.take(timed, taken, more) && timers.size() == 0);
+	}
+
+	void TestTimerWheelCascade()
+	{
+		detail::TimerWheel wheel;
+		std::vector<detail::TimerWheel::Timer> due;
+		// the edges of every level, and one beyond the last
+		const std::uint64_t deadlines[] = { 1, 63, 64, 65, 4095, 4096, 4097, 262143, 262144, 262145, 16777215, 16777216, 16777217, 40000000 };
+		detail::ReturnSlotId id = 0;
+		for (std::uint64_t deadline : deadlines)
+			wheel.schedule(++id, deadline, 0);
+		const unsigned int cancelled = wheel.schedule(100, 5000, 0);
+		wheel.cancel(cancelled);
+		TEST_CHECK(wheel.size() == id);
+
+		// every timer is due at its deadline, not a tick earlier
+		id = 0;
+		for (std::uint64_t deadline : deadlines)
+		{
+			++id;
+			due.clear();
+			wheel.advance(deadline - 1, due);
+			TEST_CHECK(due.empty());
+			wheel.advance(deadline, due);
+			TEST_CHECK(due.size() == 1 && due[0].id == id && due[0].deadline == deadline);
+		}
+		TEST_CHECK(wheel.size() == 0);
+
+		// a deadline that passed already is due with the next tick
+		due.clear();
+		wheel.schedule(1, 10, 40000000);
+		wheel.advance(40000001, due);
+		TEST_CHECK(due.size() == 1 && due[0].id == 1);
+	}
+
+	void TestThreadPoolStrandOrder()
+	{
+		const std::size_t strands = 8;
+		const int tasks = 2000;
+		std::vector<std::vector<int>> runs(strands);
+		RakServiceThreadPool pool(4, strands);
+		for (int i = 0; i < tasks; ++i)
+		{
+			for (std::size_t strand = 0; strand < strands; ++strand)
+			{
+				std::vector<int>* run = &runs[strand];
+				pool.Dispatch(strand, [run, i]() { run->push_back(i); });
+			}
+		}
+		pool.Stop();
+
+		for (const auto& run : runs)
+		{
+			bool ordered = run.size() == std::size_t(tasks);
+			for (int i = 0; ordered && i < tasks; ++i)
+				ordered = run[i] == i;
+			TEST_CHECK(ordered);
+		}
+	}
+
+	void TestSharedMemoryRingWrap()
+	{
+		auto creator = RakServiceSharedMemoryLink::Create("rakservice-tests-ring", 256, true);
+		if (!creator)
+			return;
+		auto opener = RakServiceSharedMemoryLink::Open("rakservice-tests-ring");
+		TEST_CHECK(opener);
+		if (!opener)
+			return;
+
+		// messages of every size up to the largest, sent until the ring is full, go round it many times
+		std::vector<unsigned char> message(creator->maxMessageSize());
+		unsigned int sent = 0;
+		unsigned int received = 0;
+		bool intact = true;
+		while (received < 2000 && intact)
+		{
+			for (;;)
+			{
+				const std::uint32_t length = 1 + sent % creator->maxMessageSize();
+				for (std::uint32_t i = 0; i < length; ++i)
+					message[i] = static_cast<unsigned char>(sent + i);
+				if (!creator->send(message.data(), length))
+					break;
+				++sent;
+			}
+
+			const unsigned char* data = nullptr;
+			std::uint32_t length = 0;
+			while (opener->peek(data, length))
+			{
+				intact = intact && length == 1 + received % creator->maxMessageSize();
+				for (std::uint32_t i = 0; intact && i < length; ++i)
+					intact = data[i] == static_cast<unsigned char>(received + i);
+				opener->pop();
+				++received;
+			}
+			intact = intact && received == sent;
+		}
+		TEST_CHECK(intact);
+		TEST_CHECK(!opener->isPeerClosed());
+	}
+
+	void TestHistogramBuckets()
+	{
+		typedef RakServiceHistogram Histogram;
+		TEST_CHECK(Histogram::BucketOf(0) == 0);
+		TEST_CHECK(Histogram::BucketOf(Histogram::SubBuckets - 1) == Histogram::SubBuckets - 1);
+		TEST_CHECK(Histogram::BucketOf(Histogram::SubBuckets) == Histogram::SubBuckets);
+		TEST_CHECK(Histogram::BucketOf(0xFFFFFFFFu) == Histogram::BucketCount - 1);
+		TEST_CHECK(Histogram::BucketOf(1ull << 40) == Histogram::BucketCount - 1);
+
+		// the buckets cover every value once, each within 1/SubBuckets of its low edge
+		bool edges = Histogram::BucketLow(0) == 0 && Histogram::BucketHigh(Histogram::BucketCount - 1) == 0xFFFFFFFFu;
+		for (unsigned int bucket = 0; edges && bucket < Histogram::BucketCount; ++bucket)
+		{
+			const std::uint64_t low = Histogram::BucketLow(bucket);
+			const std::uint64_t high = Histogram::BucketHigh(bucket);
+			edges = low <= high && Histogram::BucketOf(low) == bucket && Histogram::BucketOf(high) == bucket
+				&& (high - low) * Histogram::SubBuckets <= std::max<std::uint64_t>(low, Histogram::SubBuckets)
+				&& (bucket + 1 == Histogram::BucketCount || Histogram::BucketLow(bucket + 1) == high + 1);
+		}
+		TEST_CHECK(edges);
+	}
+
+}
+
+int main()
+{
+	TestBatchingKeepsOrder();
+	TestNestedBatchesIgnored();
+	TestTruncatedMessages();
+	TestGroupCallsKeepOrder();
+	TestDisconnectExpiresCalls();
+	TestGroupCallsAnswerOnce();
+	TestGroupCallsLoseMembers();
+	TestWireVersionInterop();
+	TestChunkReassemblyLimits();
+	TestCallWindows();
+	TestReturnSlotReuse();
+	TestTimerWheelCascade();
+	TestThreadPoolStrandOrder();
+	TestSharedMemoryRingWrap();
+	TestHistogramBuckets();
+
+	if (gFailures)
+	{
+		std::printf("%d checks failed\n", gFailures);
+		return 1;
+	}
+	std::printf("all checks passed\n");
+	return 0;
+}